@@ -4,6 +4,7 @@
 #include <vector>
 #include <sstream>
 #include <cstdint>
+#include <span>
 
 #include <glm/glm.hpp>
 
@@ -70,6 +71,20 @@ namespace bsp
         
         ArrayLength firstFace;
         ArrayLength numFaces;
+        
+        //where this leaf's compressed row starts in visData
+        ArrayLength visOffset;
+    };
+    
+    //an opening between two leaves that you could see through
+    struct Portal
+    {
+        ArrayLength firstVertex;
+        ArrayLength numVertices;
+        
+        //the portal's plane faces into the front leaf
+        ArrayLength frontLeaf;
+        ArrayLength backLeaf;
     };
     
     struct File
@@ -88,9 +103,31 @@ namespace bsp
         
         std::vector<Node> nodes;
         std::vector<Leaf> leaves;
+        
+        std::vector<glm::vec3> portalVertices;
+        std::vector<Portal> portals;
+        
+        //a row of bits for each leaf, with a bit set for every other leaf that might be seen from it
+        //runs of zero bytes are stored as a zero followed by how many there are
+        //empty if the map has no visibility info, in which case every leaf can see every other leaf
+        std::vector<uint8_t> visData;
     };
     
     File parseBspFile(std::string_view bspFileName, std::stringstream& bspFileStream);
     
     void writeFile(std::string_view bspFileName, File& bspFile);
+    
+    //the leaf this point ends up in
+    ArrayLength findLeaf(const File& bspFile, glm::vec3 point);
+    
+    //how many bytes each leaf's row of visData takes up once decompressed
+    size_t getVisRowBytes(const File& bspFile);
+    
+    void compressVisRow(std::span<const uint8_t> visRow, std::vector<uint8_t>& outCompressed);
+    
+    //everything is visible if the map has no visibility info
+    void decompressVisRow(const File& bspFile, ArrayLength leaf, std::vector<uint8_t>& outVisRow);
+    
+    //takes a row from decompressVisRow
+    bool isLeafVisible(std::span<const uint8_t> visRow, ArrayLength leaf);
 }
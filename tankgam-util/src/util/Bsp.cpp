@@ -2,11 +2,12 @@
 
 #include <fstream>
 #include <sstream>
+#include <limits>
 
 #include <fmt/format.h>
 
 static constexpr uint8_t MAJOR_VERSION = 0;
-static constexpr uint16_t MINOR_VERSION = 1;
+static constexpr uint16_t MINOR_VERSION = 3;
 static constexpr uint8_t PATCH_VERSION = 0;
 static constexpr std::string_view FILE_MAGIC_NUMBER = "STMF";
 
@@ -101,6 +102,8 @@ bsp::File bsp::parseBspFile(std::string_view bspFileName, std::stringstream& fil
     
     bsp::File bspFile;
     
+    uint16_t fileMinorVersion = 0;
+    
     {
         std::string mapFormat;
         mapFormat.resize(4);
@@ -111,10 +114,10 @@ bsp::File bsp::parseBspFile(std::string_view bspFileName, std::stringstream& fil
         }
         
         const uint8_t fileMajorVersion = readNumber_u8();
-        const uint8_t fileMinorVersion = readNumber_u16();
+        fileMinorVersion = readNumber_u16();
         const uint8_t filePatchVersion = readNumber_u8();
         //todo: convert from old map file version when we reach stable versioning
-        if (fileMajorVersion != MAJOR_VERSION || fileMinorVersion != MINOR_VERSION)
+        if (fileMajorVersion != MAJOR_VERSION || fileMinorVersion > MINOR_VERSION)
         {
             throw std::runtime_error(fmt::format("Map {} has incompatible version of {}.{}, when we want at least {}.{}",
                                                  bspFileName.data(),
@@ -265,9 +268,59 @@ bsp::File bsp::parseBspFile(std::string_view bspFileName, std::stringstream& fil
             leaf.firstFace = readNumber_u32();
             leaf.numFaces = readNumber_u32();
             
+            if (fileMinorVersion >= 3)
+            {
+                leaf.visOffset = readNumber_u32();
+            }
+            
             bspFile.leaves.push_back(leaf);
         }
     }
+    //maps before 0.3 don't have portals or visibility info, so everything can see everything
+    if (fileMinorVersion >= 3)
+    {
+        const bsp::ArrayLength numPortalVertices = readNumber_AL();
+        
+        for (bsp::ArrayLength i = 0; i < numPortalVertices; i++)
+        {
+            bspFile.portalVertices.push_back(readVertex());
+        }
+    }
+    if (fileMinorVersion >= 3)
+    {
+        const bsp::ArrayLength numPortals = readNumber_AL();
+        
+        for (bsp::ArrayLength i = 0; i < numPortals; i++)
+        {
+            bsp::Portal portal{};
+            
+            portal.firstVertex = readNumber_u32();
+            portal.numVertices = readNumber_u32();
+            
+            portal.frontLeaf = readNumber_u32();
+            portal.backLeaf = readNumber_u32();
+            
+            bspFile.portals.push_back(portal);
+        }
+    }
+    if (fileMinorVersion >= 3)
+    {
+        const bsp::ArrayLength visDataLength = readNumber_AL();
+        
+        bspFile.visData.resize(visDataLength);
+        file.read(reinterpret_cast<char*>(bspFile.visData.data()), visDataLength);
+        
+        if (!bspFile.visData.empty())
+        {
+            for (const bsp::Leaf& leaf : bspFile.leaves)
+            {
+                if (leaf.visOffset >= visDataLength)
+                {
+                    throw std::runtime_error(fmt::format("Map {} has a leaf with visibility info past the end of the lump", bspFileName.data()));
+                }
+            }
+        }
+    }
     
     return bspFile;
 }
@@ -428,6 +481,125 @@ void bsp::writeFile(std::string_view bspFileName, File& bspFile)
             
             writeNumber(leaf.firstFace);
             writeNumber(leaf.numFaces);
+            
+            writeNumber(leaf.visOffset);
+        }
+    }
+    {
+        const auto portalVerticesLength = static_cast<bsp::ArrayLength>(bspFile.portalVertices.size());
+        writeNumber(portalVerticesLength);
+        
+        for (const auto& vertex : bspFile.portalVertices)
+        {
+            writeVertex(vertex);
+        }
+    }
+    {
+        const auto portalsLength = static_cast<bsp::ArrayLength>(bspFile.portals.size());
+        writeNumber(portalsLength);
+        
+        for (const auto& portal : bspFile.portals)
+        {
+            writeNumber(portal.firstVertex);
+            writeNumber(portal.numVertices);
+            
+            writeNumber(portal.frontLeaf);
+            writeNumber(portal.backLeaf);
         }
     }
+    {
+        const auto visDataLength = static_cast<bsp::ArrayLength>(bspFile.visData.size());
+        writeNumber(visDataLength);
+        
+        file.write(reinterpret_cast<const char*>(bspFile.visData.data()), visDataLength);
+    }
+}
+
+bsp::ArrayLength bsp::findLeaf(const File& bspFile, glm::vec3 point)
+{
+    if (bspFile.nodes.empty())
+    {
+        return 0;
+    }
+    
+    //children get written out before their parents, so the root is always the last node
+    int64_t index = static_cast<int64_t>(bspFile.nodes.size() - 1);
+    while (index >= 0)
+    {
+        const bsp::Node& node = bspFile.nodes[static_cast<size_t>(index)];
+        const Plane& plane = bspFile.planes[node.splitPlane];
+        
+        if (Plane::classifyPoint(plane, point) == Plane::Classification::Back)
+        {
+            index = node.backChild;
+        }
+        else
+        {
+            index = node.frontChild;
+        }
+    }
+    
+    return static_cast<bsp::ArrayLength>(-(index + 1));
+}
+
+size_t bsp::getVisRowBytes(const File& bspFile)
+{
+    return (bspFile.leaves.size() + 7) / 8;
+}
+
+void bsp::compressVisRow(std::span<const uint8_t> visRow, std::vector<uint8_t>& outCompressed)
+{
+    for (size_t i = 0; i < visRow.size(); i++)
+    {
+        outCompressed.push_back(visRow[i]);
+        if (visRow[i] != 0)
+        {
+            continue;
+        }
+        
+        //count up the rest of the zeroes
+        uint8_t numZeroes = 1;
+        while (i + 1 < visRow.size() && visRow[i + 1] == 0 && numZeroes < std::numeric_limits<uint8_t>::max())
+        {
+            numZeroes++;
+            i++;
+        }
+        
+        outCompressed.push_back(numZeroes);
+    }
+}
+
+void bsp::decompressVisRow(const File& bspFile, ArrayLength leaf, std::vector<uint8_t>& outVisRow)
+{
+    const size_t rowBytes = getVisRowBytes(bspFile);
+    
+    outVisRow.clear();
+    
+    if (bspFile.visData.empty())
+    {
+        outVisRow.resize(rowBytes, 0xFF);
+        return;
+    }
+    
+    size_t offset = bspFile.leaves[leaf].visOffset;
+    while (outVisRow.size() < rowBytes && offset < bspFile.visData.size())
+    {
+        const uint8_t byte = bspFile.visData[offset++];
+        if (byte != 0)
+        {
+            outVisRow.push_back(byte);
+            continue;
+        }
+        
+        const uint8_t numZeroes = offset < bspFile.visData.size() ? bspFile.visData[offset++] : 1;
+        outVisRow.insert(outVisRow.end(), numZeroes, 0);
+    }
+    
+    //a broken row shouldn't let us read off the end
+    outVisRow.resize(rowBytes, 0);
+}
+
+bool bsp::isLeafVisible(std::span<const uint8_t> visRow, ArrayLength leaf)
+{
+    return (visRow[leaf / 8] & (1u << (leaf % 8))) != 0;
 }
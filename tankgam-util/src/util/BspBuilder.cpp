@@ -2,6 +2,10 @@
 
 #include <algorithm>
 #include <span>
+#include <limits>
+#include <cmath>
+#include <atomic>
+#include <thread>
 
 #include "util/Bsp.h"
 
@@ -292,9 +296,9 @@ static std::unique_ptr<Node> buildNode(std::unique_ptr<ConvexPolygon> firstPolyg
     //mark polygons with similar planes as already used as a split
     for (ConvexPolygon* polygon = firstPolygon.get(); polygon; polygon = polygon->next.get())
     {
-        const bool sameNormalA = glm::dot(polygon->plane.normal, splittingPolygon->plane.normal) <= 0.01f;
+        const bool sameNormalA = glm::dot(polygon->plane.normal, splittingPolygon->plane.normal) >= 0.99f;
         const bool sameDistanceA = std::abs(polygon->plane.distance - splittingPolygon->plane.distance) <= 0.01f;
-        const bool sameNormalB = glm::dot(-polygon->plane.normal, splittingPolygon->plane.normal) <= 0.01f;
+        const bool sameNormalB = glm::dot(-polygon->plane.normal, splittingPolygon->plane.normal) >= 0.99f;
         const bool sameDistanceB = std::abs(-polygon->plane.distance - splittingPolygon->plane.distance) <= 0.01f;
         
         const bool samePlane = (sameNormalA && sameDistanceA) || (sameNormalB && sameDistanceB);
@@ -490,6 +494,620 @@ static int64_t convertNode(bsp::File& file, std::unique_ptr<Node>& node)
     }
 }
 
+//portals start out as squares this far past the edges of the map, before getting clipped down
+static constexpr float PORTAL_WINDING_MARGIN = 64.0f;
+
+//how far to either side of a portal we check for brushes when deciding if it's blocked
+//has to be more than the plane thickness or every portal on a brush face looks open
+static constexpr float PORTAL_SOLID_OFFSET = 0.05f;
+
+//how finely each triangle of a portal gets sampled when deciding if it's blocked
+static constexpr size_t PORTAL_SAMPLE_STEPS = 4;
+
+using Winding = std::vector<glm::vec3>;
+
+static Plane flipPlane(const Plane& plane)
+{
+    return Plane{ -plane.normal, -plane.distance };
+}
+
+//keeps whatever part of the winding is behind the plane
+static Winding clipWinding(const Winding& winding, const Plane& plane)
+{
+    constexpr float planeThickness = 0.01f;
+    
+    Winding clipped;
+    
+    for (size_t i = 0; i < winding.size(); i++)
+    {
+        const glm::vec3& a = winding[i];
+        const glm::vec3& b = winding[(i + 1) % winding.size()];
+        
+        const float aDistance = glm::dot(plane.normal, a) + plane.distance;
+        const float bDistance = glm::dot(plane.normal, b) + plane.distance;
+        
+        if (aDistance <= planeThickness)
+        {
+            clipped.push_back(a);
+        }
+        
+        //the edge goes right through the plane
+        if ((aDistance < -planeThickness && bDistance > planeThickness) ||
+            (aDistance > planeThickness && bDistance < -planeThickness))
+        {
+            const float t = aDistance / (aDistance - bDistance);
+            clipped.push_back(a + (b - a) * t);
+        }
+    }
+    
+    if (clipped.size() < 3)
+    {
+        return {};
+    }
+    
+    return clipped;
+}
+
+//a square big enough to cover the whole map on this plane
+static Winding makeBaseWinding(const Plane& plane, float size)
+{
+    const glm::vec3 up = std::fabs(plane.normal.y) < 0.9f ? glm::vec3{ 0.0f, 1.0f, 0.0f } : glm::vec3{ 1.0f, 0.0f, 0.0f };
+    
+    const glm::vec3 uAxis = glm::normalize(glm::cross(up, plane.normal));
+    const glm::vec3 vAxis = glm::cross(plane.normal, uAxis);
+    
+    const glm::vec3 center = plane.normal * -plane.distance;
+    const glm::vec3 u = uAxis * size;
+    const glm::vec3 v = vAxis * size;
+    
+    return { center - u - v, center + u - v, center + u + v, center - u + v };
+}
+
+struct BuildPortal
+{
+    Winding winding;
+    
+    //faces into the front leaf
+    Plane plane;
+    
+    size_t frontLeaf;
+    size_t backLeaf;
+};
+
+//split the winding down the tree, collecting the pieces along with the leaf each one lands in
+static void pushWinding(const bsp::File& file, int64_t index, Winding winding, std::vector<std::pair<size_t, Winding>>& outPieces)
+{
+    if (winding.empty())
+    {
+        return;
+    }
+    
+    if (index < 0)
+    {
+        outPieces.emplace_back(static_cast<size_t>(-(index + 1)), std::move(winding));
+        return;
+    }
+    
+    const bsp::Node& node = file.nodes[static_cast<size_t>(index)];
+    const Plane& plane = file.planes[node.splitPlane];
+    
+    //lying right on the plane, it can only go one way
+    if (Plane::classifyPoints(plane, winding) == Plane::Classification::Coincident)
+    {
+        pushWinding(file, node.frontChild, std::move(winding), outPieces);
+        return;
+    }
+    
+    pushWinding(file, node.frontChild, clipWinding(winding, flipPlane(plane)), outPieces);
+    pushWinding(file, node.backChild, clipWinding(winding, plane), outPieces);
+}
+
+//every node's plane, cut down to the node's space, then split into pieces between the leaves on either side
+static void makePortals(const bsp::File& file, int64_t index, std::vector<Plane>& cellPlanes, float windingSize, std::vector<BuildPortal>& outPortals)
+{
+    if (index < 0)
+    {
+        return;
+    }
+    
+    const bsp::Node& node = file.nodes[static_cast<size_t>(index)];
+    const Plane& plane = file.planes[node.splitPlane];
+    
+    Winding winding = makeBaseWinding(plane, windingSize);
+    for (const Plane& cellPlane : cellPlanes)
+    {
+        winding = clipWinding(winding, cellPlane);
+    }
+    
+    std::vector<std::pair<size_t, Winding>> frontPieces;
+    pushWinding(file, node.frontChild, std::move(winding), frontPieces);
+    
+    for (auto& [frontLeaf, frontPiece] : frontPieces)
+    {
+        std::vector<std::pair<size_t, Winding>> pieces;
+        pushWinding(file, node.backChild, std::move(frontPiece), pieces);
+        
+        for (auto& [backLeaf, piece] : pieces)
+        {
+            outPortals.push_back(BuildPortal{ std::move(piece), plane, frontLeaf, backLeaf });
+        }
+    }
+    
+    //the cell planes keep whatever is behind them
+    cellPlanes.push_back(flipPlane(plane));
+    makePortals(file, node.frontChild, cellPlanes, windingSize, outPortals);
+    
+    cellPlanes.back() = plane;
+    makePortals(file, node.backChild, cellPlanes, windingSize, outPortals);
+    
+    cellPlanes.pop_back();
+}
+
+static bool isPointInBrush(std::span<const std::vector<Plane>> brushPlanes, glm::vec3 point)
+{
+    return std::any_of(brushPlanes.begin(), brushPlanes.end(), [point](const std::vector<Plane>& planes)
+    {
+        return std::all_of(planes.begin(), planes.end(), [point](const Plane& plane)
+        {
+            return Plane::classifyPoint(plane, point) == Plane::Classification::Back;
+        });
+    });
+}
+
+//a portal is open if anywhere on it has empty space on both sides
+static bool isPortalOpen(const BuildPortal& portal, std::span<const std::vector<Plane>> brushPlanes)
+{
+    glm::vec3 center{ 0.0f };
+    for (const glm::vec3& vertex : portal.winding)
+    {
+        center += vertex;
+    }
+    center /= static_cast<float>(portal.winding.size());
+    
+    const glm::vec3 offset = portal.plane.normal * PORTAL_SOLID_OFFSET;
+    
+    //sample across each triangle fanning out from the center, pulled in a little from the edges
+    constexpr float edgeShrink = 0.98f;
+    for (size_t i = 0; i < portal.winding.size(); i++)
+    {
+        const glm::vec3 toA = (portal.winding[i] - center) * edgeShrink;
+        const glm::vec3 toB = (portal.winding[(i + 1) % portal.winding.size()] - center) * edgeShrink;
+        
+        for (size_t a = 0; a <= PORTAL_SAMPLE_STEPS; a++)
+        {
+            for (size_t b = 0; a + b <= PORTAL_SAMPLE_STEPS; b++)
+            {
+                const float aWeight = static_cast<float>(a) / static_cast<float>(PORTAL_SAMPLE_STEPS);
+                const float bWeight = static_cast<float>(b) / static_cast<float>(PORTAL_SAMPLE_STEPS);
+                const glm::vec3 point = center + toA * aWeight + toB * bWeight;
+                
+                if (!isPointInBrush(brushPlanes, point + offset) && !isPointInBrush(brushPlanes, point - offset))
+                {
+                    return true;
+                }
+            }
+        }
+    }
+    
+    return false;
+}
+
+static bool testBit(const std::vector<uint8_t>& bits, size_t index)
+{
+    return (bits[index / 8] & (1u << (index % 8))) != 0;
+}
+
+static void setBit(std::vector<uint8_t>& bits, size_t index)
+{
+    bits[index / 8] |= static_cast<uint8_t>(1u << (index % 8));
+}
+
+//one way through a portal
+struct FlowPortal
+{
+    const Winding* winding;
+    
+    //faces into toLeaf
+    Plane plane;
+    
+    size_t fromLeaf;
+    size_t toLeaf;
+    
+    //a bit for every other flow portal that could possibly be seen through this one, from the rough flood
+    std::vector<uint8_t> mightSee;
+};
+
+//whether anything going through p could possibly make it through q afterwards
+static bool mightSee(const FlowPortal& p, const FlowPortal& q)
+{
+    constexpr float planeThickness = 0.01f;
+    
+    //q has to be at least partly past p
+    const bool qInFront = std::any_of(q.winding->begin(), q.winding->end(), [&p](glm::vec3 vertex)
+    {
+        return glm::dot(p.plane.normal, vertex) + p.plane.distance > planeThickness;
+    });
+    
+    //and p has to be at least partly before q
+    const bool pBehind = std::any_of(p.winding->begin(), p.winding->end(), [&q](glm::vec3 vertex)
+    {
+        return glm::dot(q.plane.normal, vertex) + q.plane.distance < -planeThickness;
+    });
+    
+    return qInFront && pBehind;
+}
+
+//the portals that can be reached through p by only going through portals that p might see
+//very conservative, but it's cheap and cuts down what the proper flow has to look at a lot
+static void floodMightSee(FlowPortal& p, std::span<const FlowPortal> flowPortals, const std::vector<std::vector<size_t>>& leafPortals)
+{
+    std::vector<uint8_t> visitedLeaves((leafPortals.size() + 7) / 8, 0);
+    
+    std::vector<size_t> leafStack;
+    setBit(visitedLeaves, p.toLeaf);
+    leafStack.push_back(p.toLeaf);
+    
+    while (!leafStack.empty())
+    {
+        const size_t leaf = leafStack.back();
+        leafStack.pop_back();
+        
+        for (size_t qIndex : leafPortals[leaf])
+        {
+            const FlowPortal& q = flowPortals[qIndex];
+            if (!mightSee(p, q))
+            {
+                continue;
+            }
+            
+            setBit(p.mightSee, qIndex);
+            
+            if (!testBit(visitedLeaves, q.toLeaf))
+            {
+                setBit(visitedLeaves, q.toLeaf);
+                leafStack.push_back(q.toLeaf);
+            }
+        }
+    }
+}
+
+//clip the target down to what can be seen from source through pass, using planes that touch both
+//same idea as ClipToSeperators in quake's vis
+static Winding clipToSeparators(const Winding& source, const Winding& pass, Winding target, bool flipClip)
+{
+    constexpr float planeThickness = 0.01f;
+    
+    for (size_t i = 0; i < source.size() && !target.empty(); i++)
+    {
+        const size_t l = (i + 1) % source.size();
+        const glm::vec3 sourceEdge = source[l] - source[i];
+        
+        for (size_t j = 0; j < pass.size() && !target.empty(); j++)
+        {
+            glm::vec3 normal = glm::cross(sourceEdge, pass[j] - source[i]);
+            const float length = glm::length(normal);
+            if (length < planeThickness)
+            {
+                continue;
+            }
+            normal /= length;
+            
+            Plane separator{ normal, -glm::dot(normal, pass[j]) };
+            
+            //make sure the source is behind the plane
+            bool sourceInFront = false;
+            bool sourceOffPlane = false;
+            for (size_t k = 0; k < source.size(); k++)
+            {
+                if (k == i || k == l)
+                {
+                    continue;
+                }
+                
+                const float distance = glm::dot(separator.normal, source[k]) + separator.distance;
+                if (distance < -planeThickness || distance > planeThickness)
+                {
+                    sourceInFront = distance > planeThickness;
+                    sourceOffPlane = true;
+                    break;
+                }
+            }
+            
+            //lies in the same plane as the source, so it doesn't separate anything
+            if (!sourceOffPlane)
+            {
+                continue;
+            }
+            
+            if (sourceInFront)
+            {
+                separator = flipPlane(separator);
+            }
+            
+            //it's only a separator if all of pass is on the other side
+            bool passBehind = false;
+            bool passInFront = false;
+            for (size_t k = 0; k < pass.size(); k++)
+            {
+                if (k == j)
+                {
+                    continue;
+                }
+                
+                const float distance = glm::dot(separator.normal, pass[k]) + separator.distance;
+                if (distance < -planeThickness)
+                {
+                    passBehind = true;
+                    break;
+                }
+                
+                if (distance > planeThickness)
+                {
+                    passInFront = true;
+                }
+            }
+            
+            if (passBehind || !passInFront)
+            {
+                continue;
+            }
+            
+            if (flipClip)
+            {
+                separator = flipPlane(separator);
+            }
+            
+            //only keep what's in front
+            target = clipWinding(target, flipPlane(separator));
+        }
+    }
+    
+    return target;
+}
+
+struct FlowContext
+{
+    const FlowPortal& base;
+    std::span<const FlowPortal> flowPortals;
+    const std::vector<std::vector<size_t>>& leafPortals;
+    
+    //the leaves seen through base, what we're working out
+    std::vector<uint8_t>& visRow;
+    
+    std::vector<uint8_t> portalsSeen;
+    
+    //the leaves we're currently in the middle of going through
+    std::vector<uint8_t> leavesOnStack;
+};
+
+//the proper flow, following portals out from base for as long as there's still a line of sight through all of them
+//pass is empty while we're still in the leaf right behind base
+static void flowThroughLeaf(FlowContext& context, size_t leaf, const Winding& source, const Winding& pass, const std::vector<uint8_t>& prevMightSee)
+{
+    setBit(context.visRow, leaf);
+    setBit(context.leavesOnStack, leaf);
+    
+    std::vector<uint8_t> nextMightSee(prevMightSee.size());
+    
+    for (size_t qIndex : context.leafPortals[leaf])
+    {
+        const FlowPortal& q = context.flowPortals[qIndex];
+        if (!testBit(prevMightSee, qIndex) || testBit(context.leavesOnStack, q.toLeaf))
+        {
+            continue;
+        }
+        
+        //no point going further if there's nothing left past here that we haven't already seen
+        bool more = false;
+        for (size_t i = 0; i < nextMightSee.size(); i++)
+        {
+            nextMightSee[i] = prevMightSee[i] & q.mightSee[i];
+            more |= (nextMightSee[i] & ~context.portalsSeen[i]) != 0;
+        }
+        
+        if (!more && testBit(context.portalsSeen, qIndex))
+        {
+            continue;
+        }
+        
+        //whatever can be seen has to be in front of base
+        Winding nextPass = clipWinding(*q.winding, flipPlane(context.base.plane));
+        if (nextPass.empty())
+        {
+            continue;
+        }
+        
+        //and whatever could be seeing it has to be behind q
+        const Winding nextSource = clipWinding(source, q.plane);
+        if (nextSource.empty())
+        {
+            continue;
+        }
+        
+        if (!pass.empty())
+        {
+            nextPass = clipToSeparators(nextSource, pass, std::move(nextPass), false);
+            if (nextPass.empty())
+            {
+                continue;
+            }
+            
+            nextPass = clipToSeparators(pass, nextSource, std::move(nextPass), true);
+            if (nextPass.empty())
+            {
+                continue;
+            }
+        }
+        
+        setBit(context.portalsSeen, qIndex);
+        
+        flowThroughLeaf(context, q.toLeaf, nextSource, nextPass, nextMightSee);
+    }
+    
+    context.leavesOnStack[leaf / 8] &= static_cast<uint8_t>(~(1u << (leaf % 8)));
+}
+
+//runs work(i) for every i below count, spread over every core
+template<typename Work>
+static void runOnAllCores(size_t count, Work work)
+{
+    std::atomic<size_t> next{ 0 };
+    const auto worker = [&next, count, &work]()
+    {
+        for (size_t i = next++; i < count; i = next++)
+        {
+            work(i);
+        }
+    };
+    
+    const size_t numThreads = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, count + 1);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < numThreads; i++)
+    {
+        threads.emplace_back(worker);
+    }
+    
+    worker();
+    
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+//find the portals between leaves, then flood through them to see which leaves could see each other
+static void buildVisibility(bsp::File& file, std::span<const Brush> brushes)
+{
+    file.portals.clear();
+    file.portalVertices.clear();
+    file.visData.clear();
+    
+    if (file.nodes.empty() || file.vertices.empty())
+    {
+        return;
+    }
+    
+    glm::vec3 mins{ std::numeric_limits<float>::max() };
+    glm::vec3 maxs{ std::numeric_limits<float>::lowest() };
+    for (const glm::vec3& vertex : file.vertices)
+    {
+        mins = glm::min(mins, vertex);
+        maxs = glm::max(maxs, vertex);
+    }
+    mins -= glm::vec3{ PORTAL_WINDING_MARGIN };
+    maxs += glm::vec3{ PORTAL_WINDING_MARGIN };
+    
+    //keep everything inside the box around the map
+    std::vector<Plane> cellPlanes
+    {
+        Plane{ glm::vec3{ 1.0f, 0.0f, 0.0f }, -maxs.x },
+        Plane{ glm::vec3{ -1.0f, 0.0f, 0.0f }, mins.x },
+        Plane{ glm::vec3{ 0.0f, 1.0f, 0.0f }, -maxs.y },
+        Plane{ glm::vec3{ 0.0f, -1.0f, 0.0f }, mins.y },
+        Plane{ glm::vec3{ 0.0f, 0.0f, 1.0f }, -maxs.z },
+        Plane{ glm::vec3{ 0.0f, 0.0f, -1.0f }, mins.z }
+    };
+    
+    const float windingSize = glm::length(maxs - mins);
+    
+    //children get written out before their parents, so the root is always the last node
+    std::vector<BuildPortal> portals;
+    makePortals(file, static_cast<int64_t>(file.nodes.size() - 1), cellPlanes, windingSize, portals);
+    
+    std::vector<std::vector<Plane>> brushPlanes;
+    for (const Brush& brush : brushes)
+    {
+        std::vector<Plane>& planes = brushPlanes.emplace_back();
+        for (const BrushFace& face : brush.getFaces())
+        {
+            planes.push_back(face.plane);
+        }
+    }
+    
+    //only the open portals matter from here on
+    std::erase_if(portals, [&brushPlanes](const BuildPortal& portal)
+    {
+        return !isPortalOpen(portal, brushPlanes);
+    });
+    
+    for (const BuildPortal& portal : portals)
+    {
+        const bsp::Portal newPortal
+        {
+            .firstVertex = static_cast<bsp::ArrayLength>(file.portalVertices.size()),
+            .numVertices = static_cast<bsp::ArrayLength>(portal.winding.size()),
+            .frontLeaf = static_cast<bsp::ArrayLength>(portal.frontLeaf),
+            .backLeaf = static_cast<bsp::ArrayLength>(portal.backLeaf)
+        };
+        
+        file.portalVertices.insert(file.portalVertices.end(), portal.winding.begin(), portal.winding.end());
+        file.portals.push_back(newPortal);
+    }
+    
+    //every portal can be gone through both ways
+    std::vector<FlowPortal> flowPortals;
+    std::vector<std::vector<size_t>> leafPortals(file.leaves.size());
+    for (const BuildPortal& portal : portals)
+    {
+        leafPortals[portal.backLeaf].push_back(flowPortals.size());
+        flowPortals.push_back(FlowPortal{ &portal.winding, portal.plane, portal.backLeaf, portal.frontLeaf, {} });
+        
+        leafPortals[portal.frontLeaf].push_back(flowPortals.size());
+        flowPortals.push_back(FlowPortal{ &portal.winding, flipPlane(portal.plane), portal.frontLeaf, portal.backLeaf, {} });
+    }
+    
+    const size_t portalBytes = (flowPortals.size() + 7) / 8;
+    for (FlowPortal& flowPortal : flowPortals)
+    {
+        flowPortal.mightSee.resize(portalBytes, 0);
+    }
+    
+    //each portal's flood only reads the others, so they can all go at once
+    runOnAllCores(flowPortals.size(), [&flowPortals, &leafPortals](size_t i)
+    {
+        floodMightSee(flowPortals[i], flowPortals, leafPortals);
+    });
+    
+    const size_t rowBytes = bsp::getVisRowBytes(file);
+    std::vector<std::vector<uint8_t>> portalVisRows(flowPortals.size(), std::vector<uint8_t>(rowBytes, 0));
+    
+    runOnAllCores(flowPortals.size(), [&flowPortals, &leafPortals, &portalVisRows, portalBytes, rowBytes](size_t i)
+    {
+        const FlowPortal& base = flowPortals[i];
+        
+        FlowContext context
+        {
+            .base = base,
+            .flowPortals = flowPortals,
+            .leafPortals = leafPortals,
+            .visRow = portalVisRows[i],
+            .portalsSeen = std::vector<uint8_t>(portalBytes, 0),
+            .leavesOnStack = std::vector<uint8_t>(rowBytes, 0)
+        };
+        
+        flowThroughLeaf(context, base.toLeaf, *base.winding, {}, base.mightSee);
+    });
+    
+    //a leaf can see itself and anything it can see through any of its portals
+    std::vector<uint8_t> visRow(rowBytes);
+    for (size_t leaf = 0; leaf < file.leaves.size(); leaf++)
+    {
+        std::fill(visRow.begin(), visRow.end(), 0);
+        visRow[leaf / 8] |= static_cast<uint8_t>(1u << (leaf % 8));
+        
+        for (size_t portalIndex : leafPortals[leaf])
+        {
+            for (size_t i = 0; i < rowBytes; i++)
+            {
+                visRow[i] |= portalVisRows[portalIndex][i];
+            }
+        }
+        
+        file.leaves[leaf].visOffset = static_cast<bsp::ArrayLength>(file.visData.size());
+        bsp::compressVisRow(visRow, file.visData);
+    }
+}
+
 bsp::File BspBuilder::build()
 {
     std::unique_ptr<ConvexPolygon> firstPolygon = convertBrushesToPolygons(pImpl->brushes);
@@ -499,5 +1117,7 @@ bsp::File BspBuilder::build()
     bsp::File file{};
     convertNode(file, rootNode);
     
+    buildVisibility(file, pImpl->brushes);
+    
     return file;
 }
@@ -54,6 +54,9 @@ bool Client::runFrame()
 
         stateStack.top()->update();
         
+        //whatever the state sent goes out together
+        net.flushPackets(NetSrc::Client);
+        
         draw();
     }
     catch (const std::exception& e)
@@ -134,7 +137,7 @@ void Client::changeState(ClientState state)
 #if 0
 void Client::handlePackets()
 {
-    NetBuf buf{};
+    NetBuf buf{ net.getBufPool() };
     NetAddr fromAddr{};
     while (net.getPacket(NetSrc::Client, buf, fromAddr))
     {
@@ -215,7 +218,7 @@ void Client::handleUnconnectedPacket(NetBuf& buf, NetAddr& fromAddr)
         //synchronize time
         const uint64_t oldClientTime = timer->getTotalTicks();
 
-        NetBuf sendBuf{};
+        NetBuf sendBuf{ net.getBufPool() };
         sendBuf.writeUint64(oldClientTime);
 
         netChan->addReliableData(std::move(sendBuf), NetMessageType::Synchronize);
@@ -400,7 +403,7 @@ void Client::sendPackets()
         PlayerCommand& cmd = commands.front();
         commands.pop();
         
-        NetBuf buf{};
+        NetBuf buf{ net.getBufPool() };
         buf.writeFloat(cmd.addRotation);
         
         netChan->sendData(std::move(buf), NetMessageType::PlayerCommand);
@@ -1,26 +1,40 @@
 #include "Client/ClientConnectedState.h"
 
+#include <algorithm>
+
 #include "sys/Renderer.h"
 #include "sys/Timer.h"
 #include "sys/Console.h"
 #include "Client.h"
 #include "NetChan.h"
 #include "EntityManager.h"
+#include "Snapshot.h"
 
 ClientConnectedState::ClientConnectedState(Client& client, Renderer& renderer, Log& log,
         Net& net, NetAddr serverAddr,
         std::unique_ptr<NetChan> netChan, std::unique_ptr<Timer> timer,
         std::unique_ptr<EntityManager> entityManager,
-        std::unordered_map<std::string, std::unique_ptr<Model>> models,
+        std::unique_ptr<SnapshotBuffer> snapshots,
+        std::vector<std::unique_ptr<Model>> models,
+        EntityId playerEntity,
         uint32_t clientSalt, uint32_t serverSalt)
     : client{ client }, renderer{ renderer }, log{ log },
       net{ net }, serverAddr{ serverAddr },
       netChan{ std::move(netChan) }, timer{ std::move(timer) },
-      entityManager{ std::move(entityManager) },
       models{ std::move(models) },
+      entityManager{ std::move(entityManager) },
+      snapshots{ std::move(snapshots) },
+      interpolation{},
+      removedEntities{},
       clientSalt{ clientSalt },
       serverSalt{ serverSalt },
-      combinedSalt{ clientSalt ^ serverSalt }
+      combinedSalt{ clientSalt ^ serverSalt },
+      playerEntity{ playerEntity },
+      unackedCommands{},
+      nextCommandSequence{ 1 },
+      hasNewCommands{ false },
+      lastCommandSendTick{ 0 },
+      nextTimeSynchronizeTick{ 0 }
 {
 }
 
@@ -42,10 +56,10 @@ bool ClientConnectedState::consumeEvent(const Event& ev)
         switch (static_cast<KeyPressType>(ev.data1))
         {
         case KeyPressType::DownArrow:
-            commands.emplace(PlayerCommand{ 5.0f });
+            addCommand(PlayerCommand::MAX_ADD_ROTATION);
             break;
         case KeyPressType::UpArrow:
-            commands.emplace(PlayerCommand{ -5.0f });
+            addCommand(-PlayerCommand::MAX_ADD_ROTATION);
             break;
         case KeyPressType::Escape:
             disconnect(true);
@@ -64,7 +78,7 @@ bool ClientConnectedState::consumeEvent(const Event& ev)
 
 void ClientConnectedState::update()
 {
-    NetBuf buf{};
+    NetBuf buf{ net.getBufPool() };
     NetAddr fromAddr{};
     while (net.getPacket(NetSrc::Client, buf, fromAddr))
     {
@@ -130,6 +144,7 @@ void ClientConnectedState::update()
     }
 
     sendPackets();
+    trySendTimeSynchronize();
 
     //if we never sent a reliable
     netChan->trySendReliable(combinedSalt);
@@ -162,29 +177,25 @@ void ClientConnectedState::handleUnconnectedPacket(NetBuf& buf, NetAddr& fromAdd
 
 void ClientConnectedState::handleReliablePacket(NetBuf& buf, const NetMessageType& msgType)
 {
-    if (msgType == NetMessageType::CreateEntity)
+    if (msgType == NetMessageType::ModelIndex)
     {
-        //console.log("CREATE");
-        EntityId netEntityId;
-        buf.readUint16(netEntityId);
+        uint16_t modelIndex;
+        buf.readUint16(modelIndex);
 
-        entityManager->allocateGlobalEntity(netEntityId);
-        Entity* newEntity = entityManager->getGlobalEntity(netEntityId);
+        std::string modelName;
+        buf.readString(modelName);
 
-        Entity::deserialize(*newEntity, buf);
+        if (modelIndex == Entity::NULL_MODEL_INDEX)
+        {
+            return;
+        }
 
-        if (!models.contains(newEntity->modelName))
+        if (modelIndex >= models.size())
         {
-            models[newEntity->modelName] = renderer.createModel(newEntity->modelName);
+            models.resize(static_cast<size_t>(modelIndex) + 1);
         }
-    }
-    else if (msgType == NetMessageType::DestroyEntity)
-    {
-        //console.log("DESTROY");
-        EntityId netEntityId;
-        buf.readUint16(netEntityId);
 
-        entityManager->freeGlobalEntity(netEntityId);
+        models[modelIndex] = renderer.createModel(modelName);
     }
 }
 
@@ -192,55 +203,160 @@ void ClientConnectedState::handleUnreliablePacket(NetBuf& buf, const NetMessageT
 {
     if (msgType == NetMessageType::EntitySynchronize)
     {
-        uint32_t numEntities;
-        buf.readUint32(numEntities);
+        uint32_t lastRunCommand;
+        const Snapshot* snapshot = nullptr;
+        if (buf.readUint32(lastRunCommand))
+        {
+            snapshot = snapshots->readSnapshot(netChan->getIncomingSequence(), buf);
+        }
 
-        for (uint32_t i = 0; i < numEntities; i++)
+        if (!snapshot)
         {
-            EntityId globalId;
-            buf.readUint16(globalId);
+            log.log(LogLevel::Warning, "Client: Could not read entity snapshot");
 
-            Entity* entity = entityManager->getGlobalEntity(globalId);
-            if (!entity)
-            {
-                entityManager->allocateGlobalEntity(globalId);
-                entity = entityManager->getGlobalEntity(globalId);
-            }
+            //this packet gets acked anyway, so tell the server not to build on it
+            NetBuf sendBuf{ net.getBufPool() };
+            sendBuf.writeUint32(netChan->getIncomingSequence());
 
-            Entity::deserialize(*entity, buf);
+            netChan->sendData(std::move(sendBuf), NetMessageType::SnapshotRequest, combinedSalt);
+            return;
+        }
 
-            if (!models.contains(entity->modelName))
-            {
-                models[entity->modelName] = renderer.createModel(entity->modelName);
-            }
+        //anything culled out of the snapshot gets dropped, and comes back without blending from where it was last seen
+        removedEntities.clear();
+        Snapshot::apply(*snapshot, *entityManager, &removedEntities);
+        for (const EntityId id : removedEntities)
+        {
+            interpolation.clearEntity(id);
         }
+
+        interpolation.addSnapshot(*snapshot, timer->getTotalTime());
+
+        //whatever the server has run is already part of the snapshot
+        while (!unackedCommands.empty() && unackedCommands.front().sequence <= lastRunCommand)
+        {
+            unackedCommands.pop_front();
+        }
+
+        //the server deltas against whatever we ack, so ack it fast
+        netChan->queueAck();
+    }
+    else if (msgType == NetMessageType::TimeSynchronize)
+    {
+        uint64_t prevTime;
+        uint64_t serverTime;
+        if (!buf.readUint64(prevTime) || !buf.readUint64(serverTime))
+        {
+            return;
+        }
+
+        //the server's time was from about halfway through the round trip
+        const uint64_t currentTime = timer->getTotalTime();
+        if (prevTime > currentTime)
+        {
+            return;
+        }
+
+        //worked in gradually until the next answer comes back
+        timer->adjustTime(serverTime + ((currentTime - prevTime) / 2), TIME_SYNCHRONIZE_TICKS * Timer::NANOS_PER_TICK);
+    }
+}
+
+void ClientConnectedState::trySendTimeSynchronize()
+{
+    const uint64_t currentTick = timer->getTotalTicks();
+    if (currentTick < nextTimeSynchronizeTick)
+    {
+        return;
     }
+
+    NetBuf sendBuf{ net.getBufPool() };
+    sendBuf.writeUint64(timer->getTotalTime());
+
+    netChan->sendData(std::move(sendBuf), NetMessageType::TimeSynchronize, combinedSalt);
+
+    nextTimeSynchronizeTick = currentTick + TIME_SYNCHRONIZE_TICKS;
 }
 
 void ClientConnectedState::sendPackets()
 {
-    while (!commands.empty())
+    if (unackedCommands.empty())
     {
-        PlayerCommand& cmd = commands.front();
-        commands.pop();
+        return;
+    }
+
+    //with nothing new, only resend once a tick in case the last one got lost
+    const uint64_t currentTick = timer->getTotalTicks();
+    if (!hasNewCommands && currentTick <= lastCommandSendTick)
+    {
+        return;
+    }
+
+    //everything made this frame goes in one packet, along with the ones before it the server hasn't acked
+    const size_t numCommands = std::min(unackedCommands.size(), PlayerCommand::MAX_BATCH_COMMANDS);
+    const std::vector<PlayerCommand> batch{ unackedCommands.end() - static_cast<std::ptrdiff_t>(numCommands), unackedCommands.end() };
+
+    NetBuf sendBuf{ net.getBufPool() };
+    PlayerCommand::serializeBatch(batch.data(), batch.size(), sendBuf);
+
+    netChan->sendData(std::move(sendBuf), NetMessageType::PlayerCommand, combinedSalt);
+
+    hasNewCommands = false;
+    lastCommandSendTick = currentTick;
+}
 
-        NetBuf sendBuf{};
-        sendBuf.writeFloat(cmd.addRotation);
+void ClientConnectedState::addCommand(float addRotation)
+{
+    const PlayerCommand cmd{ nextCommandSequence++, addRotation };
 
-        netChan->sendData(std::move(sendBuf), NetMessageType::PlayerCommand, combinedSalt);
+    //predicted right away, and kept around until the server tells us it ran it
+    unackedCommands.push_back(cmd);
 
-        //log.logf(LogLevel::Debug, "Client: Sent rotation command from on tick %d", timer->getTotalTicks());
+    //don't let them pile up forever while no snapshots are coming in
+    while (unackedCommands.size() > PlayerCommand::MAX_UNACKED_COMMANDS)
+    {
+        unackedCommands.pop_front();
     }
+
+    hasNewCommands = true;
 }
 
 
 void ClientConnectedState::draw()
 {
-    auto entities = entityManager->getGlobalEntities();
-    for (EntityId entity : entities)
+    const uint64_t renderTime = interpolation.getRenderTime(timer->getTotalTime());
+
+    const EntityView entities = entityManager->getGlobalEntities();
+    for (size_t i = 0; i < entities.size(); i++)
     {
-        const Entity* e = entityManager->getGlobalEntity(entity);
-        renderer.drawModel(*models[e->modelName], glm::vec3{1.0f}, e->rotation, e->position);
+        const EntityId entity = entities.ids[i];
+        const uint16_t modelIndex = entities.modelIndices[i];
+        if (modelIndex >= models.size() || !models[modelIndex])
+        {
+            continue;
+        }
+
+        //fall back to the latest state if we haven't got any snapshots of it yet
+        glm::vec3 position = entities.positions[i];
+        glm::quat rotation = entities.rotations[i];
+        if (entity == playerEntity)
+        {
+            //replay what the server hasn't seen yet on top of its latest state
+            Entity predicted{ position, rotation, modelIndex };
+            for (const PlayerCommand& cmd : unackedCommands)
+            {
+                PlayerCommand::apply(cmd, predicted);
+            }
+
+            position = predicted.position;
+            rotation = predicted.rotation;
+        }
+        else
+        {
+            interpolation.getState(entity, renderTime, position, rotation);
+        }
+
+        renderer.drawModel(*models[modelIndex], glm::vec3{1.0f}, rotation, position);
     }
 }
 
@@ -251,7 +367,7 @@ void ClientConnectedState::disconnect(bool serverProbablyAlive)
         //just shoot off a bunch of disconnect packets, hope one of them reaches
         for (int i = 0; i < 3; i++)
         {
-            NetBuf sendBuf;
+            NetBuf sendBuf{ net.getBufPool() };
             sendBuf.writeString("client_disconnect");
             sendBuf.writeUint32(combinedSalt);
 
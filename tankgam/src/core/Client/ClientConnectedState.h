@@ -1,11 +1,11 @@
 #pragma once
 
 #include <memory>
-#include <unordered_map>
 #include <vector>
-#include <queue>
+#include <deque>
 
 #include "Client/IClientState.h"
+#include "Client/InterpolationBuffer.h"
 #include "PlayerCommand.h"
 #include "Net.h"
 
@@ -15,6 +15,7 @@ class NetBuf;
 class Timer;
 enum class NetMessageType : uint8_t;
 class EntityManager;
+class SnapshotBuffer;
 class Model;
 struct NetAddr;
 
@@ -27,7 +28,9 @@ public:
         Net& net, NetAddr serverAddr,
         std::unique_ptr<NetChan> netChan, std::unique_ptr<Timer> timer,
         std::unique_ptr<EntityManager> entityManager,
-        std::unordered_map<std::string, std::unique_ptr<Model>> models,
+        std::unique_ptr<SnapshotBuffer> snapshots,
+        std::vector<std::unique_ptr<Model>> models,
+        EntityId playerEntity,
         uint32_t clientSalt, uint32_t serverSalt);
     ~ClientConnectedState() override;
 
@@ -44,6 +47,9 @@ private:
 
     void sendPackets();
 
+    //asks the server what time it is every so often, so our clock doesn't drift away from its
+    void trySendTimeSynchronize();
+
 public:
     void draw() override;
 
@@ -57,14 +63,38 @@ private:
     std::unique_ptr<NetChan> netChan;
     std::unique_ptr<Timer> timer;
 
-    std::unordered_map<std::string, std::unique_ptr<Model>> models;
+    //indexed by model index
+    std::vector<std::unique_ptr<Model>> models;
     std::unique_ptr<EntityManager> entityManager;
+    std::unique_ptr<SnapshotBuffer> snapshots;
+
+    //entities get drawn a bit in the past using this, instead of snapping to each snapshot
+    InterpolationBuffer interpolation;
+
+    //reused for whatever the last snapshot took out
+    std::vector<EntityId> removedEntities;
 
     uint32_t clientSalt;
     uint32_t serverSalt;
     uint32_t combinedSalt;
 
-    std::queue<PlayerCommand> commands;
+    //the entity our commands move, predicted locally instead of interpolated
+    EntityId playerEntity;
+
+    //commands that haven't shown up in a snapshot yet, resent until they do
+    std::deque<PlayerCommand> unackedCommands;
+    uint32_t nextCommandSequence;
+
+    //whether a command has been made since we last sent
+    bool hasNewCommands;
+    uint64_t lastCommandSendTick;
+
+    uint64_t nextTimeSynchronizeTick;
+
+    //about every 2 seconds, unreliable so a resend never gets mistaken for a slow round trip
+    static constexpr uint64_t TIME_SYNCHRONIZE_TICKS = 128;
+
+    void addCommand(float addRotation);
 
     void disconnect(bool serverProbablyAlive);
 };
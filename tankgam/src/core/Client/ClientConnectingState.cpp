@@ -11,6 +11,7 @@
 #include "NetChan.h"
 #include "Entity.h"
 #include "EntityManager.h"
+#include "Snapshot.h"
 
 ClientConnectingState::ClientConnectingState(Client& client, Renderer& renderer, Log& log, Net& net, NetAddr serverAddr)
     : client{ client }, renderer{ renderer }, log{ log }, net{ net }, serverAddr{ serverAddr }
@@ -94,7 +95,7 @@ void ClientConnectingState::update()
         trySendSynchronizeRequest();
     }
 
-    NetBuf buf{};
+    NetBuf buf{ net.getBufPool() };
     NetAddr fromAddr{};
     while (net.getPacket(NetSrc::Client, buf, fromAddr))
     {
@@ -239,6 +240,7 @@ void ClientConnectingState::handleUnconnectedPacket(NetBuf& buf, NetAddr& fromAd
 
         //prepare entity manager
         entityManager = std::make_unique<EntityManager>();
+        snapshots = std::make_unique<SnapshotBuffer>();
 
         nextSendTick = 0;
         trySendSynchronizeRequest();
@@ -256,41 +258,42 @@ bool ClientConnectingState::handleReliablePacket(NetBuf& buf, const NetMessageTy
         uint64_t serverTime;
         buf.readUint64(serverTime);
 
-        const uint64_t roundTripTime = (timer->getTotalTicks() - prevTime);
-        timer->setTickOffset(serverTime + (roundTripTime / 2) + 1);
+        //the server's time was from about halfway through the round trip
+        //our clock could be anywhere until now, so jump straight to it, the connected state keeps it in line afterwards
+        const uint64_t roundTripTime = (timer->getTotalTime() - prevTime);
+        timer->setTime(serverTime + (roundTripTime / 2));
 
-        uint32_t numEntities;
-        buf.readUint32(numEntities);
-        for (uint32_t i = 0; i < numEntities; i++)
-        {
-            EntityId netEntityId;
-            buf.readUint16(netEntityId);
+        EntityId playerEntity;
+        EntityId::deserialize(playerEntity, buf);
 
-            if (!entityManager->doesEntityExist(netEntityId))
-            {
-                entityManager->allocateGlobalEntity(netEntityId);
-            }
+        //load every model the server knows about
+        uint16_t numModels;
+        buf.readUint16(numModels);
+        models.clear();
+        models.resize(static_cast<size_t>(numModels));
+        for (uint16_t modelIndex = 0; modelIndex < numModels; modelIndex++)
+        {
+            std::string modelName;
+            buf.readString(modelName);
 
-            Entity* entity = entityManager->getGlobalEntity(netEntityId);
-            if (!entity)
+            if (modelIndex == Entity::NULL_MODEL_INDEX)
             {
-                throw std::runtime_error{ "This should never happen (global entity not available?!)" };
+                continue;
             }
 
-            Entity::deserialize(*entity, buf);
-
-            if (!models.contains(entity->modelName))
-            {
-                models[entity->modelName] = renderer.createModel(entity->modelName);
-            }
+            models[modelIndex] = renderer.createModel(modelName);
         }
 
+        //the entities come in with snapshots
+
         connectState = ConnectState::Connected;
         client.pushState(std::make_unique<ClientConnectedState>(client, renderer, log,
             net, serverAddr,
             std::move(netChan), std::move(timer),
             std::move(entityManager),
+            std::move(snapshots),
             std::move(models),
+            playerEntity,
             clientSalt, serverSalt));
 
         return true;
@@ -303,28 +306,30 @@ void ClientConnectingState::handleUnreliablePacket(NetBuf& buf, const NetMessage
 {
     if (msgType == NetMessageType::EntitySynchronize)
     {
-        uint32_t numEntities;
-        buf.readUint32(numEntities);
-
-        for (uint32_t i = 0; i < numEntities; i++)
+        //we haven't sent any commands yet
+        uint32_t lastRunCommand;
+        const Snapshot* snapshot = nullptr;
+        if (buf.readUint32(lastRunCommand))
         {
-            EntityId globalId;
-            buf.readUint16(globalId);
+            snapshot = snapshots->readSnapshot(netChan->getIncomingSequence(), buf);
+        }
 
-            Entity* entity = entityManager->getGlobalEntity(globalId);
-            if (!entity)
-            {
-                entityManager->allocateGlobalEntity(globalId);
-                entity = entityManager->getGlobalEntity(globalId);
-            }
+        if (!snapshot)
+        {
+            log.log(LogLevel::Warning, "Client: Could not read entity snapshot");
 
-            Entity::deserialize(*entity, buf);
+            //this packet gets acked anyway, so tell the server not to build on it
+            NetBuf sendBuf{ net.getBufPool() };
+            sendBuf.writeUint32(netChan->getIncomingSequence());
 
-            if (!models.contains(entity->modelName))
-            {
-                models[entity->modelName] = renderer.createModel(entity->modelName);
-            }
+            netChan->sendData(std::move(sendBuf), NetMessageType::SnapshotRequest, combinedSalt);
+            return;
         }
+
+        Snapshot::apply(*snapshot, *entityManager);
+
+        //the server deltas against whatever we ack, so ack it fast
+        netChan->queueAck();
     }
 }
 
@@ -351,7 +356,7 @@ void ClientConnectingState::trySendConnectionRequest()
     const uint64_t currentTick = timer->getTotalTicks();
     if (currentTick >= nextSendTick)
     {
-        NetBuf sendBuf;
+        NetBuf sendBuf{ net.getBufPool() };
         sendBuf.writeString("client_connect");
         sendBuf.writeUint32(clientSalt);
 
@@ -372,7 +377,7 @@ void ClientConnectingState::trySendChallengeRequest()
     const uint64_t currentTick = timer->getTotalTicks();
     if (currentTick >= nextSendTick)
     {
-        NetBuf sendBuf;
+        NetBuf sendBuf{ net.getBufPool() };
         sendBuf.writeString("client_challenge");
         sendBuf.writeUint32(combinedSalt);
 
@@ -394,9 +399,9 @@ void ClientConnectingState::trySendSynchronizeRequest()
     if (currentTick >= nextSendTick)
     {
         //synchronize time
-        const uint64_t oldClientTime = timer->getTotalTicks();
+        const uint64_t oldClientTime = timer->getTotalTime();
 
-        NetBuf sendBuf{};
+        NetBuf sendBuf{ net.getBufPool() };
         sendBuf.writeUint64(oldClientTime);
 
         netChan->addReliableData(std::move(sendBuf), NetMessageType::Synchronize);
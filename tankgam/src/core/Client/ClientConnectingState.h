@@ -1,7 +1,7 @@
 #pragma once
 
 #include <memory>
-#include <unordered_map>
+#include <vector>
 #include <string>
 
 #include "Client/IClientState.h"
@@ -13,6 +13,7 @@ class NetBuf;
 class Timer;
 enum class NetMessageType : uint8_t;
 class EntityManager;
+class SnapshotBuffer;
 class Model;
 
 class Renderer;
@@ -48,8 +49,10 @@ private:
     std::unique_ptr<NetChan> netChan;
     std::unique_ptr<Timer> timer;
 
-    std::unordered_map<std::string, std::unique_ptr<Model>> models;
+    //indexed by model index
+    std::vector<std::unique_ptr<Model>> models;
     std::unique_ptr<EntityManager> entityManager;
+    std::unique_ptr<SnapshotBuffer> snapshots;
 
     uint64_t stopTryConnectTick;
     uint64_t nextSendTick;
@@ -19,7 +19,7 @@ ClientMenuState::ClientMenuState(Client& client, Renderer& renderer, Log& log, N
                 {
                 case 0:
                     client.pushState(std::make_shared<ClientConnectingState>(client, renderer, log, net,
-                        NetAddr{ NetAddrType::Loopback, 0 }));
+                        net.getServerAddr()));
                     break;
                 case 1:
                     client.shutdown();
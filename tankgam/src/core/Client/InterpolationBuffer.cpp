@@ -0,0 +1,171 @@
+#include "Client/InterpolationBuffer.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "Snapshot.h"
+
+InterpolationBuffer::InterpolationBuffer()
+    : histories{},
+      hasArrival{ false },
+      transit{ 0 },
+      jitter{ 0 },
+      lastSnapshotTime{ 0 },
+      snapshotInterval{ static_cast<int64_t>(Timer::NANOS_PER_TICK) }
+{
+}
+
+InterpolationBuffer::~InterpolationBuffer() = default;
+
+void InterpolationBuffer::addSnapshot(const Snapshot& snapshot, uint64_t arrivalTime)
+{
+    const uint64_t serverTime = snapshot.tick * Timer::NANOS_PER_TICK;
+    
+    updateDelay(serverTime, arrivalTime);
+    
+    for (const SnapshotEntity& snapshotEntity : snapshot.entities)
+    {
+        addSample(snapshotEntity.id, serverTime, snapshotEntity.entity);
+    }
+}
+
+void InterpolationBuffer::addSample(EntityId id, uint64_t time, const Entity& entity)
+{
+    if (id.index >= histories.size())
+    {
+        histories.resize(static_cast<size_t>(id.index) + 1, EntityHistory{ {}, 0, 0, 0 });
+    }
+    
+    EntityHistory& history = histories[id.index];
+    if (history.generation != id.generation)
+    {
+        //a new entity took over the slot, don't blend into the old one
+        history.generation = id.generation;
+        history.first = 0;
+        history.count = 0;
+    }
+    
+    if (history.count > 0)
+    {
+        const InterpolationSample& newest = history.samples[(history.first + history.count - 1) % HISTORY_SIZE];
+        
+        //we already have this or something newer
+        if (time <= newest.time)
+        {
+            return;
+        }
+        
+        //it's been gone long enough that blending into the old state would look wrong
+        if (time - newest.time > MAX_DELAY)
+        {
+            history.first = 0;
+            history.count = 0;
+        }
+    }
+    
+    if (history.count == HISTORY_SIZE)
+    {
+        //overwrite the oldest
+        history.first = (history.first + 1) % HISTORY_SIZE;
+        history.count--;
+    }
+    
+    history.samples[(history.first + history.count) % HISTORY_SIZE] = InterpolationSample{ time, entity.position, entity.rotation };
+    history.count++;
+}
+
+void InterpolationBuffer::clearEntity(EntityId id)
+{
+    if (id.index >= histories.size())
+    {
+        return;
+    }
+    
+    histories[id.index].first = 0;
+    histories[id.index].count = 0;
+}
+
+bool InterpolationBuffer::getState(EntityId id, uint64_t time, glm::vec3& outPosition, glm::quat& outRotation) const
+{
+    if (id.index >= histories.size())
+    {
+        return false;
+    }
+    
+    const EntityHistory& history = histories[id.index];
+    if (history.generation != id.generation || history.count == 0)
+    {
+        return false;
+    }
+    
+    const InterpolationSample* before = &history.samples[history.first];
+    if (time <= before->time)
+    {
+        //older than anything we have, just show the oldest
+        outPosition = before->position;
+        outRotation = before->rotation;
+        return true;
+    }
+    
+    for (size_t i = 1; i < history.count; i++)
+    {
+        const InterpolationSample* after = &history.samples[(history.first + i) % HISTORY_SIZE];
+        if (time < after->time)
+        {
+            const float t = static_cast<float>(time - before->time) / static_cast<float>(after->time - before->time);
+            
+            outPosition = glm::mix(before->position, after->position, t);
+            outRotation = glm::slerp(before->rotation, after->rotation, t);
+            return true;
+        }
+        
+        before = after;
+    }
+    
+    //newer than anything we have, hold the newest instead of guessing
+    outPosition = before->position;
+    outRotation = before->rotation;
+    return true;
+}
+
+uint64_t InterpolationBuffer::getRenderTime(uint64_t localTime) const
+{
+    //map our clock onto the server's using how long snapshots take to arrive
+    const int64_t renderTime = static_cast<int64_t>(localTime) - transit - static_cast<int64_t>(getDelay());
+    
+    return renderTime > 0 ? static_cast<uint64_t>(renderTime) : 0;
+}
+
+uint64_t InterpolationBuffer::getDelay() const
+{
+    //enough to always have a snapshot on either side, plus slack for the ones that arrive late
+    const int64_t delay = snapshotInterval + jitter * JITTER_MULTIPLIER;
+    
+    return std::clamp(static_cast<uint64_t>(std::max<int64_t>(delay, 0)), MIN_DELAY, MAX_DELAY);
+}
+
+void InterpolationBuffer::updateDelay(uint64_t serverTime, uint64_t arrivalTime)
+{
+    //also includes the difference between our clocks, which is fine since it's only used to map between them
+    const int64_t newTransit = static_cast<int64_t>(arrivalTime) - static_cast<int64_t>(serverTime);
+    
+    if (!hasArrival)
+    {
+        hasArrival = true;
+        transit = newTransit;
+        lastSnapshotTime = serverTime;
+        return;
+    }
+    
+    //like rfc 3550's interarrival jitter, smoothed over the last few snapshots
+    const int64_t variation = std::abs(newTransit - transit);
+    jitter += (variation - jitter) / 16;
+    transit += (newTransit - transit) / 16;
+    
+    if (serverTime > lastSnapshotTime)
+    {
+        const int64_t interval = static_cast<int64_t>(serverTime - lastSnapshotTime);
+        snapshotInterval += (interval - snapshotInterval) / 8;
+        lastSnapshotTime = serverTime;
+    }
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <array>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include "Entity.h"
+#include "EntityManager.h"
+#include "sys/Timer.h"
+
+struct Snapshot;
+
+//where an entity was at a certain server time
+struct InterpolationSample
+{
+    uint64_t time;
+    glm::vec3 position;
+    glm::quat rotation;
+};
+
+//remembers the last few snapshots of every global entity so that they can be drawn
+//a little bit in the past, smoothly blending between the states the server sent us
+class InterpolationBuffer
+{
+public:
+    InterpolationBuffer();
+    ~InterpolationBuffer();
+
+    //add every entity in the snapshot, and note when the snapshot arrived in local time
+    void addSnapshot(const Snapshot& snapshot, uint64_t arrivalTime);
+
+    //record the state of an entity at the given server time, in nanoseconds
+    void addSample(EntityId id, uint64_t time, const Entity& entity);
+
+    //forget everything about this entity so a new one with the same id doesn't get blended into it
+    void clearEntity(EntityId id);
+
+    //find where the entity was at the given server time
+    //returns false if we don't know anything about this entity
+    bool getState(EntityId id, uint64_t time, glm::vec3& outPosition, glm::quat& outRotation) const;
+
+    //the server time we should be drawing at, given the current local time
+    uint64_t getRenderTime(uint64_t localTime) const;
+
+    //how far behind the newest snapshots we're drawing, in nanoseconds
+    uint64_t getDelay() const;
+
+    static constexpr size_t HISTORY_SIZE = 32;
+
+    //never draw closer than this to the newest snapshot
+    static constexpr uint64_t MIN_DELAY = Timer::NANOS_PER_TICK;
+
+    //past this we'd rather stutter than lag further behind
+    static constexpr uint64_t MAX_DELAY = Timer::NANOS_PER_SECOND / 4;
+
+    //how many jitters worth of slack to keep on top of the snapshot interval
+    static constexpr int64_t JITTER_MULTIPLIER = 3;
+
+private:
+    struct EntityHistory
+    {
+        std::array<InterpolationSample, HISTORY_SIZE> samples;
+
+        //which entity in the slot the samples belong to
+        uint8_t generation;
+
+        //index of the oldest sample
+        size_t first;
+        size_t count;
+    };
+
+    //indexed by entity id index
+    std::vector<EntityHistory> histories;
+
+    //how long snapshots take to get here (including any clock offset), averaged
+    bool hasArrival;
+    int64_t transit;
+
+    //the average variation of transit
+    int64_t jitter;
+
+    //the average server time between snapshots
+    uint64_t lastSnapshotTime;
+    int64_t snapshotInterval;
+
+    void updateDelay(uint64_t serverTime, uint64_t arrivalTime);
+};
@@ -0,0 +1,213 @@
+#include "ComponentStore.h"
+
+#include <stdexcept>
+
+ComponentStore::ComponentStore() = default;
+
+ComponentStore::~ComponentStore() = default;
+
+void ComponentStore::removeEntity(EntityId id)
+{
+    setMask(id, 0);
+}
+
+ComponentMask ComponentStore::getMask(EntityId id) const
+{
+    if (id.index >= locations.size())
+    {
+        return 0;
+    }
+
+    const EntityLocation& location = locations[id.index];
+    if (location.id != id || location.archetype == NO_ARCHETYPE)
+    {
+        return 0;
+    }
+
+    return archetypes[location.archetype].mask;
+}
+
+void ComponentStore::setMask(EntityId id, ComponentMask mask)
+{
+    if (id.index >= locations.size())
+    {
+        locations.resize(static_cast<size_t>(id.index) + 1, EntityLocation{ EntityId{}, NO_ARCHETYPE, 0, false });
+    }
+
+    EntityLocation& location = locations[id.index];
+
+    //a stale id doesn't get to touch whatever the newer entity in this slot has
+    if (location.id != id)
+    {
+        if (location.used && !EntityId::isNewerGeneration(id.generation, location.id.generation))
+        {
+            return;
+        }
+
+        //whatever was left behind by an entity that used to be in this slot is garbage
+        if (location.archetype != NO_ARCHETYPE)
+        {
+            removeRow(archetypes[location.archetype], location.row);
+            location.archetype = NO_ARCHETYPE;
+        }
+    }
+    location.id = id;
+    location.used = true;
+
+    const uint32_t oldArchetypeIndex = location.archetype;
+    if (oldArchetypeIndex != NO_ARCHETYPE && archetypes[oldArchetypeIndex].mask == mask)
+    {
+        return;
+    }
+
+    if (mask == 0)
+    {
+        if (oldArchetypeIndex != NO_ARCHETYPE)
+        {
+            removeRow(archetypes[oldArchetypeIndex], location.row);
+            location.archetype = NO_ARCHETYPE;
+        }
+
+        return;
+    }
+
+    //might add an archetype, so grab it before holding onto any references
+    const uint32_t newArchetypeIndex = getArchetype(mask);
+    Archetype& newArchetype = archetypes[newArchetypeIndex];
+    const size_t newRow = pushRow(newArchetype, id);
+
+    if (oldArchetypeIndex != NO_ARCHETYPE)
+    {
+        Archetype& oldArchetype = archetypes[oldArchetypeIndex];
+
+        //bring along everything both archetypes have
+        const ComponentMask sharedMask = oldArchetype.mask & mask;
+        for (size_t type = 0; type < NUM_COMPONENT_TYPES; type++)
+        {
+            if (!(sharedMask & getComponentBit(static_cast<ComponentType>(type))))
+            {
+                continue;
+            }
+
+            const size_t size = COMPONENT_SIZES[type];
+            std::memcpy(getRowData(newArchetype, newRow, newArchetype.offsets[type], size),
+                        getRowData(oldArchetype, location.row, oldArchetype.offsets[type], size),
+                        size);
+        }
+
+        removeRow(oldArchetype, location.row);
+    }
+
+    location.archetype = newArchetypeIndex;
+    location.row = newRow;
+}
+
+void* ComponentStore::getComponentData(EntityId id, ComponentType type)
+{
+    if (!(getMask(id) & getComponentBit(type)))
+    {
+        return nullptr;
+    }
+
+    const EntityLocation& location = locations[id.index];
+    Archetype& archetype = archetypes[location.archetype];
+    const size_t typeIndex = static_cast<size_t>(type);
+
+    return getRowData(archetype, location.row, archetype.offsets[typeIndex], COMPONENT_SIZES[typeIndex]);
+}
+
+uint32_t ComponentStore::getArchetype(ComponentMask mask)
+{
+    if (const auto it = archetypesByMask.find(mask); it != archetypesByMask.end())
+    {
+        return it->second;
+    }
+
+    Archetype archetype{};
+    archetype.mask = mask;
+
+    size_t rowBytes = sizeof(EntityId);
+    for (size_t type = 0; type < NUM_COMPONENT_TYPES; type++)
+    {
+        if (mask & getComponentBit(static_cast<ComponentType>(type)))
+        {
+            rowBytes += COMPONENT_SIZES[type];
+        }
+    }
+
+    //leave room for the padding between arrays
+    const size_t maxPadding = (NUM_COMPONENT_TYPES + 1) * CHUNK_ALIGNMENT;
+    archetype.chunkCapacity = (CHUNK_BYTES - maxPadding) / rowBytes;
+    if (archetype.chunkCapacity == 0)
+    {
+        throw std::runtime_error{ "Components are too big to fit in a chunk!" };
+    }
+
+    size_t offset = archetype.chunkCapacity * sizeof(EntityId);
+    for (size_t type = 0; type < NUM_COMPONENT_TYPES; type++)
+    {
+        if (!(mask & getComponentBit(static_cast<ComponentType>(type))))
+        {
+            continue;
+        }
+
+        offset = (offset + CHUNK_ALIGNMENT - 1) & ~(CHUNK_ALIGNMENT - 1);
+        archetype.offsets[type] = offset;
+        offset += archetype.chunkCapacity * COMPONENT_SIZES[type];
+    }
+
+    const uint32_t archetypeIndex = static_cast<uint32_t>(archetypes.size());
+    archetypes.push_back(std::move(archetype));
+    archetypesByMask[mask] = archetypeIndex;
+
+    return archetypeIndex;
+}
+
+size_t ComponentStore::pushRow(Archetype& archetype, EntityId id)
+{
+    const size_t row = archetype.count;
+    if (row / archetype.chunkCapacity >= archetype.chunks.size())
+    {
+        archetype.chunks.push_back(std::make_unique<std::byte[]>(CHUNK_BYTES));
+    }
+
+    std::memcpy(getRowData(archetype, row, 0, sizeof(EntityId)), &id, sizeof(EntityId));
+    archetype.count++;
+
+    return row;
+}
+
+void ComponentStore::removeRow(Archetype& archetype, size_t row)
+{
+    const size_t lastRow = archetype.count - 1;
+    if (row != lastRow)
+    {
+        EntityId lastId;
+        std::memcpy(&lastId, getRowData(archetype, lastRow, 0, sizeof(EntityId)), sizeof(EntityId));
+        std::memcpy(getRowData(archetype, row, 0, sizeof(EntityId)), &lastId, sizeof(EntityId));
+
+        for (size_t type = 0; type < NUM_COMPONENT_TYPES; type++)
+        {
+            if (!(archetype.mask & getComponentBit(static_cast<ComponentType>(type))))
+            {
+                continue;
+            }
+
+            const size_t size = COMPONENT_SIZES[type];
+            std::memcpy(getRowData(archetype, row, archetype.offsets[type], size),
+                        getRowData(archetype, lastRow, archetype.offsets[type], size),
+                        size);
+        }
+
+        locations[lastId.index].row = row;
+    }
+
+    archetype.count--;
+}
+
+std::byte* ComponentStore::getRowData(Archetype& archetype, size_t row, size_t offset, size_t size)
+{
+    std::byte* chunk = archetype.chunks[row / archetype.chunkCapacity].get();
+
+    return chunk + offset + (row % archetype.chunkCapacity) * size;
+}
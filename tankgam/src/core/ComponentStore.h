@@ -0,0 +1,194 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <span>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "EntityManager.h"
+#include "Components.h"
+#include "JobSystem.h"
+
+//keeps entities' components grouped by which set of them they have (their archetype)
+//every archetype packs its entities into fixed size chunks, with each component in its own array,
+//so a query walks straight through the chunks that have what it wants and skips the rest
+class ComponentStore
+{
+public:
+    ComponentStore();
+    ~ComponentStore();
+
+    ComponentStore(const ComponentStore&) = delete;
+    ComponentStore& operator=(const ComponentStore&) = delete;
+
+    //replaces the component if the entity already has one
+    //add, remove and removeEntity do nothing for ids older than the one holding their slot
+    template<typename T>
+    void add(EntityId id, const T& component)
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "Components get moved around with memcpy");
+
+        setMask(id, getMask(id) | getComponentBit(T::TYPE));
+        if (void* data = getComponentData(id, T::TYPE))
+        {
+            std::memcpy(data, &component, sizeof(T));
+        }
+    }
+
+    template<typename T>
+    void remove(EntityId id)
+    {
+        setMask(id, getMask(id) & ~getComponentBit(T::TYPE));
+    }
+
+    //returns null if the entity doesn't have one
+    //only valid until a component gets added or removed
+    template<typename T>
+    T* get(EntityId id)
+    {
+        return static_cast<T*>(getComponentData(id, T::TYPE));
+    }
+
+    //drops every component the entity has
+    void removeEntity(EntityId id);
+
+    //which components the entity has, 0 for stale ids
+    ComponentMask getMask(EntityId id) const;
+
+    //calls func(ids, components...) for every chunk with all of Ts in it, each argument a std::span
+    //don't add or remove components from inside func, collect them and do it afterwards
+    template<typename... Ts, typename F>
+    void forEach(F&& func)
+    {
+        constexpr ComponentMask mask = (getComponentBit(Ts::TYPE) | ...);
+
+        for (Archetype& archetype : archetypes)
+        {
+            if ((archetype.mask & mask) != mask)
+            {
+                continue;
+            }
+
+            for (size_t first = 0; first < archetype.count; first += archetype.chunkCapacity)
+            {
+                callWithChunk<Ts...>(archetype, first, func);
+            }
+        }
+    }
+
+    //same as forEach, but the chunks get spread out across the job system's threads
+    //func gets called for several chunks at once, so it can only touch the entities it was given
+    template<typename... Ts, typename F>
+    void parallelForEach(JobSystem& jobs, F&& func)
+    {
+        constexpr ComponentMask mask = (getComponentBit(Ts::TYPE) | ...);
+
+        matchingChunks.clear();
+        for (Archetype& archetype : archetypes)
+        {
+            if ((archetype.mask & mask) != mask)
+            {
+                continue;
+            }
+
+            for (size_t first = 0; first < archetype.count; first += archetype.chunkCapacity)
+            {
+                matchingChunks.push_back(ChunkRef{ &archetype, first });
+            }
+        }
+
+        jobs.parallelFor(matchingChunks.size(), 1, [this, &func](size_t begin, size_t end)
+            {
+                for (size_t i = begin; i < end; i++)
+                {
+                    callWithChunk<Ts...>(*matchingChunks[i].archetype, matchingChunks[i].first, func);
+                }
+            });
+    }
+
+    //how big every chunk is, the number of entities that fit depends on the archetype
+    static constexpr size_t CHUNK_BYTES = 16 * 1024;
+
+    //every array in a chunk starts on this
+    static constexpr size_t CHUNK_ALIGNMENT = 16;
+
+private:
+    struct Archetype
+    {
+        ComponentMask mask;
+
+        //entities per chunk
+        size_t chunkCapacity;
+
+        //where each component's array starts in a chunk, the ids come first
+        std::array<size_t, NUM_COMPONENT_TYPES> offsets;
+
+        //never freed, so the memory gets reused as entities come and go
+        std::vector<std::unique_ptr<std::byte[]>> chunks;
+
+        //rows are packed, so every chunk is full except the last
+        size_t count;
+    };
+
+    static constexpr uint32_t NO_ARCHETYPE = UINT32_MAX;
+
+    struct EntityLocation
+    {
+        EntityId id;
+        uint32_t archetype;
+        size_t row;
+
+        //once a slot's been used, only the same or a newer generation can change it
+        bool used;
+    };
+
+    std::vector<Archetype> archetypes;
+    std::unordered_map<ComponentMask, uint32_t> archetypesByMask;
+
+    //indexed by the id's index
+    std::vector<EntityLocation> locations;
+
+    struct ChunkRef
+    {
+        Archetype* archetype;
+
+        //the first row in the chunk
+        size_t first;
+    };
+
+    //reused by parallelForEach to hand chunks out to the job system
+    std::vector<ChunkRef> matchingChunks;
+
+    template<typename... Ts, typename F>
+    static void callWithChunk(Archetype& archetype, size_t first, F& func)
+    {
+        std::byte* chunk = archetype.chunks[first / archetype.chunkCapacity].get();
+        const size_t count = std::min(archetype.chunkCapacity, archetype.count - first);
+
+        func(std::span<const EntityId>{ reinterpret_cast<const EntityId*>(chunk), count },
+             std::span<Ts>{ reinterpret_cast<Ts*>(chunk + archetype.offsets[static_cast<size_t>(Ts::TYPE)]), count }...);
+    }
+
+    //moves the entity into the archetype for mask, keeping whatever components both have
+    //ignored if a newer generation of the entity has already used the slot
+    void setMask(EntityId id, ComponentMask mask);
+
+    //returns null if the entity doesn't have that component
+    void* getComponentData(EntityId id, ComponentType type);
+
+    uint32_t getArchetype(ComponentMask mask);
+
+    //returns the new row
+    size_t pushRow(Archetype& archetype, EntityId id);
+
+    //fills the hole with the last row
+    void removeRow(Archetype& archetype, size_t row);
+
+    static std::byte* getRowData(Archetype& archetype, size_t row, size_t offset, size_t size);
+};
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+//game logic state that lives next to an entity, the networked fields stay in EntityManager
+//components get copied around as raw bytes, so they have to stay trivially copyable
+enum class ComponentType : uint8_t
+{
+    AngularVelocity,
+    Count,
+};
+
+constexpr size_t NUM_COMPONENT_TYPES = static_cast<size_t>(ComponentType::Count);
+
+//one bit for every ComponentType
+using ComponentMask = uint32_t;
+
+static_assert(NUM_COMPONENT_TYPES <= sizeof(ComponentMask) * 8, "Too many component types for ComponentMask");
+
+constexpr ComponentMask getComponentBit(ComponentType type)
+{
+    return ComponentMask{ 1 } << static_cast<uint8_t>(type);
+}
+
+//spins the entity around an axis every tick
+struct AngularVelocityComponent
+{
+    glm::vec3 axis;
+    float degreesPerSecond;
+
+    static constexpr ComponentType TYPE = ComponentType::AngularVelocity;
+};
+
+//indexed by ComponentType
+constexpr std::array<size_t, NUM_COMPONENT_TYPES> COMPONENT_SIZES =
+{
+    sizeof(AngularVelocityComponent),
+};
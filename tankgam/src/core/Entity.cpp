@@ -2,29 +2,184 @@
 
 #include "NetBuf.h"
 
-void Entity::serialize(const Entity& inEntity, NetBuf& outBuf)
+static const NetVec3Quantization POSITION_QUANTIZATION
 {
-    outBuf.writeVec3(inEntity.position);
-    outBuf.writeQuat(inEntity.rotation);
-    outBuf.writeString(inEntity.modelName);
+    .mins = glm::vec3{ -Entity::WORLD_EXTENT },
+    .maxs = glm::vec3{ Entity::WORLD_EXTENT },
+    .precision = Entity::POSITION_PRECISION,
+};
+
+static bool writePosition(const glm::vec3& position, NetBuf& outBuf, EntityEncoding encoding)
+{
+    if (encoding == EntityEncoding::Quantized)
+    {
+        return outBuf.writeQuantizedVec3(position, POSITION_QUANTIZATION);
+    }
+    
+    return outBuf.writeVec3(position);
+}
+
+static bool readPosition(glm::vec3& position, NetBuf& inBuf, EntityEncoding encoding)
+{
+    if (encoding == EntityEncoding::Quantized)
+    {
+        return inBuf.readQuantizedVec3(position, POSITION_QUANTIZATION);
+    }
+    
+    return inBuf.readVec3(position);
+}
+
+static bool writeRotation(const glm::quat& rotation, NetBuf& outBuf, EntityEncoding encoding)
+{
+    if (encoding == EntityEncoding::Quantized)
+    {
+        return outBuf.writeQuantizedQuat(rotation, Entity::ROTATION_COMPONENT_BITS);
+    }
+    
+    return outBuf.writeQuat(rotation);
+}
+
+static bool readRotation(glm::quat& rotation, NetBuf& inBuf, EntityEncoding encoding)
+{
+    if (encoding == EntityEncoding::Quantized)
+    {
+        return inBuf.readQuantizedQuat(rotation, Entity::ROTATION_COMPONENT_BITS);
+    }
+    
+    return inBuf.readQuat(rotation);
 }
 
-bool Entity::deserialize(Entity& outEntity, NetBuf& inBuf)
+void Entity::serialize(const Entity& inEntity, NetBuf& outBuf, EntityEncoding encoding)
 {
-    if (!inBuf.readVec3(outEntity.position))
+    writePosition(inEntity.position, outBuf, encoding);
+    writeRotation(inEntity.rotation, outBuf, encoding);
+    outBuf.writeUint16(inEntity.modelIndex);
+}
+
+bool Entity::deserialize(Entity& outEntity, NetBuf& inBuf, EntityEncoding encoding)
+{
+    if (!readPosition(outEntity.position, inBuf, encoding))
+    {
+        return false;
+    }
+    
+    if (!readRotation(outEntity.rotation, inBuf, encoding))
     {
         return false;
     }
     
-    if (!inBuf.readQuat(outEntity.rotation))
+    if (!inBuf.readUint16(outEntity.modelIndex))
+    {
+        return false;
+    }
+    
+    return true;
+}
+
+uint8_t Entity::getChangedFields(const Entity& from, const Entity& to, EntityEncoding encoding)
+{
+    uint8_t fields = static_cast<uint8_t>(EntityField::None);
+    
+    //changes too small to survive quantization aren't worth sending
+    if (encoding == EntityEncoding::Quantized)
+    {
+        if (NetBuf::quantizeVec3(from.position, POSITION_QUANTIZATION) !=
+            NetBuf::quantizeVec3(to.position, POSITION_QUANTIZATION))
+        {
+            fields |= static_cast<uint8_t>(EntityField::Position);
+        }
+        
+        if (NetBuf::quantizeQuat(from.rotation, ROTATION_COMPONENT_BITS) !=
+            NetBuf::quantizeQuat(to.rotation, ROTATION_COMPONENT_BITS))
+        {
+            fields |= static_cast<uint8_t>(EntityField::Rotation);
+        }
+    }
+    else
+    {
+        if (from.position != to.position)
+        {
+            fields |= static_cast<uint8_t>(EntityField::Position);
+        }
+        
+        if (from.rotation != to.rotation)
+        {
+            fields |= static_cast<uint8_t>(EntityField::Rotation);
+        }
+    }
+    
+    if (from.modelIndex != to.modelIndex)
+    {
+        fields |= static_cast<uint8_t>(EntityField::ModelIndex);
+    }
+    
+    return fields;
+}
+
+bool Entity::serializeDelta(const Entity& inEntity, uint8_t fields, NetBuf& outBuf, EntityEncoding encoding)
+{
+    if (!outBuf.writeUint8(fields))
     {
         return false;
     }
     
-    if (!inBuf.readString(outEntity.modelName))
+    if (fields & static_cast<uint8_t>(EntityField::Position))
+    {
+        if (!writePosition(inEntity.position, outBuf, encoding))
+        {
+            return false;
+        }
+    }
+    
+    if (fields & static_cast<uint8_t>(EntityField::Rotation))
+    {
+        if (!writeRotation(inEntity.rotation, outBuf, encoding))
+        {
+            return false;
+        }
+    }
+    
+    if (fields & static_cast<uint8_t>(EntityField::ModelIndex))
+    {
+        if (!outBuf.writeUint16(inEntity.modelIndex))
+        {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+bool Entity::deserializeDelta(Entity& outEntity, uint8_t& fields, NetBuf& inBuf, EntityEncoding encoding)
+{
+    if (!inBuf.readUint8(fields))
     {
         return false;
     }
     
+    if (fields & static_cast<uint8_t>(EntityField::Position))
+    {
+        if (!readPosition(outEntity.position, inBuf, encoding))
+        {
+            return false;
+        }
+    }
+    
+    if (fields & static_cast<uint8_t>(EntityField::Rotation))
+    {
+        if (!readRotation(outEntity.rotation, inBuf, encoding))
+        {
+            return false;
+        }
+    }
+    
+    if (fields & static_cast<uint8_t>(EntityField::ModelIndex))
+    {
+        if (!inBuf.readUint16(outEntity.modelIndex))
+        {
+            return false;
+        }
+    }
+    
     return true;
 }
@@ -1,19 +1,58 @@
 #pragma once
 
-#include <string>
+#include <cstdint>
 
 #include <glm/glm.hpp>
 #include <glm/gtc/quaternion.hpp>
 
 class NetBuf;
 
+//bitmask of the fields that are written in an entity delta
+enum class EntityField : uint8_t
+{
+    None = 0,
+    Position = 1 << 0,
+    Rotation = 1 << 1,
+    ModelIndex = 1 << 2,
+    All = Position | Rotation | ModelIndex,
+    Removed = 1 << 7,
+};
+
+//how the transform of an entity is written out
+enum class EntityEncoding : uint8_t
+{
+    Full,       //raw floats
+    Quantized,  //fixed point position & smallest three rotation
+};
+
 struct Entity
 {
     glm::vec3 position;
     glm::quat rotation;
-    std::string modelName;
     
-    static void serialize(const Entity& inEntity, NetBuf& outBuf);
+    //index into the model table that the server sends out
+    uint16_t modelIndex;
+    
+    static void serialize(const Entity& inEntity, NetBuf& outBuf, EntityEncoding encoding = EntityEncoding::Full);
+    
+    static bool deserialize(Entity& outEntity, NetBuf& inBuf, EntityEncoding encoding = EntityEncoding::Full);
+    
+    //returns the fields that differ between the two entities once they're encoded
+    static uint8_t getChangedFields(const Entity& from, const Entity& to, EntityEncoding encoding = EntityEncoding::Full);
+    
+    //writes the field mask followed by only the fields in it
+    static bool serializeDelta(const Entity& inEntity, uint8_t fields, NetBuf& outBuf, EntityEncoding encoding = EntityEncoding::Full);
+    
+    //outEntity should already contain the baseline the delta was made against
+    //fields is set to the field mask that was read
+    static bool deserializeDelta(Entity& outEntity, uint8_t& fields, NetBuf& inBuf, EntityEncoding encoding = EntityEncoding::Full);
+    
+    //quantized positions are only valid within [-WORLD_EXTENT, WORLD_EXTENT] on every axis
+    static constexpr float WORLD_EXTENT = 4096.0f;
+    static constexpr float POSITION_PRECISION = 1.0f / 128.0f;
+    
+    static constexpr uint8_t ROTATION_COMPONENT_BITS = 10;
     
-    static bool deserialize(Entity& outEntity, NetBuf& inBuf);
+    //entities with this index don't get drawn
+    static constexpr uint16_t NULL_MODEL_INDEX = 0;
 };
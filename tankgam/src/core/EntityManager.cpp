@@ -1,83 +1,91 @@
 #include "EntityManager.h"
 
 #include <stdexcept>
+#include <limits>
 
-EntityManager::EntityManager() = default;
+#include "NetBuf.h"
 
-EntityManager::~EntityManager() = default;
-
-#ifdef ENTITY_MANAGER_COPY_CONSTRUCTOR
-EntityManager::EntityManager(const EntityManager& o)
+bool EntityId::serialize(EntityId id, NetBuf& outBuf)
 {
-    std::copy(o.usedEntities.begin(), o.usedEntities.end(), usedEntities.begin());
-    std::copy(o.entities.begin(), o.entities.end(), entities.begin());
+    if (!outBuf.writeUint16(id.index))
+    {
+        return false;
+    }
+    
+    return outBuf.writeUint8(id.generation);
 }
 
-EntityManager& EntityManager::operator=(const EntityManager& o)
+bool EntityId::deserialize(EntityId& outId, NetBuf& inBuf)
 {
-    if (&o == this)
+    if (!inBuf.readUint16(outId.index))
     {
-        return *this;
+        return false;
     }
     
-    std::copy(o.usedEntities.begin(), o.usedEntities.end(), usedEntities.begin());
-    std::copy(o.entities.begin(), o.entities.end(), entities.begin());
-    
-    return *this;
+    return inBuf.readUint8(outId.generation);
 }
-#endif
 
-EntityManager::EntityManager(EntityManager&& o) noexcept
+bool EntityId::isNewerGeneration(uint8_t a, uint8_t b)
 {
-    std::swap(usedEntities, o.usedEntities);
-    std::swap(entities, o.entities);
+    return static_cast<int8_t>(a - b) > 0;
 }
 
-EntityManager& EntityManager::operator=(EntityManager&& o) noexcept
+EntityPool::EntityPool(uint16_t firstIndex, size_t capacity)
+    : firstIndex{ firstIndex }, capacity{ capacity },
+      denseIndices(capacity, NOT_LIVE),
+      generations(capacity, 0),
+      nextFree(capacity, NO_SLOT),
+      prevFree(capacity, NO_SLOT),
+      freeHead{ NO_SLOT }, freeTail{ NO_SLOT }
 {
-    if (&o == this)
+    ids.reserve(capacity);
+    positions.reserve(capacity);
+    rotations.reserve(capacity);
+    modelIndices.reserve(capacity);
+    
+    //hand out the lowest ids first
+    for (size_t i = 0; i < capacity; i++)
     {
-        return *this;
+        linkFreeSlot(static_cast<uint32_t>(i));
     }
-    
-    std::swap(usedEntities, o.usedEntities);
-    std::swap(entities, o.entities);
-    
-    return *this;
 }
 
-bool EntityManager::operator==(const EntityManager& o) const
+EntityPool::~EntityPool() = default;
+
+bool EntityPool::operator==(const EntityPool& o) const
 {
     if (&o == this)
     {
         return true;
     }
     
-    for (size_t i = 0; i < MAX_LOCAL_ENTITIES; i++)
+    if (firstIndex != o.firstIndex || capacity != o.capacity || ids.size() != o.ids.size())
     {
-        if (usedEntities[i] != o.usedEntities[i])
-        {
-            return false;
-        }
+        return false;
     }
     
-    for (size_t i = 0; i < MAX_LOCAL_ENTITIES; i++)
+    //the dense order depends on the order things were freed in, so match them up by id
+    for (size_t i = 0; i < ids.size(); i++)
     {
-        const Entity& entity = entities[i];
-        const Entity& oEntity = o.entities[i];
+        if (!o.exists(ids[i]))
+        {
+            return false;
+        }
         
-        if ((glm::length(entity.position) - glm::length(oEntity.position)) >= 0.001f)
+        const uint32_t oIndex = o.denseIndices[ids[i].index - firstIndex];
+        
+        if ((glm::length(positions[i]) - glm::length(o.positions[oIndex])) >= 0.001f)
         {
             return false;
         }
         
-        if (const float matching = glm::dot(entity.rotation, oEntity.rotation);
+        if (const float matching = glm::dot(rotations[i], o.rotations[oIndex]);
             std::abs(matching - 1.0f) >= 0.001f)
         {
             return false;
         }
         
-        if (entity.modelName != oEntity.modelName)
+        if (modelIndices[i] != o.modelIndices[oIndex])
         {
             return false;
         }
@@ -86,188 +94,358 @@ bool EntityManager::operator==(const EntityManager& o) const
     return true;
 }
 
-EntityId EntityManager::allocateLocalEntity()
+EntityId EntityPool::allocate()
 {
-    for (size_t i = MAX_GLOBAL_ENTITIES; i < MAX_LOCAL_ENTITIES; i++)
+    if (freeHead == NO_SLOT)
     {
-        if (!usedEntities[i])
-        {
-            usedEntities[i] = true;
-            entities[i] = {};
-            
-            return static_cast<EntityId>(i);
-        }
+        throw std::runtime_error{ "Ran out of room for entities!" };
     }
     
-    throw std::runtime_error{ "Ran out of room for local entities!" };
-}
-
-void EntityManager::freeLocalEntity(EntityId id)
-{
-    if (!isLocalId(id))
-    {
-        throw std::runtime_error{ "Tried to free a not local id id!" };
-    }
+    const EntityId id{ static_cast<uint16_t>(firstIndex + freeHead), generations[freeHead] };
+    allocate(id);
     
-    const size_t realId = static_cast<size_t>(id);
-    
-    usedEntities[realId] = false;
+    return id;
 }
 
-void EntityManager::allocateGlobalEntity(EntityId netId)
+void EntityPool::allocate(EntityId id)
 {
-    const size_t realId = static_cast<size_t>(netId);
-    if (realId >= MAX_GLOBAL_ENTITIES)
+    if (!contains(id))
     {
-        throw std::runtime_error{ "Tried to allocate global entity outside of available id range!" };
+        throw std::runtime_error{ "Tried to allocate entity outside of available id range!" };
     }
     
-    if (usedEntities[realId])
+    const uint32_t slot = static_cast<uint32_t>(id.index - firstIndex);
+    if (denseIndices[slot] != NOT_LIVE)
     {
-        throw std::runtime_error{ "Tried to allocate global entity in occupied slot!" };
+        throw std::runtime_error{ "Tried to allocate entity in occupied slot!" };
     }
     
-    usedEntities[realId] = true;
-    entities[realId] = {};
+    unlinkFreeSlot(slot);
+    
+    //whoever handed us the id gets to decide the generation
+    generations[slot] = id.generation;
+    
+    denseIndices[slot] = static_cast<uint32_t>(ids.size());
+    ids.push_back(id);
+    positions.emplace_back();
+    rotations.emplace_back();
+    modelIndices.push_back(Entity::NULL_MODEL_INDEX);
 }
 
-EntityId EntityManager::allocateGlobalEntity()
+bool EntityPool::claim(EntityId id)
 {
-    EntityId netId;
-    
-    bool emptySpot = false;
-    for (size_t i = 0; i < MAX_GLOBAL_ENTITIES; i++)
+    if (!contains(id))
     {
-        if (!usedEntities[i])
-        {
-            netId = static_cast<EntityId>(i);
-            emptySpot = true;
-            
-            break;
-        }
+        return false;
     }
     
-    if (!emptySpot)
+    const uint32_t slot = static_cast<uint32_t>(id.index - firstIndex);
+    if (denseIndices[slot] != NOT_LIVE)
     {
-        throw std::runtime_error{ "Ran out of global ids!" };
+        const uint8_t generation = generations[slot];
+        if (generation == id.generation)
+        {
+            return true;
+        }
+        
+        if (!EntityId::isNewerGeneration(id.generation, generation))
+        {
+            return false;
+        }
+        
+        free(EntityId{ id.index, generation });
     }
     
-    allocateGlobalEntity(netId);
+    allocate(id);
     
-    return netId;
+    return true;
 }
 
-void EntityManager::freeGlobalEntity(EntityId netId)
+void EntityPool::free(EntityId id)
 {
-    if (!isGlobalId(netId))
+    if (!exists(id))
     {
-        throw std::runtime_error{ "Tried to free a not global id id!" };
+        throw std::runtime_error{ "Tried to free an entity that doesn't exist!" };
     }
     
-    const size_t realId = static_cast<size_t>(netId);
+    const uint32_t slot = static_cast<uint32_t>(id.index - firstIndex);
+    const uint32_t index = denseIndices[slot];
     
-    usedEntities[realId] = false;
+    //move the last live entity into the hole so everything stays packed
+    const uint32_t lastIndex = static_cast<uint32_t>(ids.size() - 1);
+    if (index != lastIndex)
+    {
+        const EntityId lastId = ids[lastIndex];
+        
+        ids[index] = lastId;
+        positions[index] = positions[lastIndex];
+        rotations[index] = rotations[lastIndex];
+        modelIndices[index] = modelIndices[lastIndex];
+        
+        denseIndices[lastId.index - firstIndex] = index;
+    }
+    
+    ids.pop_back();
+    positions.pop_back();
+    rotations.pop_back();
+    modelIndices.pop_back();
+    
+    denseIndices[slot] = NOT_LIVE;
+    generations[slot]++;
+    
+    linkFreeSlot(slot);
 }
 
-bool EntityManager::doesEntityExist(EntityId entityId) const
+bool EntityPool::contains(EntityId id) const
 {
-    return usedEntities[entityId];
+    return id.index >= firstIndex && static_cast<size_t>(id.index - firstIndex) < capacity;
 }
 
-bool EntityManager::isGlobalId(EntityId entityId) const
+bool EntityPool::exists(EntityId id) const
 {
-    if (entityId > MAX_GLOBAL_ENTITIES)
+    if (!contains(id))
     {
         return false;
     }
+    
+    const uint32_t slot = static_cast<uint32_t>(id.index - firstIndex);
+    
+    return denseIndices[slot] != NOT_LIVE && generations[slot] == id.generation;
+}
 
-#if 0
-    if (!usedEntities[entityId])
+bool EntityPool::get(EntityId id, Entity& outEntity) const
+{
+    if (!exists(id))
     {
         return false;
     }
-#endif
+    
+    const uint32_t index = denseIndices[id.index - firstIndex];
+    outEntity.position = positions[index];
+    outEntity.rotation = rotations[index];
+    outEntity.modelIndex = modelIndices[index];
     
     return true;
 }
 
-bool EntityManager::isLocalId(EntityId entityId) const
+bool EntityPool::set(EntityId id, const Entity& entity)
 {
-    if (entityId < MAX_GLOBAL_ENTITIES || entityId > MAX_LOCAL_ENTITIES)
+    if (!exists(id))
     {
         return false;
     }
+    
+    const uint32_t index = denseIndices[id.index - firstIndex];
+    positions[index] = entity.position;
+    rotations[index] = entity.rotation;
+    modelIndices[index] = entity.modelIndex;
+    
+    return true;
+}
 
-#if 0
-    if (!usedEntities[entityId])
+bool EntityPool::getIndex(EntityId id, size_t& outIndex) const
+{
+    if (!exists(id))
     {
         return false;
     }
-#endif
+    
+    outIndex = denseIndices[id.index - firstIndex];
     
     return true;
 }
 
-std::vector<EntityId> EntityManager::getGlobalEntities() const
+EntityView EntityPool::getView()
+{
+    return EntityView{ ids, positions, rotations, modelIndices };
+}
+
+size_t EntityPool::size() const
 {
-    std::vector<EntityId> entities;
-    for (size_t i = 0; i < MAX_GLOBAL_ENTITIES; i++)
+    return ids.size();
+}
+
+size_t EntityPool::getCapacity() const
+{
+    return capacity;
+}
+
+void EntityPool::linkFreeSlot(uint32_t slot)
+{
+    prevFree[slot] = freeTail;
+    nextFree[slot] = NO_SLOT;
+    
+    if (freeTail != NO_SLOT)
     {
-        if (!usedEntities[i])
-        {
-            continue;
-        }
-        
-        entities.push_back(static_cast<EntityId>(i));
+        nextFree[freeTail] = slot;
+    }
+    else
+    {
+        freeHead = slot;
     }
     
-    return entities;
+    freeTail = slot;
 }
 
-std::vector<EntityId> EntityManager::getLocalEntities() const
+void EntityPool::unlinkFreeSlot(uint32_t slot)
 {
-    std::vector<EntityId> entities;
-    for (size_t i = MAX_GLOBAL_ENTITIES; i < MAX_LOCAL_ENTITIES; i++)
+    if (prevFree[slot] != NO_SLOT)
     {
-        if (!usedEntities[i])
-        {
-            continue;
-        }
-        
-        entities.push_back(static_cast<EntityId>(i));
+        nextFree[prevFree[slot]] = nextFree[slot];
+    }
+    else
+    {
+        freeHead = nextFree[slot];
     }
     
-    return entities;
+    if (nextFree[slot] != NO_SLOT)
+    {
+        prevFree[nextFree[slot]] = prevFree[slot];
+    }
+    else
+    {
+        freeTail = prevFree[slot];
+    }
+    
+    prevFree[slot] = NO_SLOT;
+    nextFree[slot] = NO_SLOT;
 }
 
-Entity* EntityManager::getGlobalEntity(EntityId id)
+EntityManager::EntityManager(size_t maxGlobalEntities, size_t maxLocalEntities)
+    : globalEntities{ 0, checkMaxEntities(maxGlobalEntities, maxLocalEntities) },
+      localEntities{ static_cast<uint16_t>(maxGlobalEntities), maxLocalEntities }
+{
+}
+
+EntityManager::~EntityManager() = default;
+
+#ifdef ENTITY_MANAGER_COPY_CONSTRUCTOR
+EntityManager::EntityManager(const EntityManager& o) = default;
+
+EntityManager& EntityManager::operator=(const EntityManager& o) = default;
+#endif
+
+EntityManager::EntityManager(EntityManager&& o) noexcept = default;
+
+EntityManager& EntityManager::operator=(EntityManager&& o) noexcept = default;
+
+bool EntityManager::operator==(const EntityManager& o) const
 {
-    if (!isGlobalId(id))
+    if (&o == this)
     {
-        return nullptr;
+        return true;
     }
     
-    const size_t realId = static_cast<size_t>(id);
-    if (!usedEntities[realId])
+    return globalEntities == o.globalEntities && localEntities == o.localEntities;
+}
+
+EntityId EntityManager::allocateLocalEntity()
+{
+    return localEntities.allocate();
+}
+
+void EntityManager::freeLocalEntity(EntityId id)
+{
+    if (!isLocalId(id))
     {
-        return nullptr;
+        throw std::runtime_error{ "Tried to free a not local id id!" };
     }
     
-    return &entities[realId];
+    localEntities.free(id);
 }
 
-Entity* EntityManager::getLocalEntity(EntityId id)
+void EntityManager::allocateGlobalEntity(EntityId netId)
 {
-    if (!isLocalId(id))
+    globalEntities.allocate(netId);
+}
+
+EntityId EntityManager::allocateGlobalEntity()
+{
+    return globalEntities.allocate();
+}
+
+void EntityManager::freeGlobalEntity(EntityId netId)
+{
+    if (!isGlobalId(netId))
     {
-        return nullptr;
+        throw std::runtime_error{ "Tried to free a not global id id!" };
     }
     
-    const size_t realId = static_cast<size_t>(id);
-    if (!usedEntities[realId])
+    globalEntities.free(netId);
+}
+
+bool EntityManager::claimGlobalEntity(EntityId netId)
+{
+    return globalEntities.claim(netId);
+}
+
+bool EntityManager::doesEntityExist(EntityId entityId) const
+{
+    return globalEntities.exists(entityId) || localEntities.exists(entityId);
+}
+
+bool EntityManager::isGlobalId(EntityId entityId) const
+{
+    return globalEntities.contains(entityId);
+}
+
+bool EntityManager::isLocalId(EntityId entityId) const
+{
+    return localEntities.contains(entityId);
+}
+
+EntityView EntityManager::getGlobalEntities()
+{
+    return globalEntities.getView();
+}
+
+EntityView EntityManager::getLocalEntities()
+{
+    return localEntities.getView();
+}
+
+bool EntityManager::getGlobalEntity(EntityId id, Entity& outEntity) const
+{
+    return globalEntities.get(id, outEntity);
+}
+
+bool EntityManager::setGlobalEntity(EntityId id, const Entity& entity)
+{
+    return globalEntities.set(id, entity);
+}
+
+bool EntityManager::getGlobalIndex(EntityId id, size_t& outIndex) const
+{
+    return globalEntities.getIndex(id, outIndex);
+}
+
+bool EntityManager::getLocalEntity(EntityId id, Entity& outEntity) const
+{
+    return localEntities.get(id, outEntity);
+}
+
+bool EntityManager::setLocalEntity(EntityId id, const Entity& entity)
+{
+    return localEntities.set(id, entity);
+}
+
+size_t EntityManager::getMaxGlobalEntities() const
+{
+    return globalEntities.getCapacity();
+}
+
+size_t EntityManager::getMaxLocalEntities() const
+{
+    return localEntities.getCapacity();
+}
+
+size_t EntityManager::checkMaxEntities(size_t maxGlobalEntities, size_t maxLocalEntities)
+{
+    if (maxGlobalEntities > std::numeric_limits<uint16_t>::max() ||
+        maxLocalEntities > std::numeric_limits<uint16_t>::max() - maxGlobalEntities)
     {
-        return nullptr;
+        throw std::runtime_error{ "Too many entities to fit in an entity id!" };
     }
     
-    return &entities[realId];
+    return maxGlobalEntities;
 }
@@ -1,20 +1,125 @@
 #pragma once
 
-#include <array>
 #include <cstdint>
 #include <cstring>
+#include <compare>
+#include <span>
 #include <vector>
 
 #include "Entity.h"
 
-using EntityId = uint16_t;
+class NetBuf;
+
+//the slot an entity lives in, plus how many times that slot had been reused when it was handed out
+//once the entity is freed its id stops matching, so a stale id can't reach whatever takes the slot next
+struct EntityId
+{
+    uint16_t index;
+    uint8_t generation;
+    
+    auto operator<=>(const EntityId& o) const = default;
+    
+    //3 bytes on the wire
+    static bool serialize(EntityId id, NetBuf& outBuf);
+    
+    static bool deserialize(EntityId& outId, NetBuf& inBuf);
+    
+    //whether a was handed out after b, taking wraparound into account
+    static bool isNewerGeneration(uint8_t a, uint8_t b);
+};
+
+//the live entities of one id range, packed together so systems can walk straight through them
+//every span is the same length and an index means the same entity in all of them
+//only valid until the next entity in the range is allocated or freed
+struct EntityView
+{
+    std::span<const EntityId> ids;
+    std::span<glm::vec3> positions;
+    std::span<glm::quat> rotations;
+    std::span<uint16_t> modelIndices;
+    
+    size_t size() const { return ids.size(); }
+    bool empty() const { return ids.empty(); }
+};
+
+//a contiguous range of ids, with the fields of the live ones stored as seperate dense arrays
+class EntityPool
+{
+public:
+    EntityPool(uint16_t firstIndex, size_t capacity);
+    ~EntityPool();
+    
+    bool operator==(const EntityPool& o) const;
+    
+    //grabs any free id, throws if there's none left
+    EntityId allocate();
+    
+    //grabs a specific id, throws if the slot is taken or out of range
+    void allocate(EntityId id);
+    
+    //makes sure the id exists, throwing out an older entity that's still in its slot
+    //returns false if the slot already holds a newer one
+    bool claim(EntityId id);
+    
+    //throws if the id is stale
+    void free(EntityId id);
+    
+    //only checks the index
+    bool contains(EntityId id) const;
+    
+    bool exists(EntityId id) const;
+    
+    bool get(EntityId id, Entity& outEntity) const;
+    
+    bool set(EntityId id, const Entity& entity);
+    
+    //where the entity is in getView(), returns false for stale ids
+    bool getIndex(EntityId id, size_t& outIndex) const;
+    
+    EntityView getView();
+    
+    size_t size() const;
+    
+    size_t getCapacity() const;
+
+private:
+    static constexpr uint32_t NOT_LIVE = UINT32_MAX;
+    static constexpr uint32_t NO_SLOT = UINT32_MAX;
+    
+    uint16_t firstIndex;
+    size_t capacity;
+    
+    //indexed by slot (index - firstIndex)
+    std::vector<uint32_t> denseIndices;
+    std::vector<uint8_t> generations;
+    
+    //free slots are queued up oldest first, so a slot goes through as many other slots
+    //as possible before its generation gets bumped again
+    std::vector<uint32_t> nextFree;
+    std::vector<uint32_t> prevFree;
+    uint32_t freeHead;
+    uint32_t freeTail;
+    
+    //indexed by dense index, only the first size() entries are live
+    std::vector<EntityId> ids;
+    std::vector<glm::vec3> positions;
+    std::vector<glm::quat> rotations;
+    std::vector<uint16_t> modelIndices;
+    
+    void linkFreeSlot(uint32_t slot);
+    
+    void unlinkFreeSlot(uint32_t slot);
+};
 
 class EntityManager
 {
 public:
-    EntityManager();
+    //global entities mapped from range of [0, maxGlobalEntities)
+    //local entities mapped from a range of [maxGlobalEntities, maxGlobalEntities + maxLocalEntities)
+    explicit EntityManager(size_t maxGlobalEntities = DEFAULT_MAX_GLOBAL_ENTITIES,
+                           size_t maxLocalEntities = DEFAULT_MAX_LOCAL_ENTITIES);
     ~EntityManager();
-
+    
 #ifdef ENTITY_MANAGER_COPY_CONSTRUCTOR
     EntityManager(const EntityManager& o);
     EntityManager& operator=(const EntityManager& o);
@@ -35,29 +140,47 @@ public:
     
     void freeGlobalEntity(EntityId netId);
     
+    //for mirroring the server's entities, see EntityPool::claim
+    bool claimGlobalEntity(EntityId netId);
+    
+    //false for stale ids
     bool doesEntityExist(EntityId entityId) const;
     
     bool isGlobalId(EntityId entityId) const;
     
     bool isLocalId(EntityId entityId) const;
     
-    std::vector<EntityId> getGlobalEntities() const;
+    //doesn't allocate, but is in no particular order
+    EntityView getGlobalEntities();
+    
+    EntityView getLocalEntities();
+    
+    //entities are stored field by field, so these copy in and out
+    bool getGlobalEntity(EntityId id, Entity& outEntity) const;
     
-    std::vector<EntityId> getLocalEntities() const;
+    bool setGlobalEntity(EntityId id, const Entity& entity);
     
-    Entity* getGlobalEntity(EntityId id);
+    //where the entity is in getGlobalEntities(), for systems that already have the id
+    bool getGlobalIndex(EntityId id, size_t& outIndex) const;
     
-    Entity* getLocalEntity(EntityId id);
+    bool getLocalEntity(EntityId id, Entity& outEntity) const;
+    
+    bool setLocalEntity(EntityId id, const Entity& entity);
+    
+    size_t getMaxGlobalEntities() const;
+    
+    size_t getMaxLocalEntities() const;
     
     static constexpr size_t NUM_ENTITY_MANAGERS = 128;
     
+    static constexpr size_t DEFAULT_MAX_GLOBAL_ENTITIES = 256;
+    static constexpr size_t DEFAULT_MAX_LOCAL_ENTITIES = 256;
+
 private:
-    //global entities mapped from range of [0, MAX_GLOBAL_ENTITIES)
-    static constexpr size_t MAX_GLOBAL_ENTITIES = 256;
-    
-    //local entities mapped from a range of [MAX_GLOBAL_ENTITIES, MAX_LOCAL_ENTITIES)
-    static constexpr size_t MAX_LOCAL_ENTITIES = MAX_GLOBAL_ENTITIES * 2;
+    EntityPool globalEntities;
+    EntityPool localEntities;
     
-    std::array<bool, MAX_LOCAL_ENTITIES> usedEntities = {};
-    std::array<Entity, MAX_LOCAL_ENTITIES> entities = {};
+    //throws if both pools together won't fit in an entity id, otherwise returns maxGlobalEntities
+    //called while building the pools so nothing gets allocated with sizes that wrapped around
+    static size_t checkMaxEntities(size_t maxGlobalEntities, size_t maxLocalEntities);
 };
@@ -0,0 +1,194 @@
+#include "JobSystem.h"
+
+#include <algorithm>
+
+//which JobSystem's worker this thread is, if any
+static thread_local const JobSystem* currentJobSystem = nullptr;
+static thread_local size_t currentQueueIndex = 0;
+
+JobSystem::JobSystem(size_t numThreads)
+    : running{ true }, numQueuedJobs{ 0 }
+{
+    if (numThreads == 0)
+    {
+        numThreads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    }
+
+    //the calling thread does its share, so it gets a queue but not a thread
+    for (size_t i = 0; i < numThreads; i++)
+    {
+        queues.push_back(std::make_unique<JobQueue>());
+    }
+
+    for (size_t i = 0; i + 1 < numThreads; i++)
+    {
+        workers.emplace_back(&JobSystem::workerLoop, this, i);
+    }
+}
+
+JobSystem::~JobSystem()
+{
+    {
+        std::lock_guard<std::mutex> lock{ wakeMutex };
+        running = false;
+    }
+    wakeCondition.notify_all();
+
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+}
+
+void JobSystem::parallelFor(size_t count, size_t batchSize, const std::function<void(size_t begin, size_t end)>& func)
+{
+    if (count == 0)
+    {
+        return;
+    }
+
+    batchSize = std::max<size_t>(batchSize, 1);
+    if (count <= batchSize || workers.empty())
+    {
+        func(0, count);
+        return;
+    }
+
+    const size_t numBatches = (count + batchSize - 1) / batchSize;
+    JobBatch jobBatch{ &func, numBatches, {}, {} };
+
+    //counted before they're queued, so it never drops below zero when they get taken
+    {
+        std::lock_guard<std::mutex> lock{ wakeMutex };
+        numQueuedJobs += numBatches;
+    }
+
+    //deal the batches out to every queue, whoever finishes early steals the rest
+    for (size_t batch = 0; batch < numBatches; batch++)
+    {
+        const size_t begin = batch * batchSize;
+        const Job job{ &jobBatch, begin, std::min(begin + batchSize, count) };
+
+        JobQueue& queue = *queues[batch % queues.size()];
+        std::lock_guard<std::mutex> lock{ queue.mutex };
+        queue.jobs.push_back(job);
+    }
+
+    wakeCondition.notify_all();
+
+    //help out until our batches are done, which might mean running someone else's jobs
+    const size_t queueIndex = getQueueIndex();
+    while (jobBatch.remaining.load(std::memory_order_acquire) > 0)
+    {
+        Job job;
+        if (popJob(queueIndex, job))
+        {
+            runJob(job);
+        }
+        else
+        {
+            //the last few are still running on other threads
+            std::this_thread::yield();
+        }
+    }
+
+    //nothing else can touch it now that every job is done
+    if (jobBatch.exception)
+    {
+        std::rethrow_exception(jobBatch.exception);
+    }
+}
+
+size_t JobSystem::getNumThreads() const
+{
+    return queues.size();
+}
+
+void JobSystem::workerLoop(size_t queueIndex)
+{
+    currentJobSystem = this;
+    currentQueueIndex = queueIndex;
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock{ wakeMutex };
+            wakeCondition.wait(lock, [this]() -> bool
+                {
+                    return !running || numQueuedJobs > 0;
+                });
+
+            if (!running)
+            {
+                return;
+            }
+        }
+
+        Job job;
+        while (popJob(queueIndex, job))
+        {
+            runJob(job);
+        }
+    }
+}
+
+size_t JobSystem::getQueueIndex() const
+{
+    if (currentJobSystem == this)
+    {
+        return currentQueueIndex;
+    }
+
+    return queues.size() - 1;
+}
+
+bool JobSystem::popJob(size_t queueIndex, Job& outJob)
+{
+    {
+        JobQueue& queue = *queues[queueIndex];
+        std::lock_guard<std::mutex> lock{ queue.mutex };
+        if (!queue.jobs.empty())
+        {
+            outJob = queue.jobs.back();
+            queue.jobs.pop_back();
+            numQueuedJobs--;
+
+            return true;
+        }
+    }
+
+    for (size_t i = 1; i < queues.size(); i++)
+    {
+        JobQueue& queue = *queues[(queueIndex + i) % queues.size()];
+        std::lock_guard<std::mutex> lock{ queue.mutex };
+        if (!queue.jobs.empty())
+        {
+            outJob = queue.jobs.front();
+            queue.jobs.pop_front();
+            numQueuedJobs--;
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void JobSystem::runJob(const Job& job)
+{
+    //the job has to be counted as done no matter what, or parallelFor never returns
+    try
+    {
+        (*job.batch->func)(job.begin, job.end);
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> lock{ job.batch->exceptionMutex };
+        if (!job.batch->exception)
+        {
+            job.batch->exception = std::current_exception();
+        }
+    }
+
+    job.batch->remaining.fetch_sub(1, std::memory_order_acq_rel);
+}
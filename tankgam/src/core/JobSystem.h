@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+//a pool of worker threads for splitting loops up across every core
+//every thread has its own queue of jobs, and steals from the others once it runs dry
+class JobSystem
+{
+public:
+    //0 means one thread per core, counting whichever thread calls parallelFor
+    explicit JobSystem(size_t numThreads = 0);
+    ~JobSystem();
+
+    JobSystem(const JobSystem&) = delete;
+    JobSystem& operator=(const JobSystem&) = delete;
+
+    //splits [0, count) into runs of batchSize and calls func(begin, end) for each of them on any thread
+    //the calling thread helps out, and doesn't return until every batch is done
+    //anything that fits in a single batch just runs on the calling thread
+    //safe to call from inside a job
+    //if func throws, every batch still runs and the first exception gets rethrown here afterwards
+    void parallelFor(size_t count, size_t batchSize, const std::function<void(size_t begin, size_t end)>& func);
+
+    //including the thread calling parallelFor
+    size_t getNumThreads() const;
+
+private:
+    //everything the jobs of one parallelFor share, lives on the stack of whoever called it
+    struct JobBatch
+    {
+        const std::function<void(size_t, size_t)>* func;
+
+        //counts down as the jobs finish, parallelFor can't return until it hits 0
+        std::atomic<size_t> remaining;
+
+        //the first thing a job threw, if any
+        std::mutex exceptionMutex;
+        std::exception_ptr exception;
+    };
+
+    struct Job
+    {
+        JobBatch* batch;
+        size_t begin;
+        size_t end;
+    };
+
+    //kept on seperate cache lines so threads don't fight over each other's locks
+    struct alignas(64) JobQueue
+    {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+
+    //one for every worker, the last one is shared by threads that aren't workers
+    std::vector<std::unique_ptr<JobQueue>> queues;
+    std::vector<std::thread> workers;
+
+    std::atomic<bool> running;
+
+    //workers sleep on this while there's nothing queued anywhere
+    std::mutex wakeMutex;
+    std::condition_variable wakeCondition;
+    std::atomic<size_t> numQueuedJobs;
+
+    void workerLoop(size_t queueIndex);
+
+    //the queue of the worker we're on, or the shared one
+    size_t getQueueIndex() const;
+
+    //takes the newest job from our own queue, then the oldest from anyone else's
+    bool popJob(size_t queueIndex, Job& outJob);
+
+    static void runJob(const Job& job);
+};
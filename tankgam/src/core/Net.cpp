@@ -1,20 +1,192 @@
 #include "Net.h"
 
+#include <stdexcept>
+#include <algorithm>
+#include <limits>
+#include <thread>
+
 #include <util/Log.h>
 
-Net::Net(Log& log, bool initClient, bool initServer)
-    : log{ log }, netLoopback{ log, initClient, initServer }
+Net::Net(Log& log, bool initClient, bool initServer, NetBackend backend, uint16_t serverPort)
+    : log{ log }, backend{ backend }, serverAddr{ NetAddrType::Loopback, 0, {} },
+      bufPool{}
 {
+    switch (backend)
+    {
+    case NetBackend::Loopback:
+        log.log(LogLevel::Info, "Net: Using loopback backend");
+        netLoopback = std::make_unique<NetLoopback>(log, initClient, initServer);
+        break;
+    case NetBackend::Udp:
+#if __linux
+        log.log(LogLevel::Info, "Net: Using udp backend");
+        netUdp = std::make_unique<NetUdp>(log, initClient, initServer, serverPort);
+        
+        //127.0.0.1, as ipv4 mapped
+        serverAddr = NetAddr{ NetAddrType::Ip, serverPort, { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 127, 0, 0, 1 } };
+        break;
+#else
+        (void)serverPort;
+        throw std::runtime_error{ "The udp net backend isn't available on this platform" };
+#endif
+    case NetBackend::InProcess:
+        log.log(LogLevel::Info, "Net: Using in process backend");
+        netInProcess = std::make_unique<NetInProcess>();
+        serverAddr = NetAddr{ NetAddrType::InProcess, 0, {} };
+        break;
+    default:
+        throw std::runtime_error{ "Unknown net backend" };
+    }
 }
 
 Net::~Net() = default;
 
 bool Net::getPacket(NetSrc src, NetBuf& buf, NetAddr& fromAddr)
 {
-    return netLoopback.getPacket(src, buf, fromAddr);
+#if __linux
+    if (backend == NetBackend::Udp)
+    {
+        return netUdp->getPacket(src, buf, fromAddr);
+    }
+#endif
+    if (backend == NetBackend::InProcess)
+    {
+        return netInProcess->getPacket(src, buf, fromAddr);
+    }
+    
+    return netLoopback->getPacket(src, buf, fromAddr);
+}
+
+size_t Net::getPackets(NetSrc src, std::span<NetBuf> bufs, std::span<NetAddr> fromAddrs)
+{
+#if __linux
+    if (backend == NetBackend::Udp)
+    {
+        return netUdp->getPackets(src, bufs, fromAddrs);
+    }
+#endif
+    if (backend == NetBackend::InProcess)
+    {
+        return netInProcess->getPackets(src, bufs, fromAddrs);
+    }
+    
+    return netLoopback->getPackets(src, bufs, fromAddrs);
 }
 
 void Net::sendPacket(NetSrc src, NetBuf buf, NetAddr toAddr)
 {
-    netLoopback.sendPacket(src, std::move(buf), toAddr);
+#if __linux
+    if (backend == NetBackend::Udp)
+    {
+        netUdp->sendPacket(src, std::move(buf), toAddr);
+        return;
+    }
+#endif
+    if (backend == NetBackend::InProcess)
+    {
+        netInProcess->sendPacket(src, std::move(buf), toAddr);
+        return;
+    }
+    
+    netLoopback->sendPacket(src, std::move(buf), toAddr);
+}
+
+void Net::flushPackets(NetSrc src)
+{
+#if __linux
+    if (backend == NetBackend::Udp)
+    {
+        netUdp->flushPackets(src);
+        return;
+    }
+#endif
+    if (backend == NetBackend::InProcess)
+    {
+        //packets are handed over as soon as they're sent
+        return;
+    }
+    
+    netLoopback->flushPackets(src);
+}
+
+bool Net::waitForPackets(NetSrc src, std::chrono::steady_clock::time_point deadline)
+{
+    if (backend == NetBackend::InProcess)
+    {
+        return netInProcess->waitForPackets(src, deadline);
+    }
+    
+    for (;;)
+    {
+        const auto now = std::chrono::steady_clock::now();
+        if (now >= deadline)
+        {
+            return false;
+        }
+        
+        //the sockets only wait in whole milliseconds, so sleep off whatever's left under one
+        //rounding it up instead would make us up to a millisecond late
+        const int64_t timeoutMs = std::chrono::floor<std::chrono::milliseconds>(deadline - now).count();
+        if (timeoutMs == 0)
+        {
+            std::this_thread::sleep_until(deadline);
+            return false;
+        }
+        
+        const int timeout = static_cast<int>(std::min<int64_t>(timeoutMs, std::numeric_limits<int>::max()));
+        
+#if __linux
+        const bool hasPackets = backend == NetBackend::Udp ?
+            netUdp->waitForPackets(src, timeout) :
+            netLoopback->waitForPackets(src, timeout);
+#else
+        const bool hasPackets = netLoopback->waitForPackets(src, timeout);
+#endif
+        
+        if (hasPackets)
+        {
+            return true;
+        }
+    }
+}
+
+NetBackend Net::getBackend() const
+{
+    return backend;
+}
+
+bool Net::isBackendSupported(NetBackend backend)
+{
+#if __linux
+    (void)backend;
+    return true;
+#else
+    return backend != NetBackend::Udp;
+#endif
+}
+
+NetBufPool& Net::getBufPool()
+{
+    return bufPool;
+}
+
+NetAddr Net::getServerAddr() const
+{
+    return serverAddr;
+}
+
+void Net::setServerAddr(NetAddr addr)
+{
+    serverAddr = addr;
+}
+
+bool Net::resolveAddr(std::string_view str, NetAddr& outAddr)
+{
+#if __linux
+    return NetUdp::resolveAddr(str, DEFAULT_SERVER_PORT, outAddr);
+#else
+    (void)str;
+    (void)outAddr;
+    return false;
+#endif
 }
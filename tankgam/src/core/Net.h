@@ -4,45 +4,130 @@
 #include <cstring>
 #include <unordered_map>
 #include <string>
+#include <string_view>
+#include <functional>
+#include <array>
+#include <memory>
+#include <span>
+#include <chrono>
 
 #include "NetBuf.h"
+#include "NetBufPool.h"
 #include "sys/NetLoopback.h"
+#if __linux
+    #include "sys/NetUdp.h"
+#endif
+#include "NetInProcess.h"
 
 enum class NetAddrType
 {
     Unknown,
     Loopback,
+    Ip,
+    InProcess,
 };
 
 struct NetAddr
 {
     NetAddrType type;
     uint16_t port;
+    
+    //ipv6, ipv4 addresses are stored mapped as ::ffff:a.b.c.d
+    std::array<uint8_t, 16> ip;
 
     auto operator<=>(const NetAddr&) const = default;
 };
 
+template<>
+struct std::hash<NetAddr>
+{
+    size_t operator()(const NetAddr& addr) const noexcept
+    {
+        size_t hash = std::hash<uint32_t>{}((static_cast<uint32_t>(addr.type) << 16) | addr.port);
+        for (uint8_t byte : addr.ip)
+        {
+            hash = hash * 31 + byte;
+        }
+        
+        return hash;
+    }
+};
+
 enum class NetSrc
 {
     Client,
     Server,
 };
 
+enum class NetBackend
+{
+    Loopback,
+    Udp,
+    
+    //server and client on seperate threads of the same process
+    InProcess,
+};
+
 class Log;
 
 class Net
 {
 public:
-    Net(Log& log, bool initClient = true, bool initServer = true);
+    Net(Log& log, bool initClient = true, bool initServer = true,
+        NetBackend backend = NetBackend::Loopback, uint16_t serverPort = DEFAULT_SERVER_PORT);
     ~Net();
 
     Net(const Net&) = delete;
     Net& operator=(const Net&) = delete;
 
     bool getPacket(NetSrc src, NetBuf& buf, NetAddr& fromAddr);
+    
+    //grab up to a batch of waiting packets at once
+    //returns how many of bufs & fromAddrs were filled in
+    size_t getPackets(NetSrc src, std::span<NetBuf> bufs, std::span<NetAddr> fromAddrs);
+    
+    //may be held back until the next flushPackets so they can go out together
     void sendPacket(NetSrc src, NetBuf buf, NetAddr toAddr);
+    
+    //send everything that's been queued up by sendPacket
+    void flushPackets(NetSrc src);
+
+    //blocks until a packet comes in for src or the deadline passes
+    //returns true if there's a packet waiting
+    bool waitForPackets(NetSrc src, std::chrono::steady_clock::time_point deadline);
+    
+    NetBackend getBackend() const;
+    
+    //udp only has a socket implementation on linux so far
+    static bool isBackendSupported(NetBackend backend);
+    
+    //make NetBufs out of this so they don't each need their own allocation
+    NetBufPool& getBufPool();
+    
+    //where the client connects to, the local server unless told otherwise
+    NetAddr getServerAddr() const;
+    void setServerAddr(NetAddr addr);
+    
+    //turns "host[:port]" into an address for the udp backend
+    //returns false if it couldn't be resolved
+    static bool resolveAddr(std::string_view str, NetAddr& outAddr);
+    
+    static constexpr size_t MAX_PACKET_BATCH = 32;
+    
+    static constexpr uint16_t DEFAULT_SERVER_PORT = 27500;
 
 private:
     Log& log;
-    NetLoopback netLoopback;
+    NetBackend backend;
+    NetAddr serverAddr;
+    
+    //has to outlive the backends, they hold onto buffers
+    NetBufPool bufPool;
+    
+    //only the one for our backend exists
+    std::unique_ptr<NetLoopback> netLoopback;
+#if __linux
+    std::unique_ptr<NetUdp> netUdp;
+#endif
+    std::unique_ptr<NetInProcess> netInProcess;
 };
@@ -1,35 +1,79 @@
 #include "NetBuf.h"
 
 #include <stdexcept>
+#include <utility>
 #include <algorithm>
 #include <limits>
+#include <cmath>
+
+#include "NetBufPool.h"
+
+uint8_t NetVec3Quantization::getAxisBits(int axis) const
+{
+    const float steps = std::ceil((maxs[axis] - mins[axis]) / precision);
+    
+    uint8_t bits = 1;
+    while (bits < 32 && static_cast<float>(1ull << bits) <= steps)
+    {
+        bits++;
+    }
+    
+    return bits;
+}
 
 NetBuf::NetBuf()
-    : data{}, dataWritten{ 0 }, dataRead{ 0 }
+    : pool{ nullptr }, block{ nullptr }, capacity{ MAX_BYTES }, dataOffset{ 0 },
+      dataWritten{ 0 }, dataRead{ 0 },
+      writeBitOffset{ 0 }, readBitOffset{ 0 }
+{
+}
+
+NetBuf::NetBuf(NetBufPool& pool)
+    : pool{ &pool }, block{ nullptr }, capacity{ MAX_BYTES }, dataOffset{ 0 },
+      dataWritten{ 0 }, dataRead{ 0 },
+      writeBitOffset{ 0 }, readBitOffset{ 0 }
 {
 }
 
 NetBuf::NetBuf(std::span<const std::byte> newData)
-    : data{}
+    : NetBuf{}
 {
-    if (newData.size() > data.size())
+    if (newData.size() > capacity)
     {
         throw std::runtime_error{ "Tried to create network buffer greater than the available space" };
     }
 
-    std::copy(newData.begin(), newData.end(), data.begin());
-    dataWritten = newData.size();
-    dataRead = 0;
+    writeBytes(newData);
+}
+
+NetBuf::NetBuf(NetBufPool& pool, std::span<const std::byte> newData)
+    : NetBuf{ pool }
+{
+    if (newData.size() > capacity)
+    {
+        throw std::runtime_error{ "Tried to create network buffer greater than the available space" };
+    }
+
+    writeBytes(newData);
 }
 
-NetBuf::~NetBuf() = default;
+NetBuf::NetBuf(NetBufPool& pool, size_t capacity)
+    : pool{ &pool }, block{ nullptr }, capacity{ capacity }, dataOffset{ 0 },
+      dataWritten{ 0 }, dataRead{ 0 },
+      writeBitOffset{ 0 }, readBitOffset{ 0 }
+{
+}
+
+NetBuf::~NetBuf()
+{
+    NetBufPool::release(block);
+}
 
 NetBuf::NetBuf(NetBuf&& o) noexcept
-    : data{}, dataWritten{ 0 }, dataRead{ 0 }
+    : pool{ o.pool }, block{ std::exchange(o.block, nullptr) }, capacity{ o.capacity }, dataOffset{ std::exchange(o.dataOffset, 0) },
+      dataWritten{ std::exchange(o.dataWritten, 0) }, dataRead{ std::exchange(o.dataRead, 0) },
+      writeBitOffset{ std::exchange(o.writeBitOffset, 0) }, readBitOffset{ std::exchange(o.readBitOffset, 0) }
 {
-    std::swap(data, o.data);
-    std::swap(dataWritten, o.dataWritten);
-    std::swap(dataRead, o.dataRead);
 }
 
 NetBuf& NetBuf::operator=(NetBuf&& o) noexcept
@@ -39,9 +83,17 @@ NetBuf& NetBuf::operator=(NetBuf&& o) noexcept
         return *this;
     }
 
-    std::swap(data, o.data);
-    std::swap(dataWritten, o.dataWritten);
-    std::swap(dataRead, o.dataRead);
+    //let go of what we had straight away, handing it to o could keep it out of the pool for ages
+    NetBufPool::release(block);
+
+    pool = o.pool;
+    block = std::exchange(o.block, nullptr);
+    capacity = o.capacity;
+    dataOffset = std::exchange(o.dataOffset, 0);
+    dataWritten = std::exchange(o.dataWritten, 0);
+    dataRead = std::exchange(o.dataRead, 0);
+    writeBitOffset = std::exchange(o.writeBitOffset, 0);
+    readBitOffset = std::exchange(o.readBitOffset, 0);
 
     return *this;
 }
@@ -50,18 +102,78 @@ std::span<const std::byte> NetBuf::getData() const
 {
     return std::span<const std::byte>
     {
-        data.begin(), data.begin() + dataWritten
+        getBytes(), dataWritten
     };
 }
 
+std::span<std::byte> NetBuf::beginDirectWrite()
+{
+    //no point copying over what we had if it's all getting overwritten
+    if (block && block->refCount.load(std::memory_order_acquire) != 1)
+    {
+        NetBufPool::release(block);
+        block = nullptr;
+    }
+    
+    dataOffset = 0;
+    dataWritten = 0;
+    dataRead = 0;
+    writeBitOffset = 0;
+    readBitOffset = 0;
+    
+    makeWritable();
+    
+    return std::span<std::byte>{ block->data, capacity };
+}
+
+bool NetBuf::endDirectWrite(size_t size)
+{
+    if (!checkWriteSpaceLeft(size))
+    {
+        return false;
+    }
+    
+    dataWritten = size;
+    
+    return true;
+}
+
+bool NetBuf::readView(NetBuf& outView, size_t size)
+{
+    if (!checkReadSpaceLeft(size))
+    {
+        return false;
+    }
+    
+    NetBuf view{};
+    view.pool = pool;
+    view.capacity = capacity;
+    if (size > 0)
+    {
+        block->refCount.fetch_add(1, std::memory_order_relaxed);
+        view.block = block;
+        view.dataOffset = dataOffset + dataRead;
+        view.dataWritten = size;
+    }
+    
+    outView = std::move(view);
+    
+    dataRead += size;
+    readBitOffset = 0;
+    
+    return true;
+}
+
 void NetBuf::beginWrite()
 {
     dataWritten = 0;
+    writeBitOffset = 0;
 }
 
 void NetBuf::beginRead()
 {
     dataRead = 0;
+    readBitOffset = 0;
 }
 
 //TODO: handle endianness
@@ -256,6 +368,248 @@ bool NetBuf::readQuat(glm::quat& v)
     return true;
 }
 
+bool NetBuf::writeBits(uint32_t v, uint8_t numBits)
+{
+    if (numBits > 32)
+    {
+        return false;
+    }
+    
+    //check that everything fits beforehand so we don't write half a value
+    {
+        const size_t freeBits = writeBitOffset == 0 ? 0 : 8 - writeBitOffset;
+        if (numBits > freeBits && !checkWriteSpaceLeft((numBits - freeBits + 7) / 8))
+        {
+            return false;
+        }
+    }
+    
+    makeWritable();
+    
+    uint8_t bitsLeft = numBits;
+    while (bitsLeft > 0)
+    {
+        //start a new byte
+        if (writeBitOffset == 0)
+        {
+            getBytes()[dataWritten++] = std::byte{ 0 };
+        }
+        
+        const uint8_t bits = std::min<uint8_t>(bitsLeft, 8 - writeBitOffset);
+        const uint32_t mask = (1u << bits) - 1;
+        
+        getBytes()[dataWritten - 1] |= static_cast<std::byte>((v & mask) << writeBitOffset);
+        
+        v >>= bits;
+        bitsLeft -= bits;
+        writeBitOffset = (writeBitOffset + bits) % 8;
+    }
+    
+    return true;
+}
+
+bool NetBuf::readBits(uint32_t& v, uint8_t numBits)
+{
+    v = 0;
+    
+    if (numBits > 32)
+    {
+        return false;
+    }
+    
+    {
+        const size_t availableBits = readBitOffset == 0 ? 0 : 8 - readBitOffset;
+        if (numBits > availableBits && !checkReadSpaceLeft((numBits - availableBits + 7) / 8))
+        {
+            return false;
+        }
+    }
+    
+    uint8_t bitsRead = 0;
+    while (bitsRead < numBits)
+    {
+        if (readBitOffset == 0)
+        {
+            dataRead++;
+        }
+        
+        const uint8_t bits = std::min<uint8_t>(numBits - bitsRead, 8 - readBitOffset);
+        const uint32_t mask = (1u << bits) - 1;
+        
+        const uint32_t byte = static_cast<uint32_t>(getBytes()[dataRead - 1]);
+        v |= ((byte >> readBitOffset) & mask) << bitsRead;
+        
+        bitsRead += bits;
+        readBitOffset = (readBitOffset + bits) % 8;
+    }
+    
+    return true;
+}
+
+bool NetBuf::writeQuantizedVec3(const glm::vec3& v, const NetVec3Quantization& quantization)
+{
+    const std::array<uint32_t, 3> quantized = quantizeVec3(v, quantization);
+    
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (!writeBits(quantized[axis], quantization.getAxisBits(axis)))
+        {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+bool NetBuf::readQuantizedVec3(glm::vec3& v, const NetVec3Quantization& quantization)
+{
+    std::array<uint32_t, 3> quantized{};
+    
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (!readBits(quantized[axis], quantization.getAxisBits(axis)))
+        {
+            return false;
+        }
+    }
+    
+    v = dequantizeVec3(quantized, quantization);
+    
+    return true;
+}
+
+bool NetBuf::writeQuantizedQuat(const glm::quat& v, uint8_t bitsPerComponent)
+{
+    if (bitsPerComponent > MAX_QUAT_COMPONENT_BITS)
+    {
+        return false;
+    }
+    
+    return writeBits(quantizeQuat(v, bitsPerComponent), 2 + 3 * bitsPerComponent);
+}
+
+bool NetBuf::readQuantizedQuat(glm::quat& v, uint8_t bitsPerComponent)
+{
+    if (bitsPerComponent > MAX_QUAT_COMPONENT_BITS)
+    {
+        return false;
+    }
+    
+    uint32_t quantized;
+    if (!readBits(quantized, 2 + 3 * bitsPerComponent))
+    {
+        return false;
+    }
+    
+    v = dequantizeQuat(quantized, bitsPerComponent);
+    
+    return true;
+}
+
+std::array<uint32_t, 3> NetBuf::quantizeVec3(const glm::vec3& v, const NetVec3Quantization& quantization)
+{
+    std::array<uint32_t, 3> quantized{};
+    
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const float maxStep = static_cast<float>((1ull << quantization.getAxisBits(axis)) - 1);
+        const float step = std::round((v[axis] - quantization.mins[axis]) / quantization.precision);
+        
+        //clamp lets NaN through, and casting that is undefined, so it goes to the bottom of the range
+        quantized[axis] = std::isnan(step) ? 0 : static_cast<uint32_t>(std::clamp(step, 0.0f, maxStep));
+    }
+    
+    return quantized;
+}
+
+glm::vec3 NetBuf::dequantizeVec3(const std::array<uint32_t, 3>& v, const NetVec3Quantization& quantization)
+{
+    glm::vec3 dequantized{};
+    
+    for (int axis = 0; axis < 3; axis++)
+    {
+        dequantized[axis] = quantization.mins[axis] + static_cast<float>(v[axis]) * quantization.precision;
+    }
+    
+    return dequantized;
+}
+
+//the components other than the largest one can only be within [-1/sqrt(2), 1/sqrt(2)]
+static constexpr float QUAT_COMPONENT_RANGE = 0.707107f;
+
+uint32_t NetBuf::quantizeQuat(const glm::quat& v, uint8_t bitsPerComponent)
+{
+    glm::quat q = glm::normalize(v);
+    
+    //anything non-finite doesn't survive normalizing, so it gets sent as no rotation at all
+    if (!std::isfinite(q.x) || !std::isfinite(q.y) || !std::isfinite(q.z) || !std::isfinite(q.w))
+    {
+        q = glm::identity<glm::quat>();
+    }
+    
+    //find the largest component, we can figure it out from the other three
+    int largest = 0;
+    for (int i = 1; i < 4; i++)
+    {
+        if (std::abs(q[i]) > std::abs(q[largest]))
+        {
+            largest = i;
+        }
+    }
+    
+    //q and -q are the same rotation, so make the largest one positive
+    const float sign = q[largest] < 0.0f ? -1.0f : 1.0f;
+    
+    const float maxStep = static_cast<float>((1u << bitsPerComponent) - 1);
+    
+    uint32_t quantized = static_cast<uint32_t>(largest);
+    uint8_t shift = 2;
+    for (int i = 0; i < 4; i++)
+    {
+        if (i == largest)
+        {
+            continue;
+        }
+        
+        const float normalized = (q[i] * sign + QUAT_COMPONENT_RANGE) / (2.0f * QUAT_COMPONENT_RANGE);
+        const uint32_t component = static_cast<uint32_t>(std::clamp(std::round(normalized * maxStep), 0.0f, maxStep));
+        
+        quantized |= component << shift;
+        shift += bitsPerComponent;
+    }
+    
+    return quantized;
+}
+
+glm::quat NetBuf::dequantizeQuat(uint32_t v, uint8_t bitsPerComponent)
+{
+    const int largest = static_cast<int>(v & 0x3);
+    
+    const uint32_t mask = (1u << bitsPerComponent) - 1;
+    const float maxStep = static_cast<float>(mask);
+    
+    glm::quat q{};
+    float sumSquares = 0.0f;
+    uint8_t shift = 2;
+    for (int i = 0; i < 4; i++)
+    {
+        if (i == largest)
+        {
+            continue;
+        }
+        
+        const float normalized = static_cast<float>((v >> shift) & mask) / maxStep;
+        q[i] = normalized * (2.0f * QUAT_COMPONENT_RANGE) - QUAT_COMPONENT_RANGE;
+        
+        sumSquares += q[i] * q[i];
+        shift += bitsPerComponent;
+    }
+    
+    q[largest] = std::sqrt(std::max(0.0f, 1.0f - sumSquares));
+    
+    return glm::normalize(q);
+}
+
 bool NetBuf::writeString(std::string_view str)
 {
     if (str.empty())
@@ -341,9 +695,12 @@ bool NetBuf::writeBytes(std::span<const std::byte> writeData)
         return false;
     }
 
-    std::copy(writeData.begin(), writeData.end(), data.begin() + dataWritten);
+    makeWritable();
+
+    std::copy(writeData.begin(), writeData.end(), getBytes() + dataWritten);
 
     dataWritten += writeData.size();
+    writeBitOffset = 0;
 
     return true;
 }
@@ -360,16 +717,17 @@ bool NetBuf::readBytes(std::span<std::byte> readData)
         return false;
     }
 
-    std::copy(data.begin() + dataRead, data.begin() + dataRead + readData.size(), readData.data());
+    std::copy(getBytes() + dataRead, getBytes() + dataRead + readData.size(), readData.data());
 
     dataRead += readData.size();
+    readBitOffset = 0;
 
     return true;
 }
 
 bool NetBuf::checkWriteSpaceLeft(size_t w)
 {
-    if (dataWritten + w > data.size())
+    if (dataWritten + w > capacity)
     {
         return false;
     }
@@ -386,3 +744,36 @@ bool NetBuf::checkReadSpaceLeft(size_t r)
 
     return true;
 }
+
+void NetBuf::makeWritable()
+{
+    if (!block)
+    {
+        block = NetBufPool::acquireFrom(pool, capacity);
+        dataOffset = 0;
+        return;
+    }
+    
+    if (block->refCount.load(std::memory_order_acquire) == 1 && dataOffset == 0)
+    {
+        return;
+    }
+    
+    //someone else is looking at these bytes (or we're a view without room to grow), so move what we have into a block of our own
+    NetBufBlock* newBlock = NetBufPool::acquireFrom(pool, capacity);
+    std::copy(getBytes(), getBytes() + dataWritten, newBlock->data);
+    
+    NetBufPool::release(block);
+    block = newBlock;
+    dataOffset = 0;
+}
+
+std::byte* NetBuf::getBytes() const
+{
+    if (!block)
+    {
+        return nullptr;
+    }
+    
+    return block->data + dataOffset;
+}
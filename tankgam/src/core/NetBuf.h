@@ -10,11 +10,34 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/quaternion.hpp>
 
+//fixed point encoding for positions inside of some bounds
+struct NetVec3Quantization
+{
+    glm::vec3 mins;
+    glm::vec3 maxs;
+    
+    //the size of a single step
+    float precision;
+    
+    //how many bits it takes to store the given axis
+    uint8_t getAxisBits(int axis) const;
+};
+
+class NetBufPool;
+struct NetBufBlock;
+
+//the bytes live in a block that's only grabbed on the first write, so moving a buffer is just moving a pointer
+//blocks come from the given pool, or the heap if there isn't one
 class NetBuf
 {
 public:
     NetBuf();
+    explicit NetBuf(NetBufPool& pool);
     explicit NetBuf(std::span<const std::byte> newData);
+    NetBuf(NetBufPool& pool, std::span<const std::byte> newData);
+    
+    //for messages that won't fit in a single packet, anything over MAX_BYTES comes from the heap
+    NetBuf(NetBufPool& pool, size_t capacity);
     ~NetBuf();
 
     NetBuf(const NetBuf&) = delete;
@@ -24,6 +47,15 @@ public:
     NetBuf& operator=(NetBuf&& o) noexcept;
 
     std::span<const std::byte> getData() const;
+    
+    //for recieving straight into the buffer, returns all the space there is to write into
+    //call endDirectWrite with how much actually got written afterwards
+    std::span<std::byte> beginDirectWrite();
+    bool endDirectWrite(size_t size);
+    
+    //makes outView read the next size bytes of this buffer without copying them
+    //writing to either one afterwards gives it its own copy first
+    bool readView(NetBuf& outView, size_t size);
 
     //reset buffer to start writing at the beginning
     void beginWrite();
@@ -50,6 +82,29 @@ public:
     
     bool writeQuat(const glm::quat& v);
     bool readQuat(glm::quat& v);
+    
+    //packs the lowest numBits of v, least significant bit first
+    //bits are packed together until a byte-sized write/read which starts on the next whole byte
+    bool writeBits(uint32_t v, uint8_t numBits);
+    bool readBits(uint32_t& v, uint8_t numBits);
+    
+    //positions outside of the quantization bounds are clamped to them
+    bool writeQuantizedVec3(const glm::vec3& v, const NetVec3Quantization& quantization);
+    bool readQuantizedVec3(glm::vec3& v, const NetVec3Quantization& quantization);
+    
+    //smallest three encoding, takes 2 + 3 * bitsPerComponent bits
+    bool writeQuantizedQuat(const glm::quat& v, uint8_t bitsPerComponent = DEFAULT_QUAT_COMPONENT_BITS);
+    bool readQuantizedQuat(glm::quat& v, uint8_t bitsPerComponent = DEFAULT_QUAT_COMPONENT_BITS);
+    
+    static std::array<uint32_t, 3> quantizeVec3(const glm::vec3& v, const NetVec3Quantization& quantization);
+    static glm::vec3 dequantizeVec3(const std::array<uint32_t, 3>& v, const NetVec3Quantization& quantization);
+    
+    static uint32_t quantizeQuat(const glm::quat& v, uint8_t bitsPerComponent = DEFAULT_QUAT_COMPONENT_BITS);
+    static glm::quat dequantizeQuat(uint32_t v, uint8_t bitsPerComponent = DEFAULT_QUAT_COMPONENT_BITS);
+    
+    //the whole quaternion has to fit in 32 bits
+    static constexpr uint8_t MAX_QUAT_COMPONENT_BITS = 10;
+    static constexpr uint8_t DEFAULT_QUAT_COMPONENT_BITS = 10;
 
     bool writeString(std::string_view str);
     bool readString(std::string& str);
@@ -67,10 +122,25 @@ public:
     static constexpr size_t MAX_BYTES = 1024;
     
 private:
-    std::array<std::byte, MAX_BYTES> data;
+    NetBufPool* pool;
+    NetBufBlock* block;
+    size_t capacity;
+    
+    //where this buffer starts in the block, only non-zero for views
+    size_t dataOffset;
+    
     size_t dataWritten;
     size_t dataRead;
+    
+    //bits already used up in the last byte written/read, 0 when byte aligned
+    uint8_t writeBitOffset;
+    uint8_t readBitOffset;
 
     bool checkWriteSpaceLeft(size_t w);
     bool checkReadSpaceLeft(size_t r);
+    
+    //grabs a block if we don't have one, or copies into our own if we share it
+    void makeWritable();
+    
+    std::byte* getBytes() const;
 };
@@ -0,0 +1,96 @@
+#include "NetBufPool.h"
+
+NetBufPool::NetBufPool(size_t numBlocks)
+    : blocks{ std::make_unique<NetBufBlock[]>(numBlocks) },
+      blockData{ std::make_unique<std::byte[]>(numBlocks * NetBuf::MAX_BYTES) }
+{
+    freeBlocks.reserve(numBlocks);
+
+    //hand out the lowest addresses first
+    for (size_t i = numBlocks; i > 0; i--)
+    {
+        NetBufBlock& block = blocks[i - 1];
+        block.refCount = 0;
+        block.pool = this;
+        block.data = blockData.get() + (i - 1) * NetBuf::MAX_BYTES;
+        block.capacity = NetBuf::MAX_BYTES;
+
+        freeBlocks.push_back(&block);
+    }
+}
+
+NetBufPool::~NetBufPool() = default;
+
+NetBufBlock* NetBufPool::acquire()
+{
+    NetBufBlock* block = nullptr;
+
+    {
+        std::lock_guard<std::mutex> lock{ freeMutex };
+        if (freeBlocks.empty())
+        {
+            return acquireFrom(nullptr);
+        }
+
+        block = freeBlocks.back();
+        freeBlocks.pop_back();
+    }
+
+    block->refCount.store(1, std::memory_order_relaxed);
+
+    return block;
+}
+
+void NetBufPool::release(NetBufBlock* block)
+{
+    if (!block)
+    {
+        return;
+    }
+
+    //make sure every other thread is done with the bytes before handing it out again
+    if (block->refCount.fetch_sub(1, std::memory_order_acq_rel) != 1)
+    {
+        return;
+    }
+
+    if (block->pool)
+    {
+        block->pool->giveBack(block);
+    }
+    else
+    {
+        delete block;
+    }
+}
+
+NetBufBlock* NetBufPool::acquireFrom(NetBufPool* pool, size_t capacity)
+{
+    if (pool && capacity <= NetBuf::MAX_BYTES)
+    {
+        return pool->acquire();
+    }
+
+    NetBufBlock* block = new NetBufBlock{};
+    block->refCount.store(1, std::memory_order_relaxed);
+    block->pool = nullptr;
+    block->heapData = std::make_unique<std::byte[]>(capacity);
+    block->data = block->heapData.get();
+    block->capacity = capacity;
+
+    return block;
+}
+
+size_t NetBufPool::getNumFreeBlocks()
+{
+    std::lock_guard<std::mutex> lock{ freeMutex };
+
+    return freeBlocks.size();
+}
+
+void NetBufPool::giveBack(NetBufBlock* block)
+{
+    std::lock_guard<std::mutex> lock{ freeMutex };
+
+    freeBlocks.push_back(block);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "NetBuf.h"
+
+class NetBufPool;
+
+//the bytes behind a NetBuf, shared between a buffer and any views of it
+struct NetBufBlock
+{
+    std::atomic<uint32_t> refCount;
+
+    //where this goes back to once nothing uses it, null if it came from the heap
+    NetBufPool* pool;
+
+    std::byte* data;
+    size_t capacity;
+
+    //only used by blocks that came from the heap
+    std::unique_ptr<std::byte[]> heapData;
+};
+
+//preallocated packet buffers so sending and recieving don't have to hit the heap
+//blocks can be freed from a different thread than the one that acquired them
+class NetBufPool
+{
+public:
+    explicit NetBufPool(size_t numBlocks = DEFAULT_NUM_BLOCKS);
+    ~NetBufPool();
+
+    NetBufPool(const NetBufPool&) = delete;
+    NetBufPool& operator=(const NetBufPool&) = delete;
+
+    //returns a block with a ref count of 1
+    //falls back to the heap if the pool has run dry
+    NetBufBlock* acquire();
+
+    //drop a reference to the block, returning it to where it came from if that was the last one
+    static void release(NetBufBlock* block);
+
+    //same as acquire, but a null pool or anything bigger than a packet comes straight from the heap
+    static NetBufBlock* acquireFrom(NetBufPool* pool, size_t capacity = NetBuf::MAX_BYTES);
+
+    size_t getNumFreeBlocks();
+
+    static constexpr size_t DEFAULT_NUM_BLOCKS = 1024;
+
+private:
+    std::unique_ptr<NetBufBlock[]> blocks;
+    std::unique_ptr<std::byte[]> blockData;
+
+    std::mutex freeMutex;
+    std::vector<NetBufBlock*> freeBlocks;
+
+    void giveBack(NetBufBlock* block);
+};
@@ -5,7 +5,7 @@
 #include <stdexcept>
 
 NetChan::NetChan(Net& net, NetSrc netSrc)
-    : NetChan{ net, netSrc, NetAddr{ NetAddrType::Unknown } }
+    : NetChan{ net, netSrc, NetAddr{ NetAddrType::Unknown, 0, {} } }
 {
 }
 
@@ -13,9 +13,20 @@ NetChan::NetChan(Net& net, NetSrc netSrc, NetAddr toAddr)
     : net{ net }, netSrc{ netSrc }, netAddr{ toAddr },
       outgoingSequenceBuffer{}, outgoingPacketInfoBuffer{},
       incomingSequenceBuffer{}, incomingPacketInfoBuffer{},
+      sentSequenceBuffer{}, sentTimeBuffer{}, sentAckedBuffer{},
+      outgoingSequenceCounted{ 0 }, incomingSequenceBits{ 0 },
+      stats{}, hasRoundTripTime{ false },
+      rateWindowStart{ std::chrono::steady_clock::now() },
+      windowSentPackets{ 0 }, windowRecievedPackets{ 0 },
+      windowSentBytes{ 0 }, windowRecievedBytes{ 0 },
+      totalSentBytes{ 0 },
       outgoingSequence{ 0 }, incomingSequence{ 0 },
-      outgoingReliableSequence{ 0 }, incomingReliableSequence{ 0 },
-      shouldTrySendReliable{ true }
+      outgoingSequenceAcked{ 0 }, outgoingSequenceAckedBits{ 0 },
+      outgoingReliableSequence{ 0 }, outgoingReliableAcked{ 0 }, incomingReliableSequence{ 0 },
+      outgoingFragmentMessage{ 0 },
+      incomingFragmentBuf{}, incomingFragmentMessage{ 0 },
+      incomingFragmentCount{ 0 }, nextIncomingFragment{ 0 },
+      shouldTrySendReliable{ true }, shouldSendAck{ false }
 {
 }
 
@@ -53,7 +64,7 @@ void NetChan::outOfBand(Net& net, NetSrc src, NetAddr toAddr, NetBuf sendBuf)
 
 void NetChan::outOfBand(Net& net, NetSrc src, NetAddr toAddr, std::span<const std::byte> data)
 {
-    NetBuf buf{};
+    NetBuf buf{ net.getBufPool() };
     buf.writeUint16(OUT_OF_BAND_MAGIC_NUMBER);
     buf.writeBytes(data);
 
@@ -71,32 +82,39 @@ void NetChan::trySendReliable(uint32_t salt)
         return;
     }
     
-    bool unacked = false;
+    bool due = false;
     
-    //search if there's any reliable messages to send
-    for (uint32_t counter = 0, currentSequence = outgoingReliableSequence;
-         counter <= 64;
-         counter++, currentSequence--)
+    //search if there's any reliable messages that haven't gone out yet or have waited too long for an ack
+    const auto now = std::chrono::steady_clock::now();
+    for (uint32_t currentSequence = outgoingReliableAcked + 1;
+         currentSequence <= outgoingReliableSequence;
+         currentSequence++)
     {
         OutPacketInfo* packetInfo = getOutPacketInfo(currentSequence);
-        if (!packetInfo || packetInfo->acked)
+        if (packetInfo && !packetInfo->acked && isReliableMessageDue(*packetInfo, now))
         {
-            continue;
-        }
-        
-        if (!packetInfo->acked)
-        {
-            unacked = true;
+            due = true;
             break;
         }
     }
     
-    if (unacked)
+    //we still want to let them know what we got, even if we have nothing to send back
+    if (due || shouldSendAck)
     {
         sendData(std::span<const std::byte> {}, NetMessageType::SendReliables, salt);
     }
 }
 
+void NetChan::queueAck()
+{
+    shouldSendAck = true;
+}
+
+NetChanStats NetChan::getStats() const
+{
+    return stats;
+}
+
 void NetChan::addReliableData(NetBuf sendBuf, NetMessageType msgType)
 {
     addReliableData(sendBuf.getData(), msgType);
@@ -114,27 +132,318 @@ void NetChan::addReliableData(std::span<const std::byte> data, NetMessageType ms
         throw std::runtime_error{ "Tried to send unreliable message through reliable messaging" };
     }
 
-    NetBuf msgBuf{};
-    msgBuf.writeUint8(static_cast<uint8_t>(msgType));
-    msgBuf.writeBytes(data);
+    //small enough to go out as is
+    if (data.size() + 1 <= MAX_FRAGMENT_BYTES)
+    {
+        NetBuf msgBuf{ net.getBufPool() };
+        msgBuf.writeUint8(static_cast<uint8_t>(msgType));
+        msgBuf.writeBytes(data);
+
+        addReliableMessage(std::move(msgBuf));
+        return;
+    }
+
+    if (data.size() > MAX_MESSAGE_BYTES)
+    {
+        throw std::runtime_error{ "Tried to send a reliable message bigger than NetChan::MAX_MESSAGE_BYTES" };
+    }
 
-    OutPacketInfo& newPacket = insertOutPacketInfo(++outgoingReliableSequence);
-    newPacket.acked = false;
-    newPacket.sequence = outgoingReliableSequence;
-    newPacket.data = std::move(msgBuf);
+    //the type goes at the start of the first fragment, so it all goes back together into a normal message
+    const size_t messageSize = data.size() + 1;
+    const uint8_t numFragments = static_cast<uint8_t>((messageSize + MAX_FRAGMENT_BYTES - 1) / MAX_FRAGMENT_BYTES);
+    const uint16_t fragmentMessage = ++outgoingFragmentMessage;
+
+    size_t dataSent = 0;
+    for (uint8_t fragment = 0; fragment < numFragments; fragment++)
+    {
+        NetBuf fragmentBuf{ net.getBufPool() };
+        fragmentBuf.writeUint8(static_cast<uint8_t>(NetMessageType::Fragment));
+        fragmentBuf.writeUint16(fragmentMessage);
+        fragmentBuf.writeUint8(fragment);
+        fragmentBuf.writeUint8(numFragments);
+
+        size_t fragmentSize = MAX_FRAGMENT_BYTES;
+        if (fragment == 0)
+        {
+            fragmentBuf.writeUint8(static_cast<uint8_t>(msgType));
+            fragmentSize--;
+        }
+
+        fragmentSize = std::min(fragmentSize, data.size() - dataSent);
+        fragmentBuf.writeBytes(data.subspan(dataSent, fragmentSize));
+        dataSent += fragmentSize;
+
+        addReliableMessage(std::move(fragmentBuf));
+    }
 }
 
-void NetChan::sendData(NetBuf sendBuf, NetMessageType msgType, uint32_t salt)
+void NetChan::addReliableMessage(NetBuf msgBuf)
 {
-    sendData(sendBuf.getData(), msgType, salt);
+    if (tryBundleReliableMessage(msgBuf))
+    {
+        return;
+    }
+
+    queuedReliableMessages.push_back(std::move(msgBuf));
+    fillReliableWindow();
 }
 
-void NetChan::sendData(std::span<const std::byte> data, NetMessageType msgType, uint32_t salt)
+bool NetChan::tryBundleReliableMessage(const NetBuf& msgBuf)
 {
-    if (netAddr.type == NetAddrType::Unknown)
+    const std::span<const std::byte> msgData = msgBuf.getData();
+    if (msgData.empty() || static_cast<NetMessageType>(msgData[0]) == NetMessageType::Fragment)
+    {
+        return false;
+    }
+
+    //find the newest message, as long as it hasn't been sent yet
+    NetBuf* lastBuf = nullptr;
+    if (!queuedReliableMessages.empty())
+    {
+        lastBuf = &queuedReliableMessages.back();
+    }
+    else if (OutPacketInfo* packetInfo = getOutPacketInfo(outgoingReliableSequence);
+             packetInfo && outgoingReliableSequence > outgoingReliableAcked && !packetInfo->sent)
+    {
+        lastBuf = &packetInfo->data;
+    }
+
+    if (!lastBuf)
+    {
+        return false;
+    }
+
+    const std::span<const std::byte> lastData = lastBuf->getData();
+    if (lastData.empty() || static_cast<NetMessageType>(lastData[0]) == NetMessageType::Fragment)
+    {
+        return false;
+    }
+
+    //every message in a bundle gets its size in front of it
+    const bool isBundle = static_cast<NetMessageType>(lastData[0]) == NetMessageType::Bundle;
+    const size_t bundleSize = (isBundle ? lastData.size() : 1 + 2 + lastData.size()) + 2 + msgData.size();
+    if (bundleSize > MAX_FRAGMENT_BYTES)
+    {
+        return false;
+    }
+
+    if (!isBundle)
+    {
+        NetBuf bundleBuf{ net.getBufPool() };
+        bundleBuf.writeUint8(static_cast<uint8_t>(NetMessageType::Bundle));
+        bundleBuf.writeUint16(static_cast<uint16_t>(lastData.size()));
+        bundleBuf.writeBytes(lastData);
+
+        *lastBuf = std::move(bundleBuf);
+    }
+
+    lastBuf->writeUint16(static_cast<uint16_t>(msgData.size()));
+    lastBuf->writeBytes(msgData);
+
+    return true;
+}
+
+void NetChan::fillReliableWindow()
+{
+    while (!queuedReliableMessages.empty() &&
+           outgoingReliableSequence - outgoingReliableAcked < RELIABLE_WINDOW)
+    {
+        OutPacketInfo& newPacket = insertOutPacketInfo(++outgoingReliableSequence);
+        newPacket.acked = false;
+        newPacket.sequence = outgoingReliableSequence;
+        newPacket.data = std::move(queuedReliableMessages.front());
+        newPacket.sent = false;
+
+        queuedReliableMessages.pop_front();
+    }
+}
+
+bool NetChan::isReliableMessageDue(const OutPacketInfo& packetInfo, std::chrono::steady_clock::time_point now) const
+{
+    return !packetInfo.sent || now - packetInfo.lastSendTime >= getResendTime();
+}
+
+std::chrono::nanoseconds NetChan::getResendTime() const
+{
+    if (!hasRoundTripTime)
+    {
+        return INITIAL_RESEND_TIME;
+    }
+
+    //same as tcp's retransmission timeout
+    const std::chrono::nanoseconds resendTime = stats.roundTripTime + stats.roundTripTimeVariance * 4;
+
+    return std::clamp<std::chrono::nanoseconds>(resendTime, MIN_RESEND_TIME, MAX_RESEND_TIME);
+}
+
+void NetChan::updateRoundTripTime(uint32_t sequenceAck, std::chrono::steady_clock::time_point now)
+{
+    const size_t index = static_cast<size_t>(sequenceAck) % PACKET_BUFFER_SIZE;
+    if (sentSequenceBuffer[index] != sequenceAck)
+    {
+        return;
+    }
+
+    const std::chrono::nanoseconds sample = now - sentTimeBuffer[index];
+
+    if (!hasRoundTripTime)
+    {
+        stats.roundTripTime = sample;
+        stats.roundTripTimeVariance = sample / 2;
+        hasRoundTripTime = true;
+        return;
+    }
+
+    stats.roundTripTimeVariance = (stats.roundTripTimeVariance * 3 + std::chrono::abs(stats.roundTripTime - sample)) / 4;
+    stats.roundTripTime = (stats.roundTripTime * 7 + sample) / 8;
+}
+
+void NetChan::updateSendLoss(uint32_t sequenceAck, uint32_t sequenceAckBits)
+{
+    const auto markAcked = [this](uint32_t sequence)
+    {
+        const size_t index = static_cast<size_t>(sequence) % PACKET_BUFFER_SIZE;
+        if (sentSequenceBuffer[index] == sequence)
+        {
+            sentAckedBuffer[index] = true;
+        }
+    };
+
+    markAcked(sequenceAck);
+    for (uint32_t counter = 0; counter < 32; counter++)
+    {
+        if (sequenceAckBits & (1u << counter))
+        {
+            markAcked(sequenceAck - 1 - counter);
+        }
+    }
+
+    //anything older than the ack bits go back isn't going to get acked anymore
+    if (sequenceAck <= 32)
     {
         return;
     }
+
+    const uint32_t lastFinalSequence = sequenceAck - 33;
+    if (lastFinalSequence > outgoingSequenceCounted + PACKET_BUFFER_SIZE)
+    {
+        outgoingSequenceCounted = lastFinalSequence - PACKET_BUFFER_SIZE;
+    }
+
+    while (outgoingSequenceCounted < lastFinalSequence)
+    {
+        outgoingSequenceCounted++;
+
+        const size_t index = static_cast<size_t>(outgoingSequenceCounted) % PACKET_BUFFER_SIZE;
+        if (sentSequenceBuffer[index] != outgoingSequenceCounted)
+        {
+            continue;
+        }
+
+        const float lost = sentAckedBuffer[index] ? 0.0f : 1.0f;
+        stats.sendLoss += (lost - stats.sendLoss) * LOSS_SMOOTHING;
+    }
+}
+
+void NetChan::updateRecieveLoss(uint32_t sequence)
+{
+    if (sequence <= incomingSequence)
+    {
+        return;
+    }
+
+    const uint32_t shift = sequence - incomingSequence;
+
+    //everything we skipped over never showed up
+    for (uint32_t i = 0; i < std::min<uint32_t>(shift - 1, PACKET_BUFFER_SIZE); i++)
+    {
+        stats.recieveLoss += (1.0f - stats.recieveLoss) * LOSS_SMOOTHING;
+    }
+    stats.recieveLoss -= stats.recieveLoss * LOSS_SMOOTHING;
+
+    //the old incomingSequence becomes one of the bits
+    uint64_t bits = shift >= 32 ? 0 : static_cast<uint64_t>(incomingSequenceBits) << shift;
+    if (incomingSequence != 0 && shift <= 32)
+    {
+        bits |= 1ull << (shift - 1);
+    }
+
+    incomingSequenceBits = static_cast<uint32_t>(bits);
+}
+
+void NetChan::updateRates(std::chrono::steady_clock::time_point now)
+{
+    const auto elapsed = now - rateWindowStart;
+    if (elapsed < RATE_WINDOW)
+    {
+        return;
+    }
+
+    const float seconds = std::chrono::duration<float>(elapsed).count();
+    stats.sentPacketsPerSecond = static_cast<float>(windowSentPackets) / seconds;
+    stats.recievedPacketsPerSecond = static_cast<float>(windowRecievedPackets) / seconds;
+    stats.sentBytesPerSecond = static_cast<float>(windowSentBytes) / seconds;
+    stats.recievedBytesPerSecond = static_cast<float>(windowRecievedBytes) / seconds;
+
+    rateWindowStart = now;
+    windowSentPackets = 0;
+    windowRecievedPackets = 0;
+    windowSentBytes = 0;
+    windowRecievedBytes = 0;
+}
+
+void NetChan::handleReliableMessage(NetBuf& msgBuf, std::vector<NetBuf>& outReliableMessages)
+{
+    uint8_t msgType;
+    if (!msgBuf.readUint8(msgType))
+    {
+        return;
+    }
+
+    if (static_cast<NetMessageType>(msgType) == NetMessageType::Fragment)
+    {
+        //only pass it on once we've got the whole thing
+        NetBuf message{};
+        if (addFragment(msgBuf, message))
+        {
+            outReliableMessages.push_back(std::move(message));
+        }
+
+        return;
+    }
+
+    if (static_cast<NetMessageType>(msgType) == NetMessageType::Bundle)
+    {
+        uint16_t messageSize;
+        while (msgBuf.readUint16(messageSize))
+        {
+            NetBuf message{};
+            if (!msgBuf.readView(message, messageSize))
+            {
+                break;
+            }
+
+            outReliableMessages.push_back(std::move(message));
+        }
+
+        return;
+    }
+
+    msgBuf.beginRead();
+    outReliableMessages.push_back(std::move(msgBuf));
+}
+
+bool NetChan::sendData(NetBuf sendBuf, NetMessageType msgType, uint32_t salt)
+{
+    return sendData(sendBuf.getData(), msgType, salt);
+}
+
+bool NetChan::sendData(std::span<const std::byte> data, NetMessageType msgType, uint32_t salt)
+{
+    if (netAddr.type == NetAddrType::Unknown)
+    {
+        return false;
+    }
     //check if this is supposed to be a reliable message
     else if (static_cast<uint8_t>(msgType) & 1 << 7)
     {
@@ -144,14 +453,32 @@ void NetChan::sendData(std::span<const std::byte> data, NetMessageType msgType,
         }
     }
 
-    NetBuf sendBuf{};
-    writeHeader(sendBuf, msgType, salt);
+    //checked before the header so that a packet that can't be sent doesn't use up a sequence
+    if (data.size() > MAX_DATA_BYTES)
+    {
+        return false;
+    }
+
+    NetBuf sendBuf{ net.getBufPool() };
+    const bool sentAllReliables = writeHeader(sendBuf, msgType, salt, data.size());
+
+    if (!sendBuf.writeBytes(data))
+    {
+        return false;
+    }
 
-    sendBuf.writeBytes(data);
+    windowSentPackets++;
+    windowSentBytes += sendBuf.getData().size();
+    totalSentBytes += sendBuf.getData().size();
+    updateRates(std::chrono::steady_clock::now());
 
     net.sendPacket(netSrc, std::move(sendBuf), netAddr);
     
-    shouldTrySendReliable = false; //we sent some reliable data with this packet, don't try again this cycle
+    //we sent our reliable data with this packet, don't try again this cycle unless some of it didn't fit
+    shouldTrySendReliable = !sentAllReliables;
+    shouldSendAck = false; //the header has our acks in it
+
+    return true;
 }
 
 bool NetChan::processHeader(NetBuf& inBuf, NetMessageType& outType, std::vector<NetBuf>& outReliableMessages, uint32_t expectedSalt)
@@ -167,22 +494,58 @@ bool NetChan::processHeader(NetBuf& inBuf, NetMessageType& outType, std::vector<
         return false;
     }
 
+    const auto now = std::chrono::steady_clock::now();
+
+    updateRecieveLoss(header.sequence);
     incomingSequence = header.sequence;
 
+    windowRecievedPackets++;
+    windowRecievedBytes += inBuf.getData().size();
+    updateRates(now);
+
+    if (header.sequenceAck > outgoingSequenceAcked)
+    {
+        updateRoundTripTime(header.sequenceAck, now);
+        outgoingSequenceAcked = header.sequenceAck;
+        outgoingSequenceAckedBits = header.sequenceAckBits;
+    }
+    else if (header.sequenceAck == outgoingSequenceAcked)
+    {
+        outgoingSequenceAckedBits |= header.sequenceAckBits;
+    }
+
+    updateSendLoss(header.sequenceAck, header.sequenceAckBits);
+
+    //they'll keep resending reliable data until we ack it
+    if (header.numReliableMessages > 0)
+    {
+        shouldSendAck = true;
+    }
+
     outType = header.msgType;
     outReliableMessages.clear();
 
-    //mark down this new acked packet we put out
-    if (OutPacketInfo* packetInfo = getOutPacketInfo(header.ack);
-        packetInfo && !packetInfo->acked)
+    //everything up to their ack made it
+    if (header.ack > outgoingReliableAcked && header.ack <= outgoingReliableSequence)
     {
-        packetInfo->acked = true;
+        for (uint32_t currentSequence = outgoingReliableAcked + 1;
+             currentSequence <= header.ack;
+             currentSequence++)
+        {
+            if (OutPacketInfo* packetInfo = getOutPacketInfo(currentSequence))
+            {
+                packetInfo->acked = true;
+                packetInfo->data = NetBuf{};
+            }
+        }
+
+        outgoingReliableAcked = header.ack;
     }
 
-    //mark down the other acks that they made
-    for (uint32_t counter = 0, currentSequence = header.ack - 1;
+    //mark down the ones they got past that
+    for (uint32_t counter = 0, currentSequence = header.ack + 1;
          counter < 64;
-         counter++, currentSequence--)
+         counter++, currentSequence++)
     {
         OutPacketInfo* packetInfo = getOutPacketInfo(currentSequence);
         if (!packetInfo || packetInfo->acked)
@@ -190,35 +553,75 @@ bool NetChan::processHeader(NetBuf& inBuf, NetMessageType& outType, std::vector<
             continue;
         }
 
-        if (header.ackBits & (1 << counter))
+        if (header.ackBits & (1ull << counter))
         {
             packetInfo->acked = true;
+            packetInfo->data = NetBuf{};
         }
     }
 
+    //acks might have made room for more
+    fillReliableWindow();
+
     //technically this is THEIR out reliable info that we're reading
     for (OutPacketInfo& packetInfo : header.reliableMessages)
     {
+        //already handed out, or too far ahead for us to ack
+        if (packetInfo.sequence <= incomingReliableSequence ||
+            packetInfo.sequence > incomingReliableSequence + RELIABLE_WINDOW)
+        {
+            continue;
+        }
+
         //check if we already got this
         if (getInPacketInfo(packetInfo.sequence)) //if it exists we got it
         {
             continue;
         }
 
-        //create a listing for this
+        //hold onto it until everything before it is in
         InPacketInfo& inPacketInfo = insertInPacketInfo(packetInfo.sequence);
+        inPacketInfo.data = std::move(packetInfo.data);
+    }
 
-        //ack that we got this
-        inPacketInfo.acked = true;
+    //the other end executes these in serial, so only hand them out in order
+    while (InPacketInfo* inPacketInfo = getInPacketInfo(incomingReliableSequence + 1))
+    {
+        incomingReliableSequence++;
 
-        //write this out to the caller
-        outReliableMessages.push_back(std::move(packetInfo.data));
+        NetBuf msgBuf = std::move(inPacketInfo->data);
+        handleReliableMessage(msgBuf, outReliableMessages);
     }
 
     return true;
 }
 
-void NetChan::writeHeader(NetBuf& outBuf, NetMessageType msgType, uint32_t salt)
+uint32_t NetChan::getOutgoingSequence() const
+{
+    return outgoingSequence;
+}
+
+uint32_t NetChan::getIncomingSequence() const
+{
+    return incomingSequence;
+}
+
+uint32_t NetChan::getAckedSequence() const
+{
+    return outgoingSequenceAcked;
+}
+
+uint32_t NetChan::getAckedSequenceBits() const
+{
+    return outgoingSequenceAckedBits;
+}
+
+uint64_t NetChan::getTotalSentBytes() const
+{
+    return totalSentBytes;
+}
+
+bool NetChan::writeHeader(NetBuf& outBuf, NetMessageType msgType, uint32_t salt, size_t payloadSize)
 {
     //for organizational purposes
     OutHeader header
@@ -227,49 +630,72 @@ void NetChan::writeHeader(NetBuf& outBuf, NetMessageType msgType, uint32_t salt)
         .msgType = msgType,
         .salt = salt,
         .sequence = ++outgoingSequence,
+        .sequenceAck = incomingSequence,
+        .sequenceAckBits = incomingSequenceBits,
         .ack = incomingReliableSequence,
         .ackBits = 0,
         .numReliableMessages = 0,
         .reliableMessages = {},
     };
 
-    //figure out the reliable ack
-    for (uint32_t counter = 0, currentSequence = incomingReliableSequence - 1;
+    const auto now = std::chrono::steady_clock::now();
+
+    //remember when this went out so we can time the round trip
+    {
+        const size_t index = static_cast<size_t>(header.sequence) % PACKET_BUFFER_SIZE;
+        sentSequenceBuffer[index] = header.sequence;
+        sentTimeBuffer[index] = now;
+        sentAckedBuffer[index] = false;
+    }
+
+    //figure out the reliable ack, for the ones that came in ahead of the rest
+    for (uint32_t counter = 0, currentSequence = incomingReliableSequence + 1;
          counter < 64;
-         counter++, currentSequence--)
+         counter++, currentSequence++)
     {
-        InPacketInfo* packetInfo = getInPacketInfo(currentSequence);
-        if (!packetInfo)
+        if (getInPacketInfo(currentSequence))
         {
-            continue;
+            header.ackBits |= 1ull << counter;
         }
+    }
 
-        if (packetInfo->acked)
-        {
-            header.ackBits |= 1 << counter;
-        }
+    //packets that are carrying something else only get part of their space for reliable messages
+    //so that a burst of them doesn't blow up every packet we send
+    size_t bytesLeft = NetBuf::MAX_BYTES - std::min(NetBuf::MAX_BYTES, HEADER_BYTES + payloadSize);
+    if (payloadSize > 0)
+    {
+        bytesLeft = std::min(bytesLeft, MAX_RELIABLE_BYTES_PER_PACKET);
     }
 
     std::vector<OutPacketInfo*> reliableMessages;
+    bool sentAllReliables = true;
 
-    //figure out the reliable messages we need to send
-    for (uint32_t counter = 0, currentSequence = outgoingReliableSequence;
-         counter <= 64;
-         counter++, currentSequence--)
+    //figure out the reliable messages we need to send, oldest first
+    //only ones that are new or have waited too long for an ack, everything else is probably still on its way
+    for (uint32_t currentSequence = outgoingReliableAcked + 1;
+         currentSequence <= outgoingReliableSequence;
+         currentSequence++)
     {
         OutPacketInfo* packetInfo = getOutPacketInfo(currentSequence);
-        if (!packetInfo || packetInfo->acked)
+        if (!packetInfo || packetInfo->acked || !isReliableMessageDue(*packetInfo, now))
         {
             continue;
         }
 
+        const size_t messageBytes = RELIABLE_MESSAGE_HEADER_BYTES + packetInfo->data.getData().size();
+        if (messageBytes > bytesLeft)
+        {
+            sentAllReliables = false;
+            break;
+        }
+
+        bytesLeft -= messageBytes;
+
+        packetInfo->sent = true;
+        packetInfo->lastSendTime = now;
         reliableMessages.push_back(packetInfo);
     }
     
-    //reverse order so that they get it in the correct order
-    //other end executes this in serial, so make sure that they do these in order
-    std::reverse(reliableMessages.begin(), reliableMessages.end());
-    
     header.numReliableMessages = static_cast<uint8_t>(reliableMessages.size());
     header.reliableMessages = std::move(reliableMessages);
 
@@ -277,6 +703,8 @@ void NetChan::writeHeader(NetBuf& outBuf, NetMessageType msgType, uint32_t salt)
     outBuf.writeUint8(static_cast<uint8_t>(header.msgType));
     outBuf.writeUint32(header.salt);
     outBuf.writeUint32(header.sequence);
+    outBuf.writeUint32(header.sequenceAck);
+    outBuf.writeUint32(header.sequenceAckBits);
     outBuf.writeUint32(header.ack);
     outBuf.writeUint64(header.ackBits);
     outBuf.writeUint8(header.numReliableMessages);
@@ -286,6 +714,8 @@ void NetChan::writeHeader(NetBuf& outBuf, NetMessageType msgType, uint32_t salt)
         outBuf.writeUint32(reliableMessage->data.getData().size());
         outBuf.writeBytes(reliableMessage->data.getData());
     }
+    
+    return sentAllReliables;
 }
 
 bool NetChan::readHeader(NetBuf& inBuf, InHeader& outHeader, uint32_t expectedSalt)
@@ -309,6 +739,8 @@ bool NetChan::readHeader(NetBuf& inBuf, InHeader& outHeader, uint32_t expectedSa
     if (outHeader.salt != expectedSalt)            return false;
 
     if (!inBuf.readUint32(outHeader.sequence))          return false;
+    if (!inBuf.readUint32(outHeader.sequenceAck))       return false;
+    if (!inBuf.readUint32(outHeader.sequenceAckBits))   return false;
     if (!inBuf.readUint32(outHeader.ack))               return false;
     if (!inBuf.readUint64(outHeader.ackBits))           return false;
     if (!inBuf.readUint8(outHeader.numReliableMessages))  return false;
@@ -328,14 +760,8 @@ bool NetChan::readHeader(NetBuf& inBuf, InHeader& outHeader, uint32_t expectedSa
             return false;
         }
 
-        std::vector<std::byte> data;
-        data.resize(static_cast<size_t>(dataSize));
-        if (!inBuf.readBytes(data))
-        {
-            return false;
-        }
-
-        if (!reliableMessage.data.writeBytes(data))
+        //the message keeps pointing into the packet instead of getting copied out
+        if (!inBuf.readView(reliableMessage.data, static_cast<size_t>(dataSize)))
         {
             return false;
         }
@@ -385,3 +811,59 @@ NetChan::InPacketInfo& NetChan::insertInPacketInfo(uint32_t sequence)
     incomingSequenceBuffer[index] = sequence;
     return incomingPacketInfoBuffer[index];
 }
+
+bool NetChan::addFragment(NetBuf& fragmentBuf, NetBuf& outMessage)
+{
+    uint16_t fragmentMessage;
+    uint8_t fragment;
+    uint8_t numFragments;
+    if (!fragmentBuf.readUint16(fragmentMessage) ||
+        !fragmentBuf.readUint8(fragment) ||
+        !fragmentBuf.readUint8(numFragments))
+    {
+        return false;
+    }
+
+    if (numFragments == 0 || numFragments > MAX_FRAGMENTS || fragment >= numFragments)
+    {
+        return false;
+    }
+
+    //the start of a new message, whatever was left of the last one isn't coming
+    if (fragment == 0)
+    {
+        incomingFragmentBuf = NetBuf{ net.getBufPool(), MAX_FRAGMENT_BYTES * MAX_FRAGMENTS };
+        incomingFragmentMessage = fragmentMessage;
+        incomingFragmentCount = numFragments;
+        nextIncomingFragment = 0;
+    }
+
+    if (fragmentMessage != incomingFragmentMessage ||
+        numFragments != incomingFragmentCount ||
+        fragment != nextIncomingFragment)
+    {
+        return false;
+    }
+
+    //everything after the type and fragment header
+    const std::span<const std::byte> data = fragmentBuf.getData().subspan(1 + FRAGMENT_HEADER_BYTES);
+    if (data.size() > MAX_FRAGMENT_BYTES || !incomingFragmentBuf.writeBytes(data))
+    {
+        incomingFragmentCount = 0;
+        return false;
+    }
+
+    nextIncomingFragment++;
+    if (nextIncomingFragment < incomingFragmentCount)
+    {
+        return false;
+    }
+
+    incomingFragmentCount = 0;
+    nextIncomingFragment = 0;
+
+    outMessage = std::move(incomingFragmentBuf);
+    outMessage.beginRead();
+
+    return true;
+}
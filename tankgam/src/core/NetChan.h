@@ -6,6 +6,8 @@
 
 #include <cstddef>
 #include <vector>
+#include <deque>
+#include <chrono>
 #include <string_view>
 #include <array>
 #include <numeric>
@@ -20,9 +22,14 @@ enum class NetMessageType : uint8_t
     Unknown = 0,
     EntitySynchronize = 1,
     PlayerCommand = 2,
+    SnapshotRequest = 3,
+    TimeSynchronize = 4,
     Synchronize = 1 | (1 << 7),
     CreateEntity = 2 | (1 << 7),
     DestroyEntity = 3 | (1 << 7),
+    ModelIndex = 4 | (1 << 7),
+    Fragment = 5 | (1 << 7),
+    Bundle = 6 | (1 << 7),
     SendReliables = std::numeric_limits<uint8_t>::max(),
 };
 
@@ -33,14 +40,39 @@ constexpr const char* NetMessageTypeToString(const NetMessageType m)
     case NetMessageType::Unknown: return "Unknown";
     case NetMessageType::EntitySynchronize: return "EntitySynchronize";
     case NetMessageType::PlayerCommand: return "PlayerCommand";
+    case NetMessageType::SnapshotRequest: return "SnapshotRequest";
+    case NetMessageType::TimeSynchronize: return "TimeSynchronize";
     case NetMessageType::Synchronize: return "Synchronize";
     case NetMessageType::CreateEntity: return "CreateEntity";
     case NetMessageType::DestroyEntity: return "DestroyEntity";
+    case NetMessageType::ModelIndex: return "ModelIndex";
+    case NetMessageType::Fragment: return "Fragment";
+    case NetMessageType::Bundle: return "Bundle";
     case NetMessageType::SendReliables: return "SendReliables";
     default: throw std::invalid_argument{ "UNKNOWN ENUM" };
     }
 }
 
+//how a connection has been doing recently
+struct NetChanStats
+{
+    //smoothed time from sending a packet to hearing back about it, zero until we've heard back once
+    std::chrono::nanoseconds roundTripTime;
+
+    //how much the round trip time jumps around, the jitter
+    std::chrono::nanoseconds roundTripTimeVariance;
+
+    //the fraction of packets that went missing, from 0 to 1
+    float sendLoss;
+    float recieveLoss;
+
+    //over the last second or so
+    float sentPacketsPerSecond;
+    float recievedPacketsPerSecond;
+    float sentBytesPerSecond;
+    float recievedBytesPerSecond;
+};
+
 class NetChan
 {
 public:
@@ -68,22 +100,74 @@ public:
 
     static constexpr uint16_t RELIABLE_MAGIC_NUMBER = 3125;
 
+    //reliable messages bigger than this get split up and put back together on the other end
+    static constexpr size_t MAX_FRAGMENT_BYTES = 480;
+    static constexpr size_t MAX_FRAGMENTS = 48;
+
+    //the most data a single reliable message can carry, not counting its type
+    static constexpr size_t MAX_MESSAGE_BYTES = MAX_FRAGMENT_BYTES * MAX_FRAGMENTS - 1;
+
+    //how many reliable messages can be waiting on an ack at once, the rest get queued up
+    static constexpr uint32_t RELIABLE_WINDOW = 64;
+
+    //how much of a packet that already has something in it reliable messages get to use
+    static constexpr size_t MAX_RELIABLE_BYTES_PER_PACKET = 512;
+
+    //how long to wait for an ack before sending a reliable message again, until we know the round trip time
+    static constexpr std::chrono::milliseconds INITIAL_RESEND_TIME{ 200 };
+    static constexpr std::chrono::milliseconds MIN_RESEND_TIME{ 20 };
+    static constexpr std::chrono::milliseconds MAX_RESEND_TIME{ 1000 };
+
+    //sends a packet if there's unacked reliable data or an ack was queued
+    //and we haven't sent anything since the last call
     void trySendReliable(uint32_t salt);
 
+    //make sure the other end hears about the last packet we got, even if we have nothing to send
+    void queueAck();
+
+    NetChanStats getStats() const;
+
+    //how much each packet moves the loss estimates
+    static constexpr float LOSS_SMOOTHING = 1.0f / 32.0f;
+
+    //how often the per second rates get worked out
+    static constexpr std::chrono::seconds RATE_WINDOW{ 1 };
+
     //reliable
     void addReliableData(NetBuf sendBuf, NetMessageType msgType);
 
     //reliable
     void addReliableData(std::span<const std::byte> data, NetMessageType msgType);
 
-    //unreliable
-    void sendData(NetBuf sendBuf, NetMessageType msgType, uint32_t salt);
+    //bytes taken up by the header before any reliable messages
+    static constexpr size_t HEADER_BYTES = 2 + 1 + 4 + 4 + 4 + 4 + 4 + 8 + 1;
+
+    //the most data an unreliable packet can carry
+    static constexpr size_t MAX_DATA_BYTES = NetBuf::MAX_BYTES - HEADER_BYTES;
 
-    //unreliable
-    void sendData(std::span<const std::byte> data, NetMessageType msgType, uint32_t salt);
+    //unreliable, returns false if the data doesn't fit in a packet and nothing got sent
+    bool sendData(NetBuf sendBuf, NetMessageType msgType, uint32_t salt);
+
+    //unreliable, returns false if the data doesn't fit in a packet and nothing got sent
+    bool sendData(std::span<const std::byte> data, NetMessageType msgType, uint32_t salt);
 
     bool processHeader(NetBuf& inBuf, NetMessageType& outType, std::vector<NetBuf>& outReliableMessages, uint32_t expectedSalt);
 
+    //the sequence of the last packet we sent
+    uint32_t getOutgoingSequence() const;
+
+    //the sequence of the last packet we recieved
+    uint32_t getIncomingSequence() const;
+
+    //the sequence of the last packet of ours that the other end told us it recieved
+    uint32_t getAckedSequence() const;
+
+    //bit n is set if getAckedSequence() - 1 - n was recieved too
+    uint32_t getAckedSequenceBits() const;
+
+    //every byte that's gone out over this channel, headers included
+    uint64_t getTotalSentBytes() const;
+
 private:
     Net& net;
     NetSrc netSrc;
@@ -96,11 +180,16 @@ private:
         bool acked;
         uint32_t sequence;
         NetBuf data;
+        
+        //false until it's gone out at least once
+        bool sent;
+        std::chrono::steady_clock::time_point lastSendTime;
     };
 
+    //a reliable message that came in ahead of ones before it, waiting to be handed out in order
     struct InPacketInfo
     {
-        bool acked;
+        NetBuf data;
     };
 
     struct OutHeader
@@ -109,6 +198,13 @@ private:
         NetMessageType msgType;
         uint32_t salt;
         uint32_t sequence;
+        uint32_t sequenceAck;
+
+        //bit n is set if sequenceAck - 1 - n was recieved too
+        uint32_t sequenceAckBits;
+        
+        //every reliable message up to and including ack has been recieved
+        //bit n of ackBits is set if ack + 1 + n has been too
         uint32_t ack;
         uint64_t ackBits;
         uint8_t numReliableMessages;
@@ -121,16 +217,58 @@ private:
         NetMessageType msgType;
         uint32_t salt;
         uint32_t sequence;
+        uint32_t sequenceAck;
+
+        //bit n is set if sequenceAck - 1 - n was recieved too
+        uint32_t sequenceAckBits;
         uint32_t ack;
         uint64_t ackBits;
         uint8_t numReliableMessages;
         std::vector<OutPacketInfo> reliableMessages;
     };
 
-    void writeHeader(NetBuf& outBuf, NetMessageType msgType, uint32_t salt);
+    //fills in as many of the waiting reliable messages as fit with payloadSize bytes left over
+    //returns false if some of them had to be left for a later packet
+    bool writeHeader(NetBuf& outBuf, NetMessageType msgType, uint32_t salt, size_t payloadSize);
+
+    //bytes in front of each reliable message in the header
+    static constexpr size_t RELIABLE_MESSAGE_HEADER_BYTES = 4 + 4;
+
+    //bytes in front of the data in each fragment, after its type
+    static constexpr size_t FRAGMENT_HEADER_BYTES = 2 + 1 + 1;
 
     bool readHeader(NetBuf& inBuf, InHeader& outHeader, uint32_t expectedSalt);
 
+    void addReliableMessage(NetBuf msgBuf);
+
+    //tacks a small message onto the newest one if that hasn't gone out yet, so they share a header
+    //returns false if it couldn't be
+    bool tryBundleReliableMessage(const NetBuf& msgBuf);
+
+    //moves queued up messages into the window as acks make room
+    void fillReliableWindow();
+
+    bool isReliableMessageDue(const OutPacketInfo& packetInfo, std::chrono::steady_clock::time_point now) const;
+
+    std::chrono::nanoseconds getResendTime() const;
+
+    void updateRoundTripTime(uint32_t sequenceAck, std::chrono::steady_clock::time_point now);
+
+    //marks down which of our packets made it from an incoming header
+    void updateSendLoss(uint32_t sequenceAck, uint32_t sequenceAckBits);
+
+    //notes a new packet coming in, before incomingSequence is moved up to it
+    void updateRecieveLoss(uint32_t sequence);
+
+    //works out the per second rates once a window is up
+    void updateRates(std::chrono::steady_clock::time_point now);
+
+    //hands a reliable message that's now in order to the caller, splitting up bundles and joining fragments
+    void handleReliableMessage(NetBuf& msgBuf, std::vector<NetBuf>& outReliableMessages);
+
+    //returns true once the last fragment of a message is in, with the whole message in outMessage
+    bool addFragment(NetBuf& fragmentBuf, NetBuf& outMessage);
+
     //keeps track of if a packet has been recieved
     std::array<uint32_t, PACKET_BUFFER_SIZE> outgoingSequenceBuffer;
 
@@ -155,11 +293,60 @@ private:
     //returns the packet info of this sequence
     InPacketInfo& insertInPacketInfo(uint32_t sequence);
 
+    //when each of our recent packets went out, for timing the round trip, and if it's been acked
+    std::array<uint32_t, PACKET_BUFFER_SIZE> sentSequenceBuffer;
+    std::array<std::chrono::steady_clock::time_point, PACKET_BUFFER_SIZE> sentTimeBuffer;
+    std::array<bool, PACKET_BUFFER_SIZE> sentAckedBuffer;
+
+    //every packet of ours up to this one has been counted as lost or not
+    uint32_t outgoingSequenceCounted;
+
+    //bit n is set if we got incomingSequence - 1 - n
+    uint32_t incomingSequenceBits;
+
+    NetChanStats stats;
+    bool hasRoundTripTime;
+
+    //what's been sent and recieved since the current rate window started
+    std::chrono::steady_clock::time_point rateWindowStart;
+    uint32_t windowSentPackets;
+    uint32_t windowRecievedPackets;
+    size_t windowSentBytes;
+    size_t windowRecievedBytes;
+
+    uint64_t totalSentBytes;
+
     uint32_t outgoingSequence;
     uint32_t incomingSequence;
 
+    //latest of our packets that the other end has seen
+    uint32_t outgoingSequenceAcked;
+
+    //bit n is set if outgoingSequenceAcked - 1 - n has been seen too
+    uint32_t outgoingSequenceAckedBits;
+
     uint32_t outgoingReliableSequence;
+
+    //every reliable message of ours up to this one has been acked
+    uint32_t outgoingReliableAcked;
+
+    //every reliable message of theirs up to this one has been recieved and handed out
     uint32_t incomingReliableSequence;
+
+    //waiting for room in the window
+    std::deque<NetBuf> queuedReliableMessages;
+
+    uint16_t outgoingFragmentMessage;
+
+    //the fragmented message we're in the middle of getting
+    //reliable messages arrive in order, so there's only ever one of these
+    NetBuf incomingFragmentBuf;
+    uint16_t incomingFragmentMessage;
+    uint8_t incomingFragmentCount;
+    uint8_t nextIncomingFragment;
     
     bool shouldTrySendReliable;
+
+    //we recieved something that the other end will want an ack for
+    bool shouldSendAck;
 };
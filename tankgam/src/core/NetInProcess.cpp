@@ -0,0 +1,110 @@
+#include "NetInProcess.h"
+
+#include "Net.h"
+
+NetPacketRing::NetPacketRing()
+    : bufs{ std::make_unique<std::array<NetBuf, RING_SIZE>>() },
+      head{ 0 }, tail{ 0 },
+      recieverWaiting{ false }
+{
+    static_assert((RING_SIZE & (RING_SIZE - 1)) == 0, "RING_SIZE must be a power of 2");
+}
+
+NetPacketRing::~NetPacketRing() = default;
+
+bool NetPacketRing::push(NetBuf buf)
+{
+    const size_t currentTail = tail.load(std::memory_order_relaxed);
+    if (currentTail - head.load(std::memory_order_acquire) >= RING_SIZE)
+    {
+        return false;
+    }
+
+    (*bufs)[currentTail & (RING_SIZE - 1)] = std::move(buf);
+    tail.store(currentTail + 1, std::memory_order_seq_cst);
+
+    //only bother with the lock if someone is actually asleep
+    if (recieverWaiting.load(std::memory_order_seq_cst))
+    {
+        std::lock_guard<std::mutex> lock{ waitMutex };
+        waitCondition.notify_one();
+    }
+
+    return true;
+}
+
+bool NetPacketRing::pop(NetBuf& outBuf)
+{
+    const size_t currentHead = head.load(std::memory_order_relaxed);
+    if (currentHead == tail.load(std::memory_order_acquire))
+    {
+        return false;
+    }
+
+    outBuf = std::move((*bufs)[currentHead & (RING_SIZE - 1)]);
+    head.store(currentHead + 1, std::memory_order_release);
+
+    return true;
+}
+
+bool NetPacketRing::empty() const
+{
+    return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+}
+
+bool NetPacketRing::waitUntil(std::chrono::steady_clock::time_point deadline)
+{
+    std::unique_lock<std::mutex> lock{ waitMutex };
+
+    //has to be set before checking, otherwise a push could slip in between and never wake us
+    recieverWaiting.store(true, std::memory_order_seq_cst);
+    const bool hasPackets = waitCondition.wait_until(lock, deadline, [this]() -> bool
+        {
+            return !empty();
+        });
+    recieverWaiting.store(false, std::memory_order_relaxed);
+
+    return hasPackets;
+}
+
+NetInProcess::NetInProcess() = default;
+
+NetInProcess::~NetInProcess() = default;
+
+bool NetInProcess::getPacket(const NetSrc& src, NetBuf& buf, NetAddr& fromAddr)
+{
+    return getPackets(src, std::span<NetBuf>{ &buf, 1 }, std::span<NetAddr>{ &fromAddr, 1 }) > 0;
+}
+
+size_t NetInProcess::getPackets(const NetSrc& src, std::span<NetBuf> bufs, std::span<NetAddr> fromAddrs)
+{
+    NetPacketRing& ring = getRing(src);
+
+    size_t numPackets = 0;
+    while (numPackets < bufs.size() && numPackets < fromAddrs.size() &&
+           ring.pop(bufs[numPackets]))
+    {
+        fromAddrs[numPackets] = NetAddr{ NetAddrType::InProcess, 0, {} };
+        numPackets++;
+    }
+
+    return numPackets;
+}
+
+bool NetInProcess::sendPacket(const NetSrc& src, NetBuf buf, const NetAddr& /*toAddr*/)
+{
+    //whatever the server sends goes to the client and the other way around
+    NetPacketRing& ring = src == NetSrc::Server ? clientRing : serverRing;
+
+    return ring.push(std::move(buf));
+}
+
+bool NetInProcess::waitForPackets(const NetSrc& src, std::chrono::steady_clock::time_point deadline)
+{
+    return getRing(src).waitUntil(deadline);
+}
+
+NetPacketRing& NetInProcess::getRing(const NetSrc& src)
+{
+    return src == NetSrc::Server ? serverRing : clientRing;
+}
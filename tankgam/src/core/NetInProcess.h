@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <span>
+
+#include "NetBuf.h"
+
+struct NetAddr;
+enum class NetSrc;
+
+//a fixed size queue of packets between exactly one sending thread and one recieving thread
+//push and pop never lock, the mutex is only there so the reciever can sleep
+class NetPacketRing
+{
+public:
+    NetPacketRing();
+    ~NetPacketRing();
+
+    NetPacketRing(const NetPacketRing&) = delete;
+    NetPacketRing& operator=(const NetPacketRing&) = delete;
+
+    //only call from the sending thread
+    //returns false if the ring is full and the packet got dropped
+    bool push(NetBuf buf);
+
+    //only call from the recieving thread
+    bool pop(NetBuf& outBuf);
+
+    bool empty() const;
+
+    //only call from the recieving thread
+    //returns true if there's a packet waiting
+    bool waitUntil(std::chrono::steady_clock::time_point deadline);
+
+    //must be a power of 2
+    static constexpr size_t RING_SIZE = 256;
+
+private:
+    std::unique_ptr<std::array<NetBuf, RING_SIZE>> bufs;
+
+    //kept on seperate cache lines so the two threads don't fight over them
+    //the next slot to pop, only written by the reciever
+    alignas(64) std::atomic<size_t> head;
+    //the next slot to push, only written by the sender
+    alignas(64) std::atomic<size_t> tail;
+
+    std::atomic<bool> recieverWaiting;
+    std::mutex waitMutex;
+    std::condition_variable waitCondition;
+};
+
+//hands packets straight between a server and client living in the same process
+//each side has to stay on its own thread
+class NetInProcess
+{
+public:
+    NetInProcess();
+    ~NetInProcess();
+
+    NetInProcess(const NetInProcess&) = delete;
+    NetInProcess& operator=(const NetInProcess&) = delete;
+
+    bool getPacket(const NetSrc& src, NetBuf& buf, NetAddr& fromAddr);
+    size_t getPackets(const NetSrc& src, std::span<NetBuf> bufs, std::span<NetAddr> fromAddrs);
+
+    //packets go straight to the other side, there's nothing to flush
+    bool sendPacket(const NetSrc& src, NetBuf buf, const NetAddr& toAddr);
+
+    bool waitForPackets(const NetSrc& src, std::chrono::steady_clock::time_point deadline);
+
+private:
+    //packets going to the server and to the client
+    NetPacketRing serverRing;
+    NetPacketRing clientRing;
+
+    NetPacketRing& getRing(const NetSrc& src);
+};
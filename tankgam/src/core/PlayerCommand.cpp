@@ -0,0 +1,84 @@
+#include "PlayerCommand.h"
+
+#include <cmath>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include "Entity.h"
+#include "NetBuf.h"
+
+bool PlayerCommand::serializeBatch(const PlayerCommand* commands, size_t numCommands, NetBuf& buf)
+{
+    if (numCommands == 0 || numCommands > MAX_BATCH_COMMANDS)
+    {
+        return false;
+    }
+    
+    //the sequences go up by one, so only the first needs to be sent
+    if (!buf.writeUint32(commands[0].sequence))
+    {
+        return false;
+    }
+    
+    if (!buf.writeUint8(static_cast<uint8_t>(numCommands)))
+    {
+        return false;
+    }
+    
+    for (size_t i = 0; i < numCommands; i++)
+    {
+        if (!buf.writeFloat(commands[i].addRotation))
+        {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+bool PlayerCommand::deserializeBatch(std::vector<PlayerCommand>& outCommands, NetBuf& buf)
+{
+    outCommands.clear();
+    
+    uint32_t firstSequence;
+    if (!buf.readUint32(firstSequence))
+    {
+        return false;
+    }
+    
+    uint8_t numCommands;
+    if (!buf.readUint8(numCommands))
+    {
+        return false;
+    }
+    
+    if (numCommands == 0 || numCommands > MAX_BATCH_COMMANDS)
+    {
+        return false;
+    }
+    
+    for (uint8_t i = 0; i < numCommands; i++)
+    {
+        PlayerCommand command{ firstSequence + i, 0.0f };
+        if (!buf.readFloat(command.addRotation) || !std::isfinite(command.addRotation))
+        {
+            return false;
+        }
+        
+        //nobody's client turns faster than this
+        command.addRotation = std::clamp(command.addRotation, -MAX_ADD_ROTATION, MAX_ADD_ROTATION);
+        
+        outCommands.push_back(command);
+    }
+    
+    return true;
+}
+
+void PlayerCommand::apply(const PlayerCommand& command, Entity& entity)
+{
+    const glm::quat turn = glm::angleAxis(glm::radians(command.addRotation), glm::vec3{ 0.0f, 1.0f, 0.0f });
+    
+    entity.rotation = glm::normalize(turn * entity.rotation);
+}
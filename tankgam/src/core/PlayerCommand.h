@@ -1,6 +1,37 @@
 #pragma once
 
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+struct Entity;
+class NetBuf;
+
 struct PlayerCommand
 {
+    //starts at 1, so 0 can mean "no commands yet"
+    uint32_t sequence;
+    
     float addRotation;
+    
+    //write a run of commands with consecutive sequences into a single message
+    static bool serializeBatch(const PlayerCommand* commands, size_t numCommands, NetBuf& buf);
+    
+    //fails on anything that isn't a number, and clamps the rest into range
+    static bool deserializeBatch(std::vector<PlayerCommand>& outCommands, NetBuf& buf);
+    
+    //the server and the client's prediction both move entities with this, so they have to agree
+    static void apply(const PlayerCommand& command, Entity& entity);
+    
+    //the furthest a single command turns, in degrees either way
+    //commands that come in asking for more get clamped to it
+    static constexpr float MAX_ADD_ROTATION = 5.0f;
+    
+    //every command packet repeats up to this many of the newest unacked commands,
+    //so a dropped packet gets covered by the next one
+    static constexpr size_t MAX_BATCH_COMMANDS = 16;
+    
+    //the most unacked commands a client holds onto for prediction, a couple of seconds worth
+    //if the server hasn't acked them by then, it's not going to run them
+    static constexpr size_t MAX_UNACKED_COMMANDS = 128;
 };
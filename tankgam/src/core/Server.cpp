@@ -1,6 +1,8 @@
 #include "Server.h"
 
 #include <random>
+#include <limits>
+#include <algorithm>
 
 #include <fmt/format.h>
 
@@ -8,34 +10,93 @@
 #include "Net.h"
 #include "NetChan.h"
 #include "NetBuf.h"
+#include "ComponentStore.h"
+#include "JobSystem.h"
 
 #include <util/FileManager.h>
 #include <util/Log.h>
+#include <util/Bsp.h>
 
-Server::Server(Log& log, FileManager& fileManager, Net& net)
+//the client's last run command and the baseline sequence go in front of every snapshot
+static constexpr size_t SNAPSHOT_PACKET_HEADER_BYTES = 4 + 4;
+
+//the most entities a snapshot can have and still fit in a packet, even when every one of them replaces one from the baseline
+static constexpr size_t MAX_SNAPSHOT_ENTITIES = (NetChan::MAX_DATA_BYTES - SNAPSHOT_PACKET_HEADER_BYTES - Snapshot::DELTA_HEADER_BYTES) /
+    (Snapshot::MAX_DELTA_ENTITY_BYTES + Snapshot::REMOVED_DELTA_ENTITY_BYTES);
+
+Server::Server(Log& log, FileManager& fileManager, Net& net, size_t maxClients)
     : log{ log }, fileManager{ fileManager }, net{ net }
 {
     try
     {
-        clients.resize(4);
+        log.logf("Server: Max clients is %d", (int)maxClients);
+        
+        clients.resize(maxClients);
+        freeClients.reserve(maxClients);
+        clientsByAddr.reserve(maxClients);
+        clientsByCombinedSalt.reserve(maxClients);
         for (auto& client : clients)
         {
             client.state = ServerClientState::Free;
             client.netChan = std::make_unique<NetChan>(net, NetSrc::Server);
+            client.lastQueuedCommand = 0;
+            client.lastRunCommand = 0;
+            client.playerEntity = EntityId{};
+            client.hasPlayerEntity = false;
+            client.maxRate = 0;
+            client.rateBudget = 0;
+            client.rateBudgetTick = 0;
+            client.chargedSentBytes = 0;
+            client.snapshotInterval = 0;
+            client.nextSnapshotTick = 0;
+            client.lastIntervalAdjustTick = 0;
+            client.numChokedSnapshots = 0;
+            client.numLostCommands = 0;
             client.lastRecievedTime = 0;
             client.clientSalt = 0;
             client.serverSalt = 0;
             client.combinedSalt = 0;
         }
+        
+        //reversed so the lowest slots get handed out first
+        for (size_t i = maxClients; i > 0; i--)
+        {
+            freeClients.push_back(i - 1);
+        }
 
         log.log("Server: Init Timer Subsystem...");
         timer = std::make_unique<Timer>();
         timer->start();
+        lastTick = timer->getTotalTicks();
+        currentTick = lastTick;
+        
+        log.log("Server: Init Job System...");
+        jobs = std::make_unique<JobSystem>();
+        log.logf("Server: Running jobs on %d threads", (int)jobs->getNumThreads());
+        
+        maxCatchUpTicks = DEFAULT_MAX_CATCH_UP_TICKS;
+        
+        clientRate = DEFAULT_CLIENT_RATE;
+        snapshotInterval = DEFAULT_SNAPSHOT_INTERVAL;
+        
+        currentSnapshot = Snapshot{};
+        
+        recvBufs.reserve(Net::MAX_PACKET_BATCH);
+        for (size_t i = 0; i < Net::MAX_PACKET_BATCH; i++)
+        {
+            recvBufs.emplace_back(net.getBufPool());
+        }
+        recvAddrs.resize(Net::MAX_PACKET_BATCH);
         
         entityManager = std::make_unique<EntityManager>();
+        components = std::make_unique<ComponentStore>();
+        
+        //reserve the null model
+        modelNames.emplace_back();
         
-        allocateGlobalEntity(Entity{ glm::vec3{ 0.0f, -2.5f, -7.0f }, glm::identity<glm::quat>(), "models/tank/tank_body.txt" });
-        allocateGlobalEntity(Entity{ glm::vec3{ 0.0f, -2.5f, -7.0f }, glm::identity<glm::quat>(), "models/tank/tank_turret.txt" });
+        getModelIndex("models/tank/tank_body.txt");
+        const EntityId turretEntity = allocateGlobalEntity(Entity{ glm::vec3{ 0.0f, -2.5f, -7.0f }, glm::identity<glm::quat>(), getModelIndex("models/tank/tank_turret.txt") });
+        components->add(turretEntity, AngularVelocityComponent{ glm::vec3{ 0.0f, 1.0f, 0.0f }, TURRET_DEGREES_PER_SECOND });
     }
     catch (const std::exception& e)
     {
@@ -67,6 +128,33 @@ Server::~Server()
     }
 }
 
+void Server::loadMap(std::string_view mapFileName)
+{
+    log.logf("Server: Loading map %s", mapFileName.data());
+    
+    try
+    {
+        std::stringstream mapFileStream = fileManager.readFile(mapFileName);
+        map = std::make_unique<bsp::File>(bsp::parseBspFile(mapFileName, mapFileStream));
+        
+        if (map->leaves.empty())
+        {
+            throw std::runtime_error{ fmt::format("Map {} has no leaves", mapFileName) };
+        }
+    }
+    catch (const std::exception& e)
+    {
+        map.reset();
+        log.log(LogLevel::Error, fmt::format("Server: Map Load Error:\n{}", e.what()));
+        throw;
+    }
+    
+    if (map->visData.empty())
+    {
+        log.logf(LogLevel::Warning, "Server: Map %s has no visibility info, every entity will be sent to every client", mapFileName.data());
+    }
+}
+
 bool Server::runFrame()
 {
     try
@@ -75,9 +163,20 @@ bool Server::runFrame()
 
         handleEvents();
 
-        tryRunTicks();
+        //only send out new state when there is new state
+        if (const uint64_t ticksRun = tryRunTicks(); ticksRun > 0)
+        {
+            sendPackets();
+            
+            //see if we crossed a logging boundary while catching up
+            if (currentTick / STATS_LOG_TICKS != (currentTick - ticksRun) / STATS_LOG_TICKS)
+            {
+                logClientStats();
+            }
+        }
         
-        sendPackets();
+        //everything we sent this frame goes out together
+        net.flushPackets(NetSrc::Server);
     }
     catch (const std::exception& e)
     {
@@ -93,12 +192,74 @@ void Server::shutdown()
     running = false;
 }
 
+void Server::setMaxCatchUpTicks(uint64_t ticks)
+{
+    maxCatchUpTicks = std::max<uint64_t>(ticks, 1);
+}
+
+void Server::setClientRate(uint32_t bytesPerSecond)
+{
+    clientRate = std::max<uint32_t>(bytesPerSecond, 1);
+}
+
+void Server::setSnapshotInterval(uint64_t ticks)
+{
+    snapshotInterval = std::clamp<uint64_t>(ticks, 1, MAX_SNAPSHOT_INTERVAL);
+}
+
+size_t Server::getMaxClients() const
+{
+    return clients.size();
+}
+
+bool Server::getClientStats(size_t clientIndex, NetChanStats& outStats) const
+{
+    if (clientIndex >= clients.size() || clients[clientIndex].state == ServerClientState::Free)
+    {
+        return false;
+    }
+    
+    outStats = clients[clientIndex].netChan->getStats();
+    
+    return true;
+}
+
 EntityId Server::allocateGlobalEntity(Entity globalEntity)
 {
     EntityId netEntityId = entityManager->allocateGlobalEntity();
-    Entity* newEntity = entityManager->getGlobalEntity(netEntityId);
-    *newEntity = globalEntity;
+    entityManager->setGlobalEntity(netEntityId, globalEntity);
+    
+    //clients find out about it in the first snapshot they can see it in
+    return netEntityId;
+}
+
+void Server::freeGlobalEntity(EntityId netEntityId)
+{
+    entityManager->freeGlobalEntity(netEntityId);
+    components->removeEntity(netEntityId);
+    
+    //and it goes away on clients once it's missing from their snapshots
+}
+
+uint16_t Server::getModelIndex(std::string_view modelName)
+{
+    const std::string name{ modelName };
+    if (const auto it = modelIndices.find(name);
+        it != modelIndices.end())
+    {
+        return it->second;
+    }
+    
+    if (modelNames.size() >= std::numeric_limits<uint16_t>::max())
+    {
+        throw std::runtime_error{ "Ran out of model indices!" };
+    }
+    
+    const uint16_t modelIndex = static_cast<uint16_t>(modelNames.size());
+    modelNames.push_back(name);
+    modelIndices[name] = modelIndex;
     
+    //let everyone know about the new model
     for (auto& client : clients)
     {
         if (client.state == ServerClientState::Free)
@@ -106,136 +267,184 @@ EntityId Server::allocateGlobalEntity(Entity globalEntity)
             continue;
         }
         
-        NetBuf sendBuf{};
-        sendBuf.writeUint16(netEntityId);
-        Entity::serialize(*newEntity, sendBuf);
+        NetBuf sendBuf{ net.getBufPool() };
+        sendBuf.writeUint16(modelIndex);
+        sendBuf.writeString(name);
+        
+        client.netChan->addReliableData(std::move(sendBuf), NetMessageType::ModelIndex);
+    }
+    
+    return modelIndex;
+}
 
-        client.netChan->addReliableData(std::move(sendBuf), NetMessageType::CreateEntity);
+ServerClient* Server::allocateClient(const NetAddr& addr)
+{
+    if (freeClients.empty())
+    {
+        return nullptr;
     }
     
-    return netEntityId;
+    const size_t clientIndex = freeClients.back();
+    freeClients.pop_back();
+    
+    ServerClient& client = clients[clientIndex];
+    client.state = ServerClientState::Challenging;
+    client.netChan->setToAddr(addr);
+    
+    //start them off with a full burst so the first snapshot goes straight out
+    client.maxRate = clientRate;
+    client.rateBudget = static_cast<int64_t>(clientRate * MAX_RATE_BURST_TICKS / Timer::TICK_RATE);
+    client.rateBudgetTick = currentTick;
+    client.chargedSentBytes = client.netChan->getTotalSentBytes();
+    client.snapshotInterval = snapshotInterval;
+    client.nextSnapshotTick = 0;
+    client.lastIntervalAdjustTick = currentTick;
+    client.numChokedSnapshots = 0;
+    client.numLostCommands = 0;
+    
+    clientsByAddr[addr] = clientIndex;
+    
+    return &client;
 }
 
-void Server::freeGlobalEntity(EntityId netEntityId)
+ServerClient* Server::getClientByAddr(const NetAddr& addr)
 {
-    entityManager->freeGlobalEntity(netEntityId);
+    const auto it = clientsByAddr.find(addr);
+    if (it == clientsByAddr.end())
+    {
+        return nullptr;
+    }
     
-    for (auto& client : clients)
+    return &clients[it->second];
+}
+
+ServerClient* Server::getClientByCombinedSalt(uint32_t combinedSalt)
+{
+    const auto it = clientsByCombinedSalt.find(combinedSalt);
+    if (it == clientsByCombinedSalt.end())
     {
-        if (client.state != ServerClientState::Free)
-        {
-            continue;
-        }
-        
-        NetBuf sendBuf{};
-        sendBuf.writeUint16(netEntityId);
-        
-        client.netChan->addReliableData(std::move(sendBuf), NetMessageType::DestroyEntity);
+        return nullptr;
     }
+    
+    return &clients[it->second];
 }
 
 void Server::disconnectClient(ServerClient& client, bool forceDisconnect)
 {
+    if (client.state == ServerClientState::Free)
+    {
+        return;
+    }
+    
     log.logf("Server: Disconnect client from %d", (int)client.netChan->getToAddr().port);
 
     if (forceDisconnect)
     {
-        NetBuf sendBuf;
+        NetBuf sendBuf{ net.getBufPool() };
         sendBuf.writeString("server_disconnect");
         sendBuf.writeUint32(client.combinedSalt);
 
         NetChan::outOfBand(net, NetSrc::Server, client.netChan->getToAddr(), std::move(sendBuf));
     }
 
+    clientsByAddr.erase(client.netChan->getToAddr());
+    clientsByCombinedSalt.erase(client.combinedSalt);
+    freeClients.push_back(static_cast<size_t>(&client - clients.data()));
+
     client.state = ServerClientState::Free;
     client.netChan = std::make_unique<NetChan>(net, NetSrc::Server);
+    client.snapshots.clear();
+    client.pendingCommands.clear();
+    client.lastQueuedCommand = 0;
+    client.lastRunCommand = 0;
     client.lastRecievedTime = 0;
     client.clientSalt = 0;
     client.serverSalt = 0;
     client.combinedSalt = 0;
+
+    //everybody else gets told their tank is gone
+    if (client.hasPlayerEntity)
+    {
+        freeGlobalEntity(client.playerEntity);
+        client.hasPlayerEntity = false;
+    }
 }
 
 void Server::handlePackets()
 {
-    NetBuf buf{};
-    NetAddr fromAddr{};
-    while (net.getPacket(NetSrc::Server, buf, fromAddr))
+    size_t numPackets;
+    while ((numPackets = net.getPackets(NetSrc::Server, recvBufs, recvAddrs)) > 0)
     {
-        //read the first 2 bytes of the msg
-        uint16_t header;
-        if (!buf.readUint16(header))
-        {
-            continue;
-        }
-
-        //if it matches the out of band then it's an unconnected message
-        if (header == NetChan::OUT_OF_BAND_MAGIC_NUMBER)
-        {
-            handleUnconnectedPacket(buf, fromAddr);
-            continue;
-        }
-
-        //if it's not reliable magic number then it's broken
-        if (header != NetChan::RELIABLE_MAGIC_NUMBER)
+        for (size_t i = 0; i < numPackets; i++)
         {
-            log.log(LogLevel::Warning, "Server: Ignoring packet with mismatched magic number");
-            continue;
-        }
+            NetBuf& buf = recvBufs[i];
+            const NetAddr& fromAddr = recvAddrs[i];
+            
+            //read the first 2 bytes of the msg
+            uint16_t header;
+            if (!buf.readUint16(header))
+            {
+                continue;
+            }
 
-        //reset read head
-        buf.beginRead();
+            //if it matches the out of band then it's an unconnected message
+            if (header == NetChan::OUT_OF_BAND_MAGIC_NUMBER)
+            {
+                handleUnconnectedPacket(buf, fromAddr);
+                continue;
+            }
 
-        ServerClient* client = nullptr;
-        for (auto& currentClient : clients)
-        {
-            if (currentClient.state == ServerClientState::Free ||
-                currentClient.netChan->getToAddr() != fromAddr)
+            //if it's not reliable magic number then it's broken
+            if (header != NetChan::RELIABLE_MAGIC_NUMBER)
             {
+                log.log(LogLevel::Warning, "Server: Ignoring packet with mismatched magic number");
                 continue;
             }
 
-            client = &currentClient;
-        }
+            //reset read head
+            buf.beginRead();
 
-        if (!client)
-        {
-            continue;
-        }
+            ServerClient* client = getClientByAddr(fromAddr);
+            if (!client)
+            {
+                continue;
+            }
         
-        client->lastRecievedTime = timer->getTotalTicks();
+            client->lastRecievedTime = timer->getTotalTicks();
         
-        NetMessageType msgType = NetMessageType::Unknown;
-        std::vector<NetBuf> reliableMessages;
-        if (!client->netChan->processHeader(buf, msgType, reliableMessages, client->combinedSalt) ||
-            msgType == NetMessageType::Unknown)
-        {
-            continue;
-        }
+            NetMessageType msgType = NetMessageType::Unknown;
+            std::vector<NetBuf> reliableMessages;
+            if (!client->netChan->processHeader(buf, msgType, reliableMessages, client->combinedSalt) ||
+                msgType == NetMessageType::Unknown)
+            {
+                continue;
+            }
 
-        for (auto& reliableMessage : reliableMessages)
-        {
-            //reliable messages have their own type
-            NetMessageType reliableMsgType;
+            for (auto& reliableMessage : reliableMessages)
             {
-                uint8_t tempV;
-                if (!reliableMessage.readUint8(tempV))
+                //reliable messages have their own type
+                NetMessageType reliableMsgType;
                 {
-                    log.logf(LogLevel::Warning, "Unknown type of %d", tempV);
-                    continue;
+                    uint8_t tempV;
+                    if (!reliableMessage.readUint8(tempV))
+                    {
+                        log.logf(LogLevel::Warning, "Unknown type of %d", tempV);
+                        continue;
+                    }
+
+                    reliableMsgType = static_cast<NetMessageType>(tempV);
                 }
 
-                reliableMsgType = static_cast<NetMessageType>(tempV);
+                handleReliablePacket(reliableMessage, reliableMsgType, *client);
             }
 
-            handleReliablePacket(reliableMessage, reliableMsgType, *client);
-        }
-
-        if (msgType == NetMessageType::SendReliables)
-        {
-            continue;
-        }
+            if (msgType == NetMessageType::SendReliables)
+            {
+                continue;
+            }
         
-        handleUnreliablePacket(buf, msgType, *client);
+            handleUnreliablePacket(buf, msgType, *client);
+        }
     }
 
     for (auto& client : clients)
@@ -279,36 +488,25 @@ void Server::handleUnconnectedPacket(NetBuf& buf, const NetAddr& fromAddr)
         }
 
         //check if client already exists
-        for (auto& client : clients)
+        if (ServerClient* existingClient = getClientByAddr(fromAddr))
         {
-            if (client.state != ServerClientState::Free &&
-                client.clientSalt == clientSalt)
+            if (existingClient->clientSalt == clientSalt)
             {
                 log.logf("Server: Client tried to connect from %d twice", (int)fromAddr.port);
                 return;
             }
-        }
-
-        ServerClient* newClient = nullptr;
-        for (auto& client : clients)
-        {
-            if (client.state != ServerClientState::Free)
-            {
-                continue;
-            }
 
-            newClient = &client;
-            break;
+            //whoever was here before must have restarted
+            disconnectClient(*existingClient, false);
         }
 
+        ServerClient* newClient = allocateClient(fromAddr);
         if (!newClient)
         {
             NetChan::outOfBandPrint(net, NetSrc::Server, fromAddr, "server_noroom");
             return;
         }
 
-        newClient->state = ServerClientState::Challenging;
-        newClient->netChan->setToAddr(fromAddr);
         newClient->lastRecievedTime = timer->getTotalTicks();
 
         //fill out salts
@@ -319,16 +517,21 @@ void Server::handleUnconnectedPacket(NetBuf& buf, const NetAddr& fromAddr)
             std::mt19937 rng{ dev() };
             std::uniform_int_distribution<std::mt19937::result_type> dist{ 1 };
 
-            newClient->serverSalt = dist(rng);
+            //the combined salt has to be unique so we can find the client by it
+            do
+            {
+                newClient->serverSalt = dist(rng);
+                newClient->combinedSalt = newClient->clientSalt ^ newClient->serverSalt;
+            } while (newClient->combinedSalt == 0 || getClientByCombinedSalt(newClient->combinedSalt));
         }
         log.logf(LogLevel::Debug, "Server: Chose server salt of %d", newClient->serverSalt);
-
-        newClient->combinedSalt = newClient->clientSalt ^ newClient->serverSalt;
         log.logf(LogLevel::Debug, "Server: Combined salt of %d", newClient->combinedSalt);
 
+        clientsByCombinedSalt[newClient->combinedSalt] = static_cast<size_t>(newClient - clients.data());
+
         //send back a challenge
         {
-            NetBuf sendBuf;
+            NetBuf sendBuf{ net.getBufPool() };
             sendBuf.writeString("server_challenge");
             sendBuf.writeUint32(newClient->clientSalt);
             sendBuf.writeUint32(newClient->serverSalt);
@@ -346,24 +549,23 @@ void Server::handleUnconnectedPacket(NetBuf& buf, const NetAddr& fromAddr)
             return;
         }
 
-        ServerClient* newClient = nullptr;
-        for (auto& client : clients)
+        ServerClient* newClient = getClientByCombinedSalt(combinedSalt);
+        if (!newClient || newClient->state != ServerClientState::Challenging)
         {
-            if (client.state != ServerClientState::Challenging)
-            {
-                continue;
-            }
+            return;
+        }
 
-            if (combinedSalt == client.combinedSalt)
+        //they might have moved since they first connected
+        if (const NetAddr oldAddr = newClient->netChan->getToAddr();
+            oldAddr != fromAddr)
+        {
+            if (getClientByAddr(fromAddr))
             {
-                newClient = &client;
-                break;
+                return;
             }
-        }
 
-        if (!newClient)
-        {
-            return;
+            clientsByAddr.erase(oldAddr);
+            clientsByAddr[fromAddr] = static_cast<size_t>(newClient - clients.data());
         }
 
         newClient->state = ServerClientState::Connected;
@@ -371,7 +573,7 @@ void Server::handleUnconnectedPacket(NetBuf& buf, const NetAddr& fromAddr)
         newClient->lastRecievedTime = timer->getTotalTicks();
 
         {
-            NetBuf sendBuf;
+            NetBuf sendBuf{ net.getBufPool() };
             sendBuf.writeString("server_connect");
             sendBuf.writeUint32(newClient->combinedSalt);
 
@@ -388,22 +590,8 @@ void Server::handleUnconnectedPacket(NetBuf& buf, const NetAddr& fromAddr)
             return;
         }
 
-        ServerClient* disconnectingClient = nullptr;
-        for (auto& client : clients)
-        {
-            if (client.state == ServerClientState::Free || client.state == ServerClientState::Challenging)
-            {
-                continue;
-            }
-
-            if (combinedSalt == client.combinedSalt)
-            {
-                disconnectingClient = &client;
-                break;
-            }
-        }
-
-        if (!disconnectingClient)
+        ServerClient* disconnectingClient = getClientByCombinedSalt(combinedSalt);
+        if (!disconnectingClient || disconnectingClient->state == ServerClientState::Challenging)
         {
             return;
         }
@@ -422,24 +610,31 @@ void Server::handleReliablePacket(NetBuf& buf, const NetMessageType& msgType, Se
             return;
         }
 
-        NetBuf sendBuf{};
+        //they might ask again if the answer took too long, but they only get the one tank
+        if (!client.hasPlayerEntity)
+        {
+            const float spawnOffset = PLAYER_SPAWN_SPACING * static_cast<float>(&client - clients.data());
+            client.playerEntity = allocateGlobalEntity(Entity{ glm::vec3{ spawnOffset, -2.5f, -7.0f }, glm::identity<glm::quat>(), getModelIndex("models/tank/tank_body.txt") });
+            client.hasPlayerEntity = true;
+        }
+
+        //the model table can be bigger than a packet, NetChan splits it up for us
+        NetBuf sendBuf{ net.getBufPool(), NetChan::MAX_MESSAGE_BYTES };
         sendBuf.writeUint64(clientTime);
-        sendBuf.writeUint64(timer->getTotalTicks());
+        sendBuf.writeUint64(timer->getTotalTime());
 
-        std::vector<EntityId> globalEntities = entityManager->getGlobalEntities();
-        sendBuf.writeUint32(static_cast<uint32_t>(globalEntities.size()));
-        for (EntityId entityId : globalEntities)
-        {
-            Entity* globalEntity = entityManager->getGlobalEntity(entityId);
-            if (!globalEntity)
-            {
-                throw std::runtime_error{ "This should never happen (global entity not available?!)" };
-            }
+        //which entity they should be predicting
+        EntityId::serialize(client.playerEntity, sendBuf);
 
-            sendBuf.writeUint16(entityId);
-            Entity::serialize(*globalEntity, sendBuf);
+        //the whole model table, anything newer gets sent seperately
+        sendBuf.writeUint16(static_cast<uint16_t>(modelNames.size()));
+        for (const std::string& modelName : modelNames)
+        {
+            sendBuf.writeString(modelName);
         }
 
+        //no entities, their first snapshot is a full one with only what they can see from their tank
+
         client.netChan->addReliableData(std::move(sendBuf), NetMessageType::Synchronize);
     }
 }
@@ -448,13 +643,68 @@ void Server::handleUnreliablePacket(NetBuf& buf, const NetMessageType& msgType,
 {
     if (msgType == NetMessageType::PlayerCommand)
     {
-        float rot = 0.0f;
-        buf.readFloat(rot);
+        std::vector<PlayerCommand> commands;
+        if (!PlayerCommand::deserializeBatch(commands, buf))
+        {
+            return;
+        }
+
+        for (const PlayerCommand& command : commands)
+        {
+            //resent for redundancy, we've already got it
+            if (command.sequence <= client.lastQueuedCommand)
+            {
+                continue;
+            }
+
+            //they're sending faster than they get run, the rest come again with their next batch
+            if (client.pendingCommands.size() >= MAX_PENDING_COMMANDS)
+            {
+                break;
+            }
+
+            //the batch doesn't reach back far enough to cover the gap, so those are gone for good
+            if (const uint32_t expectedCommand = client.lastQueuedCommand + 1;
+                command.sequence > expectedCommand)
+            {
+                const uint32_t numLost = command.sequence - expectedCommand;
+                client.numLostCommands += numLost;
 
-        rotationAmount += rot;
+                log.logf(LogLevel::Warning, "Server: Client %d lost %d commands", (int)(&client - clients.data()), (int)numLost);
+            }
+
+            client.pendingCommands.push_back(command);
+            client.lastQueuedCommand = command.sequence;
+        }
 
         //log.logf(LogLevel::Debug, "Server: Rotation command recieved from: %d (tick %d)", client.netChan->getToAddr().port, timer->getTotalTicks());
     }
+    else if (msgType == NetMessageType::SnapshotRequest)
+    {
+        uint32_t failedSequence;
+        if (!buf.readUint32(failedSequence))
+        {
+            return;
+        }
+
+        //they've acked a snapshot they never got to store, so nothing we'd delta against can be trusted
+        client.snapshots.dropBaselines(failedSequence);
+    }
+    else if (msgType == NetMessageType::TimeSynchronize)
+    {
+        uint64_t clientTime;
+        if (!buf.readUint64(clientTime))
+        {
+            return;
+        }
+
+        //answered straight away so the round trip is as close as it can be to the real one
+        NetBuf sendBuf{ net.getBufPool() };
+        sendBuf.writeUint64(clientTime);
+        sendBuf.writeUint64(timer->getTotalTime());
+
+        client.netChan->sendData(std::move(sendBuf), NetMessageType::TimeSynchronize, client.combinedSalt);
+    }
 }
 
 void Server::handleEvents()
@@ -462,36 +712,113 @@ void Server::handleEvents()
 
 }
 
-void Server::tryRunTicks()
+uint64_t Server::tryRunTicks()
 {
-#if 0
     const uint64_t totalTicks = timer->getTotalTicks();
-    const uint64_t ticks = totalTicks - lastTick;
+    if (totalTicks <= lastTick)
+    {
+        return 0;
+    }
     
-    if (ticks == 0)
+    uint64_t ticks = totalTicks - lastTick;
+    
+    //if we fell this far behind, we're better off dropping the time than trying to catch up
+    if (ticks > maxCatchUpTicks)
     {
-        return;
+        log.logf(LogLevel::Warning, "Server: Tick overrun, %d ticks behind, skipping %d",
+            (int)ticks, (int)(ticks - maxCatchUpTicks));
+        
+        lastTick = totalTicks - maxCatchUpTicks;
+        ticks = maxCatchUpTicks;
+    }
+    else if (ticks > 1)
+    {
+        log.logf(LogLevel::Debug, "Server: Tick overrun, catching up %d ticks", (int)ticks);
     }
     
     for (uint64_t i = 0; i < ticks; i++)
     {
-        currentTick = lastTick + i;
-        //for (auto& [id, thing] : things)
+        currentTick = ++lastTick;
+        runTick();
+    }
+    
+    return ticks;
+}
+
+void Server::runTick()
+{
+    for (auto& client : clients)
+    {
+        if (client.state == ServerClientState::Free || client.pendingCommands.empty())
         {
-            //    thing->think();
+            continue;
+        }
+        
+        //anything past the limit waits for the next tick
+        const auto endCommand = client.pendingCommands.begin() +
+            static_cast<std::ptrdiff_t>(std::min(client.pendingCommands.size(), MAX_COMMANDS_PER_TICK));
+        
+        //each client only gets to drive their own tank
+        Entity entity;
+        if (client.hasPlayerEntity && entityManager->getGlobalEntity(client.playerEntity, entity))
+        {
+            for (auto it = client.pendingCommands.begin(); it != endCommand; ++it)
+            {
+                PlayerCommand::apply(*it, entity);
+            }
+            
+            entityManager->setGlobalEntity(client.playerEntity, entity);
         }
+        
+        client.lastRunCommand = (endCommand - 1)->sequence;
+        client.pendingCommands.erase(client.pendingCommands.begin(), endCommand);
     }
     
-    lastTick = totalTicks;
-#endif
+    updateSpinning();
+}
+
+void Server::updateSpinning()
+{
+    constexpr float TICK_SECONDS = 1.0f / static_cast<float>(Timer::TICK_RATE);
     
-    Entity* entity = entityManager->getGlobalEntity(0);
-    glm::mat4 d = glm::rotate(glm::mat4{1.0f}, glm::radians(std::fmod(rotationAmount, 360.0f)), glm::vec3{0.0f, 1.0f, 0.0f});
-    entity->rotation = glm::quat_cast(d);
+    const EntityView globalEntities = entityManager->getGlobalEntities();
+    components->parallelForEach<AngularVelocityComponent>(*jobs, [this, &globalEntities](std::span<const EntityId> ids, std::span<AngularVelocityComponent> angularVelocities)
+        {
+            for (size_t i = 0; i < ids.size(); i++)
+            {
+                size_t index;
+                if (!entityManager->getGlobalIndex(ids[i], index))
+                {
+                    continue;
+                }
+                
+                const AngularVelocityComponent& angularVelocity = angularVelocities[i];
+                const glm::quat turn = glm::angleAxis(glm::radians(angularVelocity.degreesPerSecond * TICK_SECONDS), angularVelocity.axis);
+                
+                glm::quat& rotation = globalEntities.rotations[index];
+                rotation = glm::normalize(turn * rotation);
+            }
+        });
+}
+
+void Server::sleepUntilNextTick()
+{
+    const uint64_t waitTime = timer->getNanosUntilTick(lastTick + 1);
+    if (waitTime == 0)
+    {
+        return;
+    }
+    
+    //wake up early if someone sends us something
+    net.waitForPackets(NetSrc::Server, std::chrono::steady_clock::now() + std::chrono::nanoseconds{ waitTime });
 }
 
 void Server::sendPackets()
 {
+    visibleSnapshots.clear();
+    snapshotJobs.clear();
+    
+    //work out who's due a snapshot first, all of this touches shared state so it stays on this thread
     for (auto& client : clients)
     {
         if (client.state == ServerClientState::Free)
@@ -499,18 +826,282 @@ void Server::sendPackets()
             continue;
         }
         
-        NetBuf sendBuf{};
+        updateRateBudget(client);
         
-        const std::vector<EntityId> globalEntities = entityManager->getGlobalEntities();
-        sendBuf.writeUint32(static_cast<uint32_t>(globalEntities.size()));
-        for (EntityId globalId : globalEntities)
+        if (currentTick < client.nextSnapshotTick)
         {
-            sendBuf.writeUint16(globalId);
-            
-            Entity* entity = entityManager->getGlobalEntity(globalId);
-            Entity::serialize(*entity, sendBuf);
+            continue;
+        }
+        
+        //they've used up their rate, so try again next tick
+        if (client.rateBudget < 0)
+        {
+            client.numChokedSnapshots++;
+            continue;
+        }
+        
+        adjustSnapshotInterval(client);
+        client.nextSnapshotTick = currentTick + client.snapshotInterval;
+        
+        snapshotJobs.push_back(SnapshotJob{ &client, nullptr, NetBuf{}, 0, false });
+    }
+    
+    if (snapshotJobs.empty())
+    {
+        return;
+    }
+    
+    Snapshot::build(currentSnapshot, currentTick, *entityManager);
+    encodedSnapshot.build(currentSnapshot, net.getBufPool(), jobs.get());
+    updateEntityLeaves();
+    
+    //every client looking from the same leaf gets the same state, just compressed against a different baseline
+    for (SnapshotJob& job : snapshotJobs)
+    {
+        job.visibleSnapshot = &getClientSnapshot(*job.client, getVisibleSnapshot(getClientViewLeaf(*job.client)));
+    }
+    
+    //each job only touches its own client, and the delta caches can be shared between threads
+    jobs->parallelFor(snapshotJobs.size(), 1, [this](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; i++)
+            {
+                SnapshotJob& job = snapshotJobs[i];
+                ServerClient& client = *job.client;
+                
+                //the sequence that this packet will be sent with
+                const uint32_t sequence = client.netChan->getOutgoingSequence() + 1;
+                
+                job.sendBuf = NetBuf{ net.getBufPool() };
+                job.sendBuf.writeUint32(client.lastRunCommand);
+                
+                job.written = client.snapshots.writeSnapshot(sequence, *job.visibleSnapshot->deltas,
+                    client.netChan->getAckedSequence(), client.netChan->getAckedSequenceBits(), job.sendBuf, job.baselineSequence);
+                
+                //it has to fit in one packet along with the header
+                job.written = job.written && job.sendBuf.getData().size() <= NetChan::MAX_DATA_BYTES;
+            }
+        });
+    
+    //sent in client order no matter which thread finished first
+    for (SnapshotJob& job : snapshotJobs)
+    {
+        ServerClient& client = *job.client;
+        
+        if (!job.written || !client.netChan->sendData(std::move(job.sendBuf), NetMessageType::EntitySynchronize, client.combinedSalt))
+        {
+            log.logf(LogLevel::Warning, "Server: Snapshot too large for client %d", (int)client.netChan->getToAddr().port);
+            continue;
+        }
+        
+        //only now is it something the client could ack
+        client.snapshots.storeSnapshot(client.netChan->getOutgoingSequence(), job.visibleSnapshot->deltas->getSnapshot(), job.baselineSequence);
+    }
+    
+    //don't hang onto the packets' blocks until next tick
+    snapshotJobs.clear();
+}
+
+void Server::updateRateBudget(ServerClient& client)
+{
+    //this catches the reliable only packets too
+    const uint64_t totalSentBytes = client.netChan->getTotalSentBytes();
+    client.rateBudget -= static_cast<int64_t>(totalSentBytes - client.chargedSentBytes);
+    client.chargedSentBytes = totalSentBytes;
+    
+    const uint64_t ticks = currentTick - client.rateBudgetTick;
+    client.rateBudgetTick = currentTick;
+    
+    const int64_t maxBudget = static_cast<int64_t>(client.maxRate * MAX_RATE_BURST_TICKS / Timer::TICK_RATE);
+    client.rateBudget = std::min(client.rateBudget + static_cast<int64_t>(client.maxRate * ticks / Timer::TICK_RATE), maxBudget);
+}
+
+void Server::adjustSnapshotInterval(ServerClient& client)
+{
+    if (currentTick - client.lastIntervalAdjustTick < SNAPSHOT_INTERVAL_ADJUST_TICKS)
+    {
+        return;
+    }
+    
+    client.lastIntervalAdjustTick = currentTick;
+    
+    const float sendLoss = client.netChan->getStats().sendLoss;
+    if (sendLoss > HIGH_SEND_LOSS && client.snapshotInterval < MAX_SNAPSHOT_INTERVAL)
+    {
+        client.snapshotInterval++;
+        log.logf(LogLevel::Debug, "Server: Client %d losing packets, snapshot interval up to %d",
+            (int)client.netChan->getToAddr().port, (int)client.snapshotInterval);
+    }
+    else if (sendLoss < LOW_SEND_LOSS && client.snapshotInterval > snapshotInterval)
+    {
+        client.snapshotInterval--;
+    }
+}
+
+void Server::logClientStats()
+{
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+        NetChanStats stats{};
+        if (!getClientStats(i, stats))
+        {
+            continue;
         }
         
-        client.netChan->sendData(std::move(sendBuf), NetMessageType::EntitySynchronize, client.combinedSalt);
+        ServerClient& client = clients[i];
+        
+        log.log(LogLevel::Debug, fmt::format("Server: Client {} rtt {:.1f}ms jitter {:.1f}ms loss {:.1f}% out {:.1f}% in, {:.0f}B/s out {:.0f}B/s in, "
+            "snapshot every {} ticks, {} choked, {} commands lost",
+            i,
+            std::chrono::duration<float, std::milli>(stats.roundTripTime).count(),
+            std::chrono::duration<float, std::milli>(stats.roundTripTimeVariance).count(),
+            stats.sendLoss * 100.0f, stats.recieveLoss * 100.0f,
+            stats.sentBytesPerSecond, stats.recievedBytesPerSecond,
+            client.snapshotInterval, client.numChokedSnapshots, client.numLostCommands));
+        
+        client.numChokedSnapshots = 0;
+        client.numLostCommands = 0;
+    }
+}
+
+uint32_t Server::getClientViewLeaf(const ServerClient& client)
+{
+    if (!map || !client.hasPlayerEntity)
+    {
+        return Snapshot::NO_VIEW_LEAF;
+    }
+    
+    //they see the world from their own tank
+    Entity viewEntity;
+    if (!entityManager->getGlobalEntity(client.playerEntity, viewEntity))
+    {
+        return Snapshot::NO_VIEW_LEAF;
     }
+    
+    return bsp::findLeaf(*map, viewEntity.position);
+}
+
+void Server::updateEntityLeaves()
+{
+    entityLeaves.clear();
+    
+    if (!map)
+    {
+        return;
+    }
+    
+    //every entity writes its own run of leaves, so they can all be worked out at once
+    entityLeaves.resize(currentSnapshot.entities.size() * ENTITY_CULL_POINTS);
+    jobs->parallelFor(currentSnapshot.entities.size(), ENTITY_LEAVES_BATCH_SIZE, [this](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; i++)
+            {
+                const glm::vec3& position = currentSnapshot.entities[i].entity.position;
+                uint32_t* leaves = &entityLeaves[i * ENTITY_CULL_POINTS];
+                
+                leaves[0] = bsp::findLeaf(*map, position);
+                for (size_t corner = 0; corner < ENTITY_CULL_POINTS - 1; corner++)
+                {
+                    const glm::vec3 offset
+                    {
+                        (corner & 1) ? ENTITY_CULL_RADIUS : -ENTITY_CULL_RADIUS,
+                        (corner & 2) ? ENTITY_CULL_RADIUS : -ENTITY_CULL_RADIUS,
+                        (corner & 4) ? ENTITY_CULL_RADIUS : -ENTITY_CULL_RADIUS
+                    };
+                    
+                    leaves[corner + 1] = bsp::findLeaf(*map, position + offset);
+                }
+            }
+        });
+}
+
+Server::VisibleSnapshot& Server::getVisibleSnapshot(uint32_t viewLeaf)
+{
+    if (const auto it = visibleSnapshots.find(viewLeaf); it != visibleSnapshots.end())
+    {
+        return it->second;
+    }
+    
+    VisibleSnapshot& visibleSnapshot = visibleSnapshots[viewLeaf];
+    visibleSnapshot.deltas = std::make_unique<SnapshotDeltaCache>(net.getBufPool());
+    
+    Snapshot& snapshot = visibleSnapshot.snapshot;
+    snapshot.sequence = 0;
+    snapshot.tick = currentSnapshot.tick;
+    snapshot.viewLeaf = viewLeaf;
+    snapshot.valid = true;
+    
+    if (viewLeaf == Snapshot::NO_VIEW_LEAF)
+    {
+        snapshot.entities = currentSnapshot.entities;
+    }
+    else
+    {
+        bsp::decompressVisRow(*map, viewLeaf, visRow);
+        
+        for (size_t i = 0; i < currentSnapshot.entities.size(); i++)
+        {
+            const auto firstLeaf = entityLeaves.begin() + static_cast<std::ptrdiff_t>(i * ENTITY_CULL_POINTS);
+            const bool visible = std::any_of(firstLeaf, firstLeaf + ENTITY_CULL_POINTS, [this](uint32_t entityLeaf)
+            {
+                return bsp::isLeafVisible(visRow, entityLeaf);
+            });
+            
+            if (visible)
+            {
+                snapshot.entities.push_back(currentSnapshot.entities[i]);
+            }
+        }
+    }
+    
+    visibleSnapshot.deltas->reset(snapshot, &encodedSnapshot);
+    
+    return visibleSnapshot;
+}
+
+Server::VisibleSnapshot& Server::getClientSnapshot(const ServerClient& client, VisibleSnapshot& visibleSnapshot)
+{
+    if (visibleSnapshot.snapshot.entities.size() <= MAX_SNAPSHOT_ENTITIES)
+    {
+        return visibleSnapshot;
+    }
+    
+    const uint32_t clientView = FIRST_CLIENT_VIEW + static_cast<uint32_t>(&client - clients.data());
+    
+    VisibleSnapshot& clientSnapshot = visibleSnapshots[clientView];
+    clientSnapshot.deltas = std::make_unique<SnapshotDeltaCache>(net.getBufPool());
+    
+    Snapshot& snapshot = clientSnapshot.snapshot;
+    snapshot.sequence = 0;
+    snapshot.tick = visibleSnapshot.snapshot.tick;
+    snapshot.viewLeaf = clientView;
+    snapshot.valid = true;
+    snapshot.entities = visibleSnapshot.snapshot.entities;
+    
+    //the closest entities matter the most, their own tank being the closest of all
+    Entity viewEntity;
+    if (client.hasPlayerEntity && entityManager->getGlobalEntity(client.playerEntity, viewEntity))
+    {
+        std::nth_element(snapshot.entities.begin(), snapshot.entities.begin() + MAX_SNAPSHOT_ENTITIES, snapshot.entities.end(),
+            [&viewEntity](const SnapshotEntity& a, const SnapshotEntity& b) -> bool
+            {
+                const glm::vec3 toA = a.entity.position - viewEntity.position;
+                const glm::vec3 toB = b.entity.position - viewEntity.position;
+                
+                return glm::dot(toA, toA) < glm::dot(toB, toB);
+            });
+    }
+    
+    snapshot.entities.resize(MAX_SNAPSHOT_ENTITIES);
+    
+    //deltas walk through the entities in id order
+    std::sort(snapshot.entities.begin(), snapshot.entities.end(),
+        [](const SnapshotEntity& a, const SnapshotEntity& b) -> bool
+        {
+            return a.id < b.id;
+        });
+    
+    clientSnapshot.deltas->reset(snapshot, &encodedSnapshot);
+    
+    return clientSnapshot;
 }
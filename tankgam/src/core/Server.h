@@ -3,18 +3,31 @@
 #include <memory>
 #include <vector>
 #include <array>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <atomic>
 
 #include "EntityManager.h"
+#include "Snapshot.h"
+#include "PlayerCommand.h"
+#include "Net.h"
 
 class Log;
 class FileManager;
 class Timer;
-class Net;
 class NetBuf;
 class NetChan;
-struct NetAddr;
+struct NetChanStats;
+class ComponentStore;
+class JobSystem;
 enum class NetMessageType : uint8_t;
 
+namespace bsp
+{
+    struct File;
+}
+
 enum class ServerClientState
 {
     Free,
@@ -29,6 +42,42 @@ struct ServerClient
 
     std::unique_ptr<NetChan> netChan;
     
+    //what we've sent them recently, to delta compress against
+    SnapshotBuffer snapshots;
+    
+    //commands waiting to be run, oldest first
+    std::vector<PlayerCommand> pendingCommands;
+    uint32_t lastQueuedCommand;
+    
+    //the newest command that's been run, echoed back so they can reconcile their prediction
+    uint32_t lastRunCommand;
+    
+    //the tank their commands drive, and where they get culled from
+    //made when they first synchronize, and freed when they leave
+    EntityId playerEntity;
+    bool hasPlayerEntity;
+    
+    //the most bytes a second we'll send them
+    uint32_t maxRate;
+    
+    //how many bytes they can still be sent, snapshots get choked while this is negative
+    int64_t rateBudget;
+    uint64_t rateBudgetTick;
+    
+    //how much of what their NetChan sent has been taken out of the budget
+    uint64_t chargedSentBytes;
+    
+    //they get a snapshot every this many ticks, backed off when their packets start going missing
+    uint64_t snapshotInterval;
+    uint64_t nextSnapshotTick;
+    uint64_t lastIntervalAdjustTick;
+    
+    //snapshots skipped since the last stats log because they were out of budget
+    uint32_t numChokedSnapshots;
+    
+    //commands that never made it here since the last stats log, lost in more packets than a batch covers
+    uint32_t numLostCommands;
+    
     uint64_t lastRecievedTime;
     uint32_t clientSalt;
     uint32_t serverSalt;
@@ -38,15 +87,82 @@ struct ServerClient
 class Server
 {
 public:
-    Server(Log& log, FileManager& fileManager, Net& net);
+    Server(Log& log, FileManager& fileManager, Net& net, size_t maxClients = DEFAULT_MAX_CLIENTS);
     ~Server();
 
     Server(const Server&) = delete;
     Server& operator=(const Server&) = delete;
 
+    //entities only get sent to clients that could see them from somewhere in the map
+    //without a map, everybody gets sent everything
+    void loadMap(std::string_view mapFileName);
+    
     bool runFrame();
 
     void shutdown();
+    
+    //blocks until it's time for the next tick or a packet comes in
+    void sleepUntilNextTick();
+    
+    //the most ticks that will be run in one frame to catch up after a stall
+    void setMaxCatchUpTicks(uint64_t ticks);
+    
+    //only applies to clients that connect afterwards
+    void setClientRate(uint32_t bytesPerSecond);
+    
+    //the fewest ticks between snapshots, only applies to clients that connect afterwards
+    void setSnapshotInterval(uint64_t ticks);
+    
+    size_t getMaxClients() const;
+    
+    //returns false if nobody is using that slot
+    //only call from whichever thread is running the server
+    bool getClientStats(size_t clientIndex, NetChanStats& outStats) const;
+    
+    static constexpr size_t DEFAULT_MAX_CLIENTS = 64;
+    
+    static constexpr uint64_t DEFAULT_MAX_CATCH_UP_TICKS = 8;
+    
+    static constexpr uint32_t DEFAULT_CLIENT_RATE = 25000;
+    
+    static constexpr uint64_t DEFAULT_SNAPSHOT_INTERVAL = 1;
+    
+    //how far a client's snapshot interval will be backed off
+    static constexpr uint64_t MAX_SNAPSHOT_INTERVAL = 8;
+    
+    //how often each client's snapshot interval gets reconsidered
+    static constexpr uint64_t SNAPSHOT_INTERVAL_ADJUST_TICKS = 64;
+    
+    //send loss above this backs the snapshot interval off, below the other it comes back
+    static constexpr float HIGH_SEND_LOSS = 0.1f;
+    static constexpr float LOW_SEND_LOSS = 0.02f;
+    
+    //how many ticks worth of rate a client can save up for a burst
+    static constexpr uint64_t MAX_RATE_BURST_TICKS = 8;
+    
+    //entities count as being in every leaf this close to them, so they don't pop in at the edges
+    static constexpr float ENTITY_CULL_RADIUS = 2.0f;
+    
+    //the entity's origin and the corners of the box around it
+    static constexpr size_t ENTITY_CULL_POINTS = 9;
+    
+    //how many entities' leaves get worked out per job
+    static constexpr size_t ENTITY_LEAVES_BATCH_SIZE = 64;
+    
+    //how often every client's connection stats get logged, every 10 seconds at 64 ticks a second
+    static constexpr uint64_t STATS_LOG_TICKS = 640;
+    
+    //how many of a client's commands get run each tick, sending more doesn't make them turn any faster
+    static constexpr size_t MAX_COMMANDS_PER_TICK = 2;
+    
+    //once this many are waiting to run, new ones get left for the client to send again
+    static constexpr size_t MAX_PENDING_COMMANDS = PlayerCommand::MAX_BATCH_COMMANDS;
+    
+    //players' tanks get lined up this far apart, by client slot
+    static constexpr float PLAYER_SPAWN_SPACING = 4.0f;
+    
+    //the turret in the middle of the map keeps turning around
+    static constexpr float TURRET_DEGREES_PER_SECOND = 45.0f;
 
 private:
     Log& log;
@@ -54,23 +170,103 @@ private:
     FileManager& fileManager;
 
     Net& net;
+    
+    //never resized after init, so the indices below stay valid
     std::vector<ServerClient> clients;
+    
+    //indices of the clients in the free state
+    std::vector<size_t> freeClients;
+    
+    //lookups for every client that isn't free
+    std::unordered_map<NetAddr, size_t> clientsByAddr;
+    std::unordered_map<uint32_t, size_t> clientsByCombinedSalt;
 
     std::unique_ptr<Timer> timer;
     
+    //spreads entity systems and snapshot encoding across every core
+    std::unique_ptr<JobSystem> jobs;
+    
     std::unique_ptr<EntityManager> entityManager;
+    
+    //everything about entities that's only for game logic
+    std::unique_ptr<ComponentStore> components;
+    
+    //model names indexed by their model index, clients get sent this on connect
+    std::vector<std::string> modelNames;
+    std::unordered_map<std::string, uint16_t> modelIndices;
 
-    bool running;
+    std::atomic<bool> running;
     
     uint64_t lastTick;
     uint64_t currentTick;
     
-    float rotationAmount = 0.0f;
+    uint64_t maxCatchUpTicks;
+    
+    uint32_t clientRate;
+    uint64_t snapshotInterval;
+    
+    std::unique_ptr<bsp::File> map;
+    
+    //the state of every entity this tick
+    Snapshot currentSnapshot;
+    
+    //every entity in currentSnapshot serialized once, so clients' deltas are mostly copies
+    EncodedSnapshot encodedSnapshot;
+    
+    //the map leaves each entity in currentSnapshot touches, ENTITY_CULL_POINTS for each
+    std::vector<uint32_t> entityLeaves;
+    
+    //currentSnapshot culled down to what can be seen from a leaf, and its deltas against clients' baselines
+    struct VisibleSnapshot
+    {
+        Snapshot snapshot;
+        std::unique_ptr<SnapshotDeltaCache> deltas;
+    };
+    
+    //every client viewing from the same leaf shares one of these, rebuilt every tick
+    //clients that can see too much to fit get their own, under FIRST_CLIENT_VIEW + their slot
+    std::unordered_map<uint32_t, VisibleSnapshot> visibleSnapshots;
+    
+    //well past any leaf a map could have
+    static constexpr uint32_t FIRST_CLIENT_VIEW = 1u << 31;
+    
+    //reused for decompressing whichever leaf's visibility we're looking at
+    std::vector<uint8_t> visRow;
+    
+    //a client getting a snapshot this tick, encoded on whichever thread gets to it
+    struct SnapshotJob
+    {
+        ServerClient* client;
+        VisibleSnapshot* visibleSnapshot;
+        
+        NetBuf sendBuf;
+        uint32_t baselineSequence;
+        bool written;
+    };
+    
+    //reused every tick, in client order so they always get sent out in the same order
+    std::vector<SnapshotJob> snapshotJobs;
+    
+    //reused every frame to pull packets off the socket in batches
+    std::vector<NetBuf> recvBufs;
+    std::vector<NetAddr> recvAddrs;
     
     EntityId allocateGlobalEntity(Entity globalEntity);
     
     void freeGlobalEntity(EntityId netEntityId);
     
+    //registers the model if it hasn't been already
+    uint16_t getModelIndex(std::string_view modelName);
+    
+    //returns null if we're out of room
+    ServerClient* allocateClient(const NetAddr& addr);
+    
+    //returns null if no client is using this address
+    ServerClient* getClientByAddr(const NetAddr& addr);
+    
+    //returns null if no client is using this salt
+    ServerClient* getClientByCombinedSalt(uint32_t combinedSalt);
+    
     void disconnectClient(ServerClient& client, bool forceDisconnect);
     
 //main loop stuff
@@ -84,7 +280,33 @@ private:
 
     void handleEvents();
 
-    void tryRunTicks();
+    //returns the number of ticks that were run
+    uint64_t tryRunTicks();
+    
+    void runTick();
+    
+    //systems, run every tick
+    void updateSpinning();
     
     void sendPackets();
+    
+    //take whatever the client's NetChan has sent out of their budget and top it back up for the ticks since
+    void updateRateBudget(ServerClient& client);
+    
+    //back off the snapshot interval if packets are getting lost, bring it back once they aren't
+    void adjustSnapshotInterval(ServerClient& client);
+    
+    void logClientStats();
+    
+    //the leaf the client's tank is in, or Snapshot::NO_VIEW_LEAF if there's no map or they haven't got a tank yet
+    uint32_t getClientViewLeaf(const ServerClient& client);
+    
+    //work out which leaves every entity in currentSnapshot is touching, spread across the job system
+    void updateEntityLeaves();
+    
+    //builds it if nobody has looked from this leaf yet this tick
+    VisibleSnapshot& getVisibleSnapshot(uint32_t viewLeaf);
+    
+    //the visible snapshot if it fits in a packet, otherwise only the entities closest to the client's tank
+    VisibleSnapshot& getClientSnapshot(const ServerClient& client, VisibleSnapshot& visibleSnapshot);
 };
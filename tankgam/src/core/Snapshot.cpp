@@ -0,0 +1,553 @@
+#include "Snapshot.h"
+
+#include <algorithm>
+#include <atomic>
+
+#include "NetBuf.h"
+#include "JobSystem.h"
+
+void Snapshot::build(Snapshot& outSnapshot, uint64_t tick, EntityManager& entityManager)
+{
+    outSnapshot.tick = tick;
+    outSnapshot.viewLeaf = NO_VIEW_LEAF;
+    outSnapshot.entities.clear();
+    
+    const EntityView globalEntities = entityManager.getGlobalEntities();
+    for (size_t i = 0; i < globalEntities.size(); i++)
+    {
+        const Entity entity{ globalEntities.positions[i], globalEntities.rotations[i], globalEntities.modelIndices[i] };
+        
+        outSnapshot.entities.push_back(SnapshotEntity{ globalEntities.ids[i], entity });
+    }
+    
+    //deltas walk through the entities in id order
+    std::sort(outSnapshot.entities.begin(), outSnapshot.entities.end(),
+        [](const SnapshotEntity& a, const SnapshotEntity& b) -> bool
+        {
+            return a.id < b.id;
+        });
+    
+    outSnapshot.valid = true;
+}
+
+//one entity's worth of a delta
+struct SnapshotDeltaEntry
+{
+    EntityId id;
+    
+    //null if the entity was removed
+    const SnapshotEntity* snapshotEntity;
+    
+    uint8_t fields;
+};
+
+//work out what has to be sent to get from the baseline to the snapshot
+static void getDeltaEntries(const Snapshot* baseline, const Snapshot& snapshot, std::vector<SnapshotDeltaEntry>& outEntries)
+{
+    static const std::vector<SnapshotEntity> noEntities;
+    const std::vector<SnapshotEntity>& oldEntities = baseline ? baseline->entities : noEntities;
+    const std::vector<SnapshotEntity>& newEntities = snapshot.entities;
+    
+    //both lists are sorted, so walk through them together
+    auto oldIt = oldEntities.begin();
+    auto newIt = newEntities.begin();
+    while (oldIt != oldEntities.end() || newIt != newEntities.end())
+    {
+        if (newIt == newEntities.end() ||
+            (oldIt != oldEntities.end() && oldIt->id < newIt->id))
+        {
+            //the entity doesn't exist anymore
+            outEntries.push_back(SnapshotDeltaEntry{ oldIt->id, nullptr, static_cast<uint8_t>(EntityField::Removed) });
+            ++oldIt;
+        }
+        else if (oldIt == oldEntities.end() || newIt->id < oldIt->id)
+        {
+            //the entity is new, send everything
+            outEntries.push_back(SnapshotDeltaEntry{ newIt->id, &*newIt, static_cast<uint8_t>(EntityField::All) });
+            ++newIt;
+        }
+        else
+        {
+            //only send what changed
+            if (const uint8_t fields = Entity::getChangedFields(oldIt->entity, newIt->entity, EntityEncoding::Quantized);
+                fields != static_cast<uint8_t>(EntityField::None))
+            {
+                outEntries.push_back(SnapshotDeltaEntry{ newIt->id, &*newIt, fields });
+            }
+            
+            ++oldIt;
+            ++newIt;
+        }
+    }
+}
+
+static bool writeDeltaHeader(const Snapshot& snapshot, size_t numEntries, NetBuf& outBuf)
+{
+    if (!outBuf.writeUint64(snapshot.tick))
+    {
+        return false;
+    }
+    
+    return outBuf.writeUint16(static_cast<uint16_t>(numEntries));
+}
+
+bool Snapshot::writeDelta(const Snapshot* baseline, const Snapshot& snapshot, NetBuf& outBuf)
+{
+    static const Entity nullEntity{};
+    
+    std::vector<SnapshotDeltaEntry> entries;
+    getDeltaEntries(baseline, snapshot, entries);
+    
+    if (!writeDeltaHeader(snapshot, entries.size(), outBuf))
+    {
+        return false;
+    }
+    
+    for (const SnapshotDeltaEntry& entry : entries)
+    {
+        if (!EntityId::serialize(entry.id, outBuf))
+        {
+            return false;
+        }
+        
+        const Entity& entity = entry.snapshotEntity ? entry.snapshotEntity->entity : nullEntity;
+        if (!Entity::serializeDelta(entity, entry.fields, outBuf, EntityEncoding::Quantized))
+        {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+bool Snapshot::readDelta(const Snapshot* baseline, Snapshot& outSnapshot, NetBuf& inBuf)
+{
+    if (baseline)
+    {
+        outSnapshot.entities = baseline->entities;
+    }
+    else
+    {
+        outSnapshot.entities.clear();
+    }
+    
+    outSnapshot.valid = false;
+    
+    if (!inBuf.readUint64(outSnapshot.tick))
+    {
+        return false;
+    }
+    
+    uint16_t numEntries;
+    if (!inBuf.readUint16(numEntries))
+    {
+        return false;
+    }
+    
+    for (uint16_t i = 0; i < numEntries; i++)
+    {
+        EntityId id;
+        if (!EntityId::deserialize(id, inBuf))
+        {
+            return false;
+        }
+        
+        auto it = std::lower_bound(outSnapshot.entities.begin(), outSnapshot.entities.end(), id,
+            [](const SnapshotEntity& snapshotEntity, EntityId id) -> bool
+            {
+                return snapshotEntity.id < id;
+            });
+        
+        const bool exists = it != outSnapshot.entities.end() && it->id == id;
+        
+        Entity entity = exists ? it->entity : Entity{};
+        uint8_t fields;
+        if (!Entity::deserializeDelta(entity, fields, inBuf, EntityEncoding::Quantized))
+        {
+            return false;
+        }
+        
+        if (fields & static_cast<uint8_t>(EntityField::Removed))
+        {
+            if (exists)
+            {
+                outSnapshot.entities.erase(it);
+            }
+        }
+        else if (exists)
+        {
+            it->entity = std::move(entity);
+        }
+        else
+        {
+            outSnapshot.entities.insert(it, SnapshotEntity{ id, std::move(entity) });
+        }
+    }
+    
+    outSnapshot.valid = true;
+    
+    return true;
+}
+
+void Snapshot::apply(const Snapshot& snapshot, EntityManager& entityManager, std::vector<EntityId>* outRemovedEntities)
+{
+    //the snapshot is sorted by id, so check everything we have against it
+    std::vector<EntityId> removedEntities;
+    for (const EntityId id : entityManager.getGlobalEntities().ids)
+    {
+        const auto it = std::lower_bound(snapshot.entities.begin(), snapshot.entities.end(), id,
+            [](const SnapshotEntity& snapshotEntity, EntityId findId) -> bool
+            {
+                return snapshotEntity.id < findId;
+            });
+        
+        if (it == snapshot.entities.end() || it->id != id)
+        {
+            removedEntities.push_back(id);
+        }
+    }
+    
+    //freeing moves entities around in the view, so it has to wait until we're done with it
+    for (const EntityId id : removedEntities)
+    {
+        entityManager.freeGlobalEntity(id);
+    }
+    
+    if (outRemovedEntities)
+    {
+        outRemovedEntities->insert(outRemovedEntities->end(), removedEntities.begin(), removedEntities.end());
+    }
+    
+    for (const SnapshotEntity& snapshotEntity : snapshot.entities)
+    {
+        //skipped if something newer has already taken its slot
+        if (entityManager.claimGlobalEntity(snapshotEntity.id))
+        {
+            entityManager.setGlobalEntity(snapshotEntity.id, snapshotEntity.entity);
+        }
+    }
+}
+
+EncodedSnapshot::EncodedSnapshot()
+    : snapshot{ nullptr }, valid{ false }
+{
+}
+
+EncodedSnapshot::~EncodedSnapshot() = default;
+
+void EncodedSnapshot::build(const Snapshot& newSnapshot, NetBufPool& pool, JobSystem* jobs)
+{
+    snapshot = &newSnapshot;
+    entities.resize(newSnapshot.entities.size());
+    
+    std::atomic<bool> allFit{ true };
+    const auto encodeEntities = [this, &pool, &allFit](size_t begin, size_t end)
+    {
+        NetBuf record{ pool };
+        for (size_t i = begin; i < end; i++)
+        {
+            const SnapshotEntity& snapshotEntity = snapshot->entities[i];
+            EncodedEntity& encodedEntity = entities[i];
+            
+            for (size_t fields = 1; fields <= NUM_FIELD_MASKS; fields++)
+            {
+                record.beginWrite();
+                
+                if (!EntityId::serialize(snapshotEntity.id, record) ||
+                    !Entity::serializeDelta(snapshotEntity.entity, static_cast<uint8_t>(fields), record, EntityEncoding::Quantized) ||
+                    record.getData().size() > MAX_RECORD_BYTES)
+                {
+                    allFit = false;
+                    continue;
+                }
+                
+                std::copy(record.getData().begin(), record.getData().end(), encodedEntity.records[fields - 1].begin());
+                encodedEntity.recordSizes[fields - 1] = static_cast<uint8_t>(record.getData().size());
+            }
+        }
+    };
+    
+    if (jobs)
+    {
+        jobs->parallelFor(entities.size(), BUILD_BATCH_SIZE, encodeEntities);
+    }
+    else
+    {
+        encodeEntities(0, entities.size());
+    }
+    
+    valid = allFit;
+}
+
+bool EncodedSnapshot::writeDelta(const Snapshot* baseline, const Snapshot& deltaSnapshot, NetBuf& outBuf) const
+{
+    //something was too big to cache, so do it the slow way
+    if (!valid)
+    {
+        return Snapshot::writeDelta(baseline, deltaSnapshot, outBuf);
+    }
+    
+    std::vector<SnapshotDeltaEntry> entries;
+    getDeltaEntries(baseline, deltaSnapshot, entries);
+    
+    if (!writeDeltaHeader(deltaSnapshot, entries.size(), outBuf))
+    {
+        return false;
+    }
+    
+    //both are sorted, so the encoded entities can be found by walking forward
+    const std::vector<SnapshotEntity>& encodedEntities = snapshot->entities;
+    size_t encodedIndex = 0;
+    
+    for (const SnapshotDeltaEntry& entry : entries)
+    {
+        if (!entry.snapshotEntity)
+        {
+            if (!EntityId::serialize(entry.id, outBuf) || !outBuf.writeUint8(entry.fields))
+            {
+                return false;
+            }
+            
+            continue;
+        }
+        
+        while (encodedIndex < encodedEntities.size() && encodedEntities[encodedIndex].id < entry.id)
+        {
+            encodedIndex++;
+        }
+        
+        if (encodedIndex == encodedEntities.size() || encodedEntities[encodedIndex].id != entry.id)
+        {
+            return false;
+        }
+        
+        const EncodedEntity& encodedEntity = entities[encodedIndex];
+        if (!outBuf.writeBytes(encodedEntity.records[entry.fields - 1].data(), encodedEntity.recordSizes[entry.fields - 1]))
+        {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+SnapshotDeltaCache::SnapshotDeltaCache(NetBufPool& pool)
+    : pool{ pool }, snapshot{ nullptr }, encoded{ nullptr }
+{
+}
+
+SnapshotDeltaCache::~SnapshotDeltaCache() = default;
+
+void SnapshotDeltaCache::reset(const Snapshot& newSnapshot, const EncodedSnapshot* newEncoded)
+{
+    snapshot = &newSnapshot;
+    encoded = newEncoded;
+    deltas.clear();
+}
+
+const Snapshot& SnapshotDeltaCache::getSnapshot() const
+{
+    return *snapshot;
+}
+
+const NetBuf* SnapshotDeltaCache::getDelta(const Snapshot* baseline)
+{
+    const uint64_t baselineTick = baseline ? baseline->tick : 0;
+    const uint32_t baselineViewLeaf = baseline ? baseline->viewLeaf : Snapshot::NO_VIEW_LEAF;
+    
+    CachedDelta* cachedDelta = nullptr;
+    {
+        std::lock_guard<std::mutex> lock{ deltasMutex };
+        
+        for (CachedDelta& delta : deltas)
+        {
+            if (delta.baselineTick == baselineTick && delta.baselineViewLeaf == baselineViewLeaf)
+            {
+                cachedDelta = &delta;
+                break;
+            }
+        }
+        
+        if (!cachedDelta)
+        {
+            cachedDelta = &deltas.emplace_back();
+            cachedDelta->baselineTick = baselineTick;
+            cachedDelta->baselineViewLeaf = baselineViewLeaf;
+            cachedDelta->written = false;
+        }
+    }
+    
+    //written outside the lock so that different baselines can be written at the same time
+    std::call_once(cachedDelta->writeFlag, [this, baseline, cachedDelta]()
+        {
+            cachedDelta->data = NetBuf{ pool };
+            cachedDelta->written = encoded ?
+                encoded->writeDelta(baseline, *snapshot, cachedDelta->data) :
+                Snapshot::writeDelta(baseline, *snapshot, cachedDelta->data);
+        });
+    
+    return cachedDelta->written ? &cachedDelta->data : nullptr;
+}
+
+SnapshotBuffer::SnapshotBuffer()
+    : snapshots{}, lastFullSequence{ 0 }
+{
+}
+
+SnapshotBuffer::~SnapshotBuffer() = default;
+
+SnapshotBuffer::SnapshotBuffer(SnapshotBuffer&& o) noexcept
+    : snapshots{}, lastFullSequence{ 0 }
+{
+    std::swap(snapshots, o.snapshots);
+    std::swap(lastFullSequence, o.lastFullSequence);
+}
+
+SnapshotBuffer& SnapshotBuffer::operator=(SnapshotBuffer&& o) noexcept
+{
+    if (&o == this)
+    {
+        return *this;
+    }
+    
+    std::swap(snapshots, o.snapshots);
+    std::swap(lastFullSequence, o.lastFullSequence);
+    
+    return *this;
+}
+
+Snapshot* SnapshotBuffer::getSnapshot(uint32_t sequence)
+{
+    //zero is never a valid sequence
+    if (sequence == 0)
+    {
+        return nullptr;
+    }
+    
+    Snapshot& snapshot = snapshots[static_cast<size_t>(sequence) % SNAPSHOT_BUFFER_SIZE];
+    if (!snapshot.valid || snapshot.sequence != sequence)
+    {
+        return nullptr;
+    }
+    
+    return &snapshot;
+}
+
+Snapshot& SnapshotBuffer::insertSnapshot(uint32_t sequence)
+{
+    Snapshot& snapshot = snapshots[static_cast<size_t>(sequence) % SNAPSHOT_BUFFER_SIZE];
+    snapshot.sequence = sequence;
+    snapshot.tick = 0;
+    snapshot.viewLeaf = Snapshot::NO_VIEW_LEAF;
+    snapshot.valid = false;
+    snapshot.entities.clear();
+    
+    return snapshot;
+}
+
+bool SnapshotBuffer::writeSnapshot(uint32_t sequence, SnapshotDeltaCache& deltas, uint32_t ackedSequence, uint32_t ackedSequenceBits,
+    NetBuf& outBuf, uint32_t& outBaselineSequence)
+{
+    //the newest acked packet might not have had a snapshot in it, so look back through the ack bits for one that did
+    const Snapshot* baseline = nullptr;
+    for (uint32_t back = 0; back <= 32 && !baseline; back++)
+    {
+        if (back > 0 && !(ackedSequenceBits & (1u << (back - 1))))
+        {
+            continue;
+        }
+        
+        //the other end might have overwritten this baseline already
+        const Snapshot* snapshot = getSnapshot(ackedSequence - back);
+        if (snapshot && sequence - snapshot->sequence < SNAPSHOT_BUFFER_SIZE)
+        {
+            baseline = snapshot;
+        }
+    }
+    
+    outBaselineSequence = baseline ? baseline->sequence : 0;
+    if (!outBuf.writeUint32(outBaselineSequence))
+    {
+        return false;
+    }
+    
+    const NetBuf* delta = deltas.getDelta(baseline);
+    if (!delta || !outBuf.writeBytes(delta->getData()))
+    {
+        return false;
+    }
+    
+    return true;
+}
+
+void SnapshotBuffer::storeSnapshot(uint32_t sequence, const Snapshot& snapshot, uint32_t baselineSequence)
+{
+    if (baselineSequence == 0)
+    {
+        lastFullSequence = sequence;
+    }
+    
+    Snapshot& newSnapshot = insertSnapshot(sequence);
+    newSnapshot.tick = snapshot.tick;
+    newSnapshot.viewLeaf = snapshot.viewLeaf;
+    newSnapshot.entities = snapshot.entities;
+    newSnapshot.valid = true;
+}
+
+Snapshot* SnapshotBuffer::readSnapshot(uint32_t sequence, NetBuf& inBuf)
+{
+    uint32_t baselineSequence;
+    if (!inBuf.readUint32(baselineSequence))
+    {
+        return nullptr;
+    }
+    
+    const Snapshot* baseline = nullptr;
+    if (baselineSequence != 0)
+    {
+        baseline = getSnapshot(baselineSequence);
+        if (!baseline || sequence - baselineSequence >= SNAPSHOT_BUFFER_SIZE)
+        {
+            //we can't rebuild this without the baseline
+            return nullptr;
+        }
+    }
+    
+    Snapshot newSnapshot{ sequence, 0, Snapshot::NO_VIEW_LEAF, false, {} };
+    if (!Snapshot::readDelta(baseline, newSnapshot, inBuf))
+    {
+        return nullptr;
+    }
+    
+    Snapshot& snapshot = insertSnapshot(sequence);
+    snapshot = std::move(newSnapshot);
+    
+    return &snapshot;
+}
+
+void SnapshotBuffer::dropBaselines(uint32_t failedSequence)
+{
+    //the full snapshot will sort them out once it gets there
+    if (failedSequence <= lastFullSequence)
+    {
+        return;
+    }
+    
+    for (Snapshot& snapshot : snapshots)
+    {
+        snapshot.valid = false;
+    }
+}
+
+void SnapshotBuffer::clear()
+{
+    lastFullSequence = 0;
+    
+    for (Snapshot& snapshot : snapshots)
+    {
+        snapshot.sequence = 0;
+        snapshot.tick = 0;
+        snapshot.valid = false;
+        snapshot.entities.clear();
+    }
+}
@@ -0,0 +1,213 @@
+/*
+ * Inspired by quake3's delta compressed snapshots
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <array>
+#include <deque>
+#include <vector>
+#include <limits>
+#include <mutex>
+
+#include "Entity.h"
+#include "EntityManager.h"
+
+#include "NetBuf.h"
+
+class NetBufPool;
+class JobSystem;
+
+struct SnapshotEntity
+{
+    EntityId id;
+    Entity entity;
+};
+
+//the state of the global entities as it was sent in a single packet
+struct Snapshot
+{
+    uint32_t sequence;
+    
+    //the server tick this snapshot was taken on
+    uint64_t tick;
+    
+    //the map leaf the entities were culled for, only known on the server
+    //the server also uses it to tell apart snapshots that were cut down for a single client
+    uint32_t viewLeaf;
+    
+    bool valid;
+    
+    //sorted by entity id
+    std::vector<SnapshotEntity> entities;
+    
+    //fill out the snapshot with the current state of every global entity
+    static void build(Snapshot& outSnapshot, uint64_t tick, EntityManager& entityManager);
+    
+    //for snapshots that weren't culled down to what can be seen from a leaf
+    static constexpr uint32_t NO_VIEW_LEAF = std::numeric_limits<uint32_t>::max();
+    
+    //bytes in front of the entities in a delta, the tick & how many entities there are
+    static constexpr size_t DELTA_HEADER_BYTES = 8 + 2;
+    
+    //an entity id & its field mask, then every field quantized
+    static constexpr size_t MAX_DELTA_ENTITY_BYTES = 3 + 1 + 8 + 4 + 2;
+    
+    //an entity id & its field mask with only the removed bit
+    static constexpr size_t REMOVED_DELTA_ENTITY_BYTES = 3 + 1;
+    
+    //write only the entities & fields that changed since the baseline
+    //if baseline is null, everything is written
+    static bool writeDelta(const Snapshot* baseline, const Snapshot& snapshot, NetBuf& outBuf);
+    
+    //rebuild a snapshot from the baseline & the delta against it
+    static bool readDelta(const Snapshot* baseline, Snapshot& outSnapshot, NetBuf& inBuf);
+    
+    //update the entity manager to match this snapshot
+    //global entities that aren't in it are gone or out of sight, so they get freed and added to outRemovedEntities
+    static void apply(const Snapshot& snapshot, EntityManager& entityManager, std::vector<EntityId>* outRemovedEntities = nullptr);
+};
+
+//every entity in a tick's snapshot written out ahead of time, once for every combination of fields
+//deltas get put together by copying these instead of writing every entity again for every client
+//only reads once it's built, so any number of threads can write deltas from it at once
+class EncodedSnapshot
+{
+public:
+    EncodedSnapshot();
+    ~EncodedSnapshot();
+    
+    EncodedSnapshot(const EncodedSnapshot&) = delete;
+    EncodedSnapshot& operator=(const EncodedSnapshot&) = delete;
+    
+    //the snapshot has to stay alive and unchanged until the next build
+    //the entities get spread across the job system if there is one
+    void build(const Snapshot& newSnapshot, NetBufPool& pool, JobSystem* jobs = nullptr);
+    
+    //writes exactly what Snapshot::writeDelta would
+    //snapshot can be the built snapshot or any subset of it, like one culled for a leaf
+    bool writeDelta(const Snapshot* baseline, const Snapshot& snapshot, NetBuf& outBuf) const;
+    
+    //an entity id, the field mask and every field, quantized
+    static constexpr size_t MAX_RECORD_BYTES = 32;
+    
+    //every field mask apart from none
+    static constexpr size_t NUM_FIELD_MASKS = static_cast<size_t>(EntityField::All);
+    
+    //how many entities get encoded per job
+    static constexpr size_t BUILD_BATCH_SIZE = 64;
+
+private:
+    struct EncodedEntity
+    {
+        //indexed by field mask - 1
+        std::array<std::array<std::byte, MAX_RECORD_BYTES>, NUM_FIELD_MASKS> records;
+        std::array<uint8_t, NUM_FIELD_MASKS> recordSizes;
+    };
+    
+    const Snapshot* snapshot;
+    
+    //lines up with snapshot's entities
+    std::vector<EncodedEntity> entities;
+    
+    //false if something didn't fit in MAX_RECORD_BYTES, then deltas get written the slow way
+    bool valid;
+};
+
+//delta compressed copies of one snapshot against the different baselines clients have acked
+//every client that acked the same tick gets the exact same bytes, so each delta only gets written once
+//getDelta can be called from several threads at once, reset can't
+class SnapshotDeltaCache
+{
+public:
+    explicit SnapshotDeltaCache(NetBufPool& pool);
+    ~SnapshotDeltaCache();
+    
+    SnapshotDeltaCache(const SnapshotDeltaCache&) = delete;
+    SnapshotDeltaCache& operator=(const SnapshotDeltaCache&) = delete;
+    
+    //throw away the old deltas and start writing them against this snapshot
+    //the snapshot (and encoded, if given) has to stay alive until the next reset
+    //with an encoded snapshot containing its entities, deltas get copied together out of that
+    void reset(const Snapshot& newSnapshot, const EncodedSnapshot* newEncoded = nullptr);
+    
+    const Snapshot& getSnapshot() const;
+    
+    //if baseline is null, it's the full snapshot
+    //returns null if the delta couldn't be written
+    const NetBuf* getDelta(const Snapshot* baseline);
+
+private:
+    NetBufPool& pool;
+    
+    const Snapshot* snapshot;
+    const EncodedSnapshot* encoded;
+    
+    struct CachedDelta
+    {
+        //ticks start from 1, so 0 means there wasn't a baseline
+        uint64_t baselineTick;
+        uint32_t baselineViewLeaf;
+        
+        //whoever asks first writes it, anyone else asking for it meanwhile waits
+        std::once_flag writeFlag;
+        bool written;
+        
+        NetBuf data;
+    };
+    
+    //only a handful of distinct baselines at a time, so just search through them
+    //snapshots from the same tick have the same entities as long as they were culled for the same leaf
+    //a deque so that deltas don't move while they're being written
+    std::mutex deltasMutex;
+    std::deque<CachedDelta> deltas;
+};
+
+//keeps track of the last few snapshots sent/recieved, indexed by packet sequence
+class SnapshotBuffer
+{
+public:
+    SnapshotBuffer();
+    ~SnapshotBuffer();
+    
+    SnapshotBuffer(const SnapshotBuffer&) = delete;
+    SnapshotBuffer& operator=(const SnapshotBuffer&) = delete;
+    
+    SnapshotBuffer(SnapshotBuffer&& o) noexcept;
+    SnapshotBuffer& operator=(SnapshotBuffer&& o) noexcept;
+    
+    //returns null if we don't have a valid snapshot with this sequence
+    Snapshot* getSnapshot(uint32_t sequence);
+    
+    //returns the snapshot of this sequence, overwriting whatever was in its slot
+    Snapshot& insertSnapshot(uint32_t sequence);
+    
+    //delta compress the cache's snapshot against the newest acked snapshot we still have
+    //sequence is the packet it's going out in, outBaselineSequence is 0 if it had to be written in full
+    //ackedSequence and ackedSequenceBits are what NetChan knows got through, packets without snapshots in them get skipped
+    bool writeSnapshot(uint32_t sequence, SnapshotDeltaCache& deltas, uint32_t ackedSequence, uint32_t ackedSequenceBits,
+        NetBuf& outBuf, uint32_t& outBaselineSequence);
+    
+    //keep a written snapshot as a baseline, only once the packet it was written for has actually gone out
+    void storeSnapshot(uint32_t sequence, const Snapshot& snapshot, uint32_t baselineSequence);
+    
+    //read a delta compressed snapshot and store it under this sequence
+    //returns null if the snapshot couldn't be read
+    Snapshot* readSnapshot(uint32_t sequence, NetBuf& inBuf);
+    
+    //the other end couldn't read the snapshot sent in this packet, even though it's going to ack it
+    //forget every baseline so the next one goes out in full, unless a full one has already gone out since
+    void dropBaselines(uint32_t failedSequence);
+    
+    void clear();
+    
+    //should be less than NetChan's packet buffer so that acks stay meaningful
+    static constexpr size_t SNAPSHOT_BUFFER_SIZE = 32;
+
+private:
+    std::array<Snapshot, SNAPSHOT_BUFFER_SIZE> snapshots;
+    
+    //the sequence of the last packet that went out without a baseline
+    uint32_t lastFullSequence;
+};
@@ -2,7 +2,7 @@
 
 #include <sys/socket.h>
 #include <sys/stat.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
 #include <sys/mman.h>
 #include <sys/un.h>
 #include <sys/file.h>
@@ -12,6 +12,7 @@
 #include <stdexcept>
 #include <algorithm>
 #include <string>
+#include <limits>
 
 #include <fmt/format.h>
 
@@ -23,7 +24,12 @@ NetLoopback::NetLoopback(Log& log, bool initClient, bool initServer)
     : log{ log },
       initClient{ initClient }, initServer{ initServer },
       clientPort{ 0 },
-      serverSocket{ -1 }, clientSocket{ -1 }
+      serverSocket{ -1 }, clientSocket{ -1 },
+      serverEpollFd{ -1 }, clientEpollFd{ -1 },
+      serverRecvBatch{ std::make_unique<PacketBatch>() },
+      clientRecvBatch{ std::make_unique<PacketBatch>() },
+      serverSendBatch{ std::make_unique<PacketBatch>() },
+      clientSendBatch{ std::make_unique<PacketBatch>() }
 {
     //figure out where to put our sockets
     {
@@ -43,6 +49,19 @@ NetLoopback::NetLoopback(Log& log, bool initClient, bool initServer)
             log.logf(LogLevel::Info, "Net: Creating directory %s", runDir.c_str());
             mkdir(runDir.c_str(), 0700);
         }
+        
+        clientNamePrefix = runDir + "/client-socket";
+        
+        serverSockAddr = getServerSockAddr();
+        for (size_t port = 0; port < clientSockAddrs.size(); port++)
+        {
+            clientSockAddrs[port] = getClientSockAddr(static_cast<uint16_t>(port));
+        }
+        
+        serverRecvBatch->numPackets = 0;
+        clientRecvBatch->numPackets = 0;
+        serverSendBatch->numPackets = 0;
+        clientSendBatch->numPackets = 0;
     }
     
     //initialize server socket
@@ -54,13 +73,13 @@ NetLoopback::NetLoopback(Log& log, bool initClient, bool initServer)
             throw std::runtime_error{ "Could not open server socket" };
         }
         
-        const struct sockaddr_un serverAddr = getServerSockAddr();
-        
         unlink(getServerName().c_str());
-        if (bind(serverSocket, reinterpret_cast<const struct sockaddr*>(&serverAddr), sizeof(serverAddr)) == -1)
+        if (bind(serverSocket, reinterpret_cast<const struct sockaddr*>(&serverSockAddr), sizeof(serverSockAddr)) == -1)
         {
             throw std::runtime_error{ "bind failure serverSocket: make sure there's only one server instance running" };
         }
+        
+        serverEpollFd = createEpoll(serverSocket);
     }
     
     //initialize client socket
@@ -75,13 +94,13 @@ NetLoopback::NetLoopback(Log& log, bool initClient, bool initServer)
         //use shared memory to allocate a port
         clientPort = allocClientPort();
         
-        const struct sockaddr_un clientAddr = getClientSockAddr(clientPort);
-        
         unlink(getClientName(clientPort).c_str());
-        if (bind(clientSocket, reinterpret_cast<const struct sockaddr*>(&clientAddr), sizeof(clientAddr)) == -1)
+        if (bind(clientSocket, reinterpret_cast<const struct sockaddr*>(&clientSockAddrs[clientPort]), sizeof(struct sockaddr_un)) == -1)
         {
             throw std::runtime_error{ "bind failure clientSocket" };
         }
+        
+        clientEpollFd = createEpoll(clientSocket);
     }
 }
 
@@ -89,6 +108,10 @@ NetLoopback::~NetLoopback()
 {
     if (initClient)
     {
+        //don't lose anything that was still waiting to go out
+        flushPackets(NetSrc::Client);
+        
+        close(clientEpollFd);
         close(clientSocket);
         
         unlink(getClientName(clientPort).c_str());
@@ -98,6 +121,9 @@ NetLoopback::~NetLoopback()
     
     if (initServer)
     {
+        flushPackets(NetSrc::Server);
+        
+        close(serverEpollFd);
         close(serverSocket);
         
         unlink(getServerName().c_str());
@@ -106,12 +132,71 @@ NetLoopback::~NetLoopback()
 
 bool NetLoopback::getPacket(const NetSrc& src, NetBuf& buf, NetAddr& fromAddr)
 {
-    if (src == NetSrc::Server)
+    return getPackets(src, std::span<NetBuf>{ &buf, 1 }, std::span<NetAddr>{ &fromAddr, 1 }) > 0;
+}
+
+size_t NetLoopback::getPackets(const NetSrc& src, std::span<NetBuf> bufs, std::span<NetAddr> fromAddrs)
+{
+    const int socket = src == NetSrc::Server ? serverSocket : clientSocket;
+    
+    const size_t maxPackets = std::min({ bufs.size(), fromAddrs.size(), MAX_PACKET_BATCH });
+    if (maxPackets == 0)
+    {
+        return 0;
+    }
+    
+    PacketBatch& batch = src == NetSrc::Server ? *serverRecvBatch : *clientRecvBatch;
+    for (size_t i = 0; i < maxPackets; i++)
     {
-        return getPacketServer(buf, fromAddr);
+        //recieve straight into the caller's buffers
+        const std::span<std::byte> space = bufs[i].beginDirectWrite();
+        batch.iovecs[i].iov_base = space.data();
+        batch.iovecs[i].iov_len = space.size();
+        
+        batch.headers[i] = {};
+        batch.headers[i].msg_hdr.msg_name = &batch.addrs[i];
+        batch.headers[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_un);
+        batch.headers[i].msg_hdr.msg_iov = &batch.iovecs[i];
+        batch.headers[i].msg_hdr.msg_iovlen = 1;
+    }
+    
+    //take whatever is waiting, without waiting for the rest of the batch to fill up
+    const int numRecieved = recvmmsg(socket, batch.headers.data(), static_cast<unsigned int>(maxPackets), MSG_DONTWAIT, nullptr);
+    if (numRecieved == -1)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            throw std::runtime_error{ fmt::format("recvmmsg failure: {}", strerror(errno)) };
+        }
+        
+        return 0;
     }
     
-    return getPacketClient(buf, fromAddr);
+    size_t numPackets = 0;
+    for (int i = 0; i < numRecieved; i++)
+    {
+        bufs[i].endDirectWrite(batch.headers[i].msg_len);
+        
+        NetAddr& fromAddr = fromAddrs[numPackets];
+        fromAddr.type = NetAddrType::Loopback;
+        fromAddr.port = 0;
+        
+        if (src == NetSrc::Server &&
+            !getPortFromClientName(batch.addrs[i].sun_path, fromAddr.port))
+        {
+            continue;
+        }
+        
+        //close the gap left by anything we skipped
+        if (numPackets != static_cast<size_t>(i))
+        {
+            std::swap(bufs[numPackets], bufs[i]);
+        }
+        
+        numPackets++;
+    }
+    
+    return numPackets;
 }
 
 bool NetLoopback::sendPacket(const NetSrc& src, NetBuf buf, const NetAddr& toAddr)
@@ -124,6 +209,69 @@ bool NetLoopback::sendPacket(const NetSrc& src, NetBuf buf, const NetAddr& toAdd
     return sendPacketAsClient(std::move(buf), toAddr);
 }
 
+void NetLoopback::flushPackets(const NetSrc& src)
+{
+    if (src == NetSrc::Server)
+    {
+        if (initServer)
+        {
+            sendBatch(serverSocket, *serverSendBatch);
+        }
+        
+        return;
+    }
+    
+    if (initClient)
+    {
+        sendBatch(clientSocket, *clientSendBatch);
+    }
+}
+
+bool NetLoopback::waitForPackets(const NetSrc& src, int timeoutMs)
+{
+    const int epollFd = src == NetSrc::Server ? serverEpollFd : clientEpollFd;
+    if (epollFd == -1)
+    {
+        return false;
+    }
+    
+    struct epoll_event event;
+    
+    const int numEvents = epoll_wait(epollFd, &event, 1, timeoutMs);
+    if (numEvents == -1)
+    {
+        if (errno != EINTR)
+        {
+            throw std::runtime_error{ fmt::format("epoll_wait failure: {}", strerror(errno)) };
+        }
+        
+        return false;
+    }
+    
+    return numEvents > 0;
+}
+
+int NetLoopback::createEpoll(int socket)
+{
+    const int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd == -1)
+    {
+        throw std::runtime_error{ fmt::format("Could not create epoll instance: {}", strerror(errno)) };
+    }
+    
+    struct epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = socket;
+    
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, socket, &event) == -1)
+    {
+        close(epollFd);
+        throw std::runtime_error{ fmt::format("Could not watch socket: {}", strerror(errno)) };
+    }
+    
+    return epollFd;
+}
+
 class ClientPortAllocator
 {
 public:
@@ -206,7 +354,7 @@ private:
     Log& log;
     int shm;
     
-    static constexpr size_t NUM_PORTS = 64;
+    static constexpr size_t NUM_PORTS = NetLoopback::MAX_CLIENT_PORTS;
     static constexpr size_t PORT_ARRAY_SIZE = sizeof(int) * NUM_PORTS;
     int* portArray;
 };
@@ -261,11 +409,23 @@ std::string NetLoopback::getClientName(uint16_t port)
     return runDir + "/client-socket" + std::to_string(port);
 }
 
-uint16_t NetLoopback::getPortFromClientName(const std::string& clientName)
+bool NetLoopback::getPortFromClientName(const char* clientName, uint16_t& outPort)
 {
-    const std::string port = clientName.substr((runDir + "/client-socket").size());
+    if (strncmp(clientName, clientNamePrefix.c_str(), clientNamePrefix.size()) != 0)
+    {
+        return false;
+    }
+    
+    char* end;
+    const unsigned long port = strtoul(clientName + clientNamePrefix.size(), &end, 10);
+    if (end == clientName + clientNamePrefix.size() || port >= MAX_CLIENT_PORTS)
+    {
+        return false;
+    }
     
-    return static_cast<uint16_t>(std::stoi(port));
+    outPort = static_cast<uint16_t>(port);
+    
+    return true;
 }
 
 struct sockaddr_un NetLoopback::getServerSockAddr()
@@ -291,117 +451,91 @@ struct sockaddr_un NetLoopback::getClientSockAddr(uint16_t port)
     return clientAddr;
 }
 
-bool NetLoopback::getPacketServer(NetBuf& buf, NetAddr& fromAddr)
+bool NetLoopback::sendPacketAsClient(NetBuf buf, const NetAddr& /*toAddr*/)
 {
-    struct sockaddr_un clientAddr{};
-    socklen_t clientAddrLen = sizeof(struct sockaddr_un);
+    queuePacket(*clientSendBatch, std::move(buf), serverSockAddr);
     
-    struct pollfd pfds[1];
-    pfds[0].fd = serverSocket;
-    pfds[0].events = POLLIN;
-    
-    const int numEvents = poll(pfds, 1, 1);
-    if (numEvents == 0)
-    {
-        return false;
-    }
-    
-    std::array<std::byte, NetBuf::MAX_BYTES> data{};
-    const ssize_t recvData = recvfrom(serverSocket, data.data(), data.size(), 0,
-                                      reinterpret_cast<struct sockaddr*>(&clientAddr), &clientAddrLen);
-    if (recvData == -1)
+    if (clientSendBatch->numPackets == MAX_PACKET_BATCH)
     {
-        if (errno != EAGAIN && errno != EWOULDBLOCK)
-        {
-            throw std::runtime_error{ "Failure" };
-        }
-        
-        return false;
+        sendBatch(clientSocket, *clientSendBatch);
     }
-    
-    buf.writeBytes(std::span<std::byte>{ data.data(), static_cast<size_t>(recvData) });
-    
-    fromAddr.type = NetAddrType::Loopback;
-    fromAddr.port = getPortFromClientName(clientAddr.sun_path);
-    
+
     return true;
 }
 
-bool NetLoopback::getPacketClient(NetBuf& buf, NetAddr& fromAddr)
+bool NetLoopback::sendPacketAsServer(NetBuf buf, const NetAddr& toAddr)
 {
-    struct sockaddr_un serverAddr;
-    socklen_t serverAddrLen = sizeof(struct sockaddr_un);
-    
-    struct pollfd pfds[1];
-    pfds[0].fd = clientSocket;
-    pfds[0].events = POLLIN;
-    
-    const int numEvents = poll(pfds, 1, 1);
-    if (numEvents == 0)
+    if (toAddr.port >= MAX_CLIENT_PORTS)
     {
         return false;
     }
     
-    std::array<std::byte, NetBuf::MAX_BYTES> data{};
-    const ssize_t recvData = recvfrom(clientSocket, data.data(), data.size(), 0,
-                                      reinterpret_cast<struct sockaddr*>(&serverAddr), &serverAddrLen);
-    if (recvData == -1)
+    queuePacket(*serverSendBatch, std::move(buf), clientSockAddrs[toAddr.port]);
+    
+    if (serverSendBatch->numPackets == MAX_PACKET_BATCH)
     {
-        if (errno != EAGAIN && errno != EWOULDBLOCK)
-        {
-            throw std::runtime_error{ fmt::format("Failure: {}", strerror(errno)) };
-        }
-        
-        return false;
+        sendBatch(serverSocket, *serverSendBatch);
     }
-    
-    buf.writeBytes(std::span<std::byte>{ data.data(), static_cast<size_t>(recvData) });
-    
-    fromAddr.type = NetAddrType::Loopback;
-    fromAddr.port = 0;
-    
+
     return true;
 }
 
-bool NetLoopback::sendPacketAsClient(NetBuf buf, const NetAddr& toAddr)
+void NetLoopback::queuePacket(PacketBatch& batch, NetBuf buf, const struct sockaddr_un& toAddr)
 {
-    const struct sockaddr_un serverAddr = getServerSockAddr();
+    const size_t i = batch.numPackets++;
+    
+    //hold onto the buffer until it's sent so the bytes don't need copying
+    batch.bufs[i] = std::move(buf);
+    std::span<const std::byte> data = batch.bufs[i].getData();
+    batch.addrs[i] = toAddr;
     
-    std::span<const std::byte> data = buf.getData();
+    batch.iovecs[i].iov_base = const_cast<std::byte*>(data.data());
+    batch.iovecs[i].iov_len = data.size();
+    
+    batch.headers[i] = {};
+    batch.headers[i].msg_hdr.msg_name = &batch.addrs[i];
+    batch.headers[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_un);
+    batch.headers[i].msg_hdr.msg_iov = &batch.iovecs[i];
+    batch.headers[i].msg_hdr.msg_iovlen = 1;
+}
 
-    const ssize_t res = sendto(clientSocket, data.data(), data.size(), 0,
-        reinterpret_cast<const struct sockaddr*>(&serverAddr), sizeof(struct sockaddr_un));
-    if (res == -1)
+void NetLoopback::sendBatch(int socket, PacketBatch& batch)
+{
+    size_t numSent = 0;
+    while (numSent < batch.numPackets)
     {
-        if (errno == ENOENT)
+        const int res = sendmmsg(socket, batch.headers.data() + numSent, static_cast<unsigned int>(batch.numPackets - numSent), MSG_DONTWAIT);
+        if (res == -1)
         {
-            return false;
+            //the other end went away or isn't keeping up, drop it like udp would and keep going
+            if (errno == ENOENT || errno == ECONNREFUSED || errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                numSent++;
+                continue;
+            }
+            
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            
+            releaseBatch(batch);
+            throw std::runtime_error{ fmt::format("sendmmsg err: {}({})", strerror(errno), errno) };
         }
-
-        throw std::runtime_error{ fmt::format("Server sento err: {}({})", strerror(errno), errno) };
+        
+        numSent += static_cast<size_t>(res);
     }
-
-    return true;
+    
+    releaseBatch(batch);
 }
 
-bool NetLoopback::sendPacketAsServer(NetBuf buf, const NetAddr& toAddr)
+void NetLoopback::releaseBatch(PacketBatch& batch)
 {
-    const struct sockaddr_un clientAddr = getClientSockAddr(toAddr.port);
-
-    std::span<const std::byte> data = buf.getData();
-    
-    const ssize_t res = sendto(serverSocket, data.data(), data.size(), 0,
-        reinterpret_cast<const struct sockaddr*>(&clientAddr), sizeof(struct sockaddr_un));
-
-    if (res == -1)
+    //give the blocks back to the pool
+    for (size_t i = 0; i < batch.numPackets; i++)
     {
-        if (errno == ENOENT)
-        {
-            return false;
-        }
-
-        throw std::runtime_error{ fmt::format("Client sento err: {}({})", strerror(errno), errno) };
+        batch.bufs[i] = NetBuf{};
     }
-
-    return true;
+    
+    batch.numPackets = 0;
 }
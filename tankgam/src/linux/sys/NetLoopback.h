@@ -4,6 +4,12 @@
 #include <cstring>
 #include <unordered_map>
 #include <string>
+#include <array>
+#include <memory>
+#include <span>
+
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "NetBuf.h"
 
@@ -21,8 +27,24 @@ public:
     NetLoopback& operator=(const NetLoopback&) = delete;
     
     bool getPacket(const NetSrc& src, NetBuf& buf, NetAddr& fromAddr);
+    
+    //reads as many waiting packets as fit in a single recvmmsg
+    //returns the number of bufs & fromAddrs filled in
+    size_t getPackets(const NetSrc& src, std::span<NetBuf> bufs, std::span<NetAddr> fromAddrs);
+    
+    //packets get queued up and sent together once the batch is full or on flushPackets
     bool sendPacket(const NetSrc& src, NetBuf buf, const NetAddr& toAddr);
     
+    void flushPackets(const NetSrc& src);
+    
+    //blocks until the socket for src has something to read or the timeout passes
+    //returns true if there's a packet waiting
+    bool waitForPackets(const NetSrc& src, int timeoutMs);
+    
+    static constexpr size_t MAX_PACKET_BATCH = 32;
+    
+    static constexpr size_t MAX_CLIENT_PORTS = 64;
+    
 private:
     Log& log;
     bool initClient;
@@ -34,20 +56,52 @@ private:
     
     int serverSocket;
     int clientSocket;
+
+    //one per socket, so the server and client can each wait on their own thread
+    int serverEpollFd;
+    int clientEpollFd;
     
     uint16_t allocClientPort();
     void freeClientPort(uint16_t port);
     
     std::string getServerName();
     std::string getClientName(uint16_t port);
-    uint16_t getPortFromClientName(const std::string& clientName);
+    //returns false if it isn't one of our client sockets
+    bool getPortFromClientName(const char* clientName, uint16_t& outPort);
     
     struct sockaddr_un getServerSockAddr();
     struct sockaddr_un getClientSockAddr(uint16_t port);
     
-    bool getPacketServer(NetBuf& buf, NetAddr& fromAddr);
-    bool getPacketClient(NetBuf& buf, NetAddr& fromAddr);
+    //worked out once up front instead of for every packet
+    std::string clientNamePrefix;
+    struct sockaddr_un serverSockAddr;
+    std::array<struct sockaddr_un, MAX_CLIENT_PORTS> clientSockAddrs;
+    
+    //everything recvmmsg/sendmmsg needs for a batch of packets
+    struct PacketBatch
+    {
+        //what's waiting to go out, recieving goes straight into the caller's buffers
+        std::array<NetBuf, MAX_PACKET_BATCH> bufs;
+        std::array<struct iovec, MAX_PACKET_BATCH> iovecs;
+        std::array<struct mmsghdr, MAX_PACKET_BATCH> headers;
+        std::array<struct sockaddr_un, MAX_PACKET_BATCH> addrs;
+        size_t numPackets;
+    };
+    
+    std::unique_ptr<PacketBatch> serverRecvBatch;
+    std::unique_ptr<PacketBatch> clientRecvBatch;
+    std::unique_ptr<PacketBatch> serverSendBatch;
+    std::unique_ptr<PacketBatch> clientSendBatch;
+    
+    //returns an epoll instance watching just this socket
+    int createEpoll(int socket);
     
     bool sendPacketAsClient(NetBuf buf, const NetAddr& toAddr);
     bool sendPacketAsServer(NetBuf buf, const NetAddr& toAddr);
+    
+    void queuePacket(PacketBatch& batch, NetBuf buf, const struct sockaddr_un& toAddr);
+    void sendBatch(int socket, PacketBatch& batch);
+    
+    //drops the sent buffers and empties the batch
+    void releaseBatch(PacketBatch& batch);
 };
@@ -0,0 +1,435 @@
+#include "sys/NetUdp.h"
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#include <stdexcept>
+#include <algorithm>
+#include <string>
+
+#include <fmt/format.h>
+
+#include <util/Log.h>
+
+#include "Net.h"
+
+NetUdp::NetUdp(Log& log, bool initClient, bool initServer, uint16_t serverPort)
+    : log{ log },
+      initClient{ initClient }, initServer{ initServer },
+      serverSocket{ -1 }, clientSocket{ -1 },
+      serverEpollFd{ -1 }, clientEpollFd{ -1 },
+      serverFamily{ AF_UNSPEC }, clientFamily{ AF_UNSPEC },
+      serverRecvBatch{ std::make_unique<PacketBatch>() },
+      clientRecvBatch{ std::make_unique<PacketBatch>() },
+      serverSendBatch{ std::make_unique<PacketBatch>() },
+      clientSendBatch{ std::make_unique<PacketBatch>() }
+{
+    serverRecvBatch->numPackets = 0;
+    clientRecvBatch->numPackets = 0;
+    serverSendBatch->numPackets = 0;
+    clientSendBatch->numPackets = 0;
+
+    try
+    {
+        if (initServer)
+        {
+            serverSocket = openSocket(serverPort, serverFamily);
+            serverEpollFd = createEpoll(serverSocket);
+
+            log.logf(LogLevel::Info, "Net: Server listening on udp port %d", static_cast<int>(serverPort));
+        }
+
+        if (initClient)
+        {
+            clientSocket = openSocket(0, clientFamily);
+            clientEpollFd = createEpoll(clientSocket);
+        }
+    }
+    catch (...)
+    {
+        for (int fd : { serverEpollFd, serverSocket, clientEpollFd, clientSocket })
+        {
+            if (fd != -1)
+            {
+                close(fd);
+            }
+        }
+
+        throw;
+    }
+}
+
+NetUdp::~NetUdp()
+{
+    if (initClient)
+    {
+        //don't lose anything that was still waiting to go out
+        flushPackets(NetSrc::Client);
+
+        close(clientEpollFd);
+        close(clientSocket);
+    }
+
+    if (initServer)
+    {
+        flushPackets(NetSrc::Server);
+
+        close(serverEpollFd);
+        close(serverSocket);
+    }
+}
+
+bool NetUdp::getPacket(const NetSrc& src, NetBuf& buf, NetAddr& fromAddr)
+{
+    return getPackets(src, std::span<NetBuf>{ &buf, 1 }, std::span<NetAddr>{ &fromAddr, 1 }) > 0;
+}
+
+size_t NetUdp::getPackets(const NetSrc& src, std::span<NetBuf> bufs, std::span<NetAddr> fromAddrs)
+{
+    const int socket = src == NetSrc::Server ? serverSocket : clientSocket;
+
+    const size_t maxPackets = std::min({ bufs.size(), fromAddrs.size(), MAX_PACKET_BATCH });
+    if (maxPackets == 0)
+    {
+        return 0;
+    }
+
+    PacketBatch& batch = src == NetSrc::Server ? *serverRecvBatch : *clientRecvBatch;
+    for (size_t i = 0; i < maxPackets; i++)
+    {
+        //recieve straight into the caller's buffers
+        const std::span<std::byte> space = bufs[i].beginDirectWrite();
+        batch.iovecs[i].iov_base = space.data();
+        batch.iovecs[i].iov_len = space.size();
+
+        batch.headers[i] = {};
+        batch.headers[i].msg_hdr.msg_name = &batch.addrs[i];
+        batch.headers[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        batch.headers[i].msg_hdr.msg_iov = &batch.iovecs[i];
+        batch.headers[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    //the socket is non-blocking, so this only takes what's already here
+    const int numRecieved = recvmmsg(socket, batch.headers.data(), static_cast<unsigned int>(maxPackets), 0, nullptr);
+    if (numRecieved == -1)
+    {
+        //ECONNREFUSED is just an icmp error from something we sent earlier
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNREFUSED)
+        {
+            throw std::runtime_error{ fmt::format("recvmmsg failure: {}", strerror(errno)) };
+        }
+
+        return 0;
+    }
+
+    for (int i = 0; i < numRecieved; i++)
+    {
+        sockAddrToNetAddr(batch.addrs[i], fromAddrs[i]);
+        bufs[i].endDirectWrite(batch.headers[i].msg_len);
+    }
+
+    return static_cast<size_t>(numRecieved);
+}
+
+bool NetUdp::sendPacket(const NetSrc& src, NetBuf buf, const NetAddr& toAddr)
+{
+    const bool isServer = src == NetSrc::Server;
+
+    PacketBatch& batch = isServer ? *serverSendBatch : *clientSendBatch;
+
+    const size_t i = batch.numPackets;
+
+    socklen_t sockAddrLen;
+    if (!netAddrToSockAddr(toAddr, isServer ? serverFamily : clientFamily, batch.addrs[i], sockAddrLen))
+    {
+        return false;
+    }
+
+    //hold onto the buffer until it's sent so the bytes don't need copying
+    batch.bufs[i] = std::move(buf);
+    std::span<const std::byte> data = batch.bufs[i].getData();
+
+    batch.iovecs[i].iov_base = const_cast<std::byte*>(data.data());
+    batch.iovecs[i].iov_len = data.size();
+
+    batch.headers[i] = {};
+    batch.headers[i].msg_hdr.msg_name = &batch.addrs[i];
+    batch.headers[i].msg_hdr.msg_namelen = sockAddrLen;
+    batch.headers[i].msg_hdr.msg_iov = &batch.iovecs[i];
+    batch.headers[i].msg_hdr.msg_iovlen = 1;
+
+    batch.numPackets++;
+
+    if (batch.numPackets == MAX_PACKET_BATCH)
+    {
+        sendBatch(isServer ? serverSocket : clientSocket, batch);
+    }
+
+    return true;
+}
+
+void NetUdp::flushPackets(const NetSrc& src)
+{
+    if (src == NetSrc::Server)
+    {
+        if (initServer)
+        {
+            sendBatch(serverSocket, *serverSendBatch);
+        }
+
+        return;
+    }
+
+    if (initClient)
+    {
+        sendBatch(clientSocket, *clientSendBatch);
+    }
+}
+
+bool NetUdp::waitForPackets(const NetSrc& src, int timeoutMs)
+{
+    const int epollFd = src == NetSrc::Server ? serverEpollFd : clientEpollFd;
+    if (epollFd == -1)
+    {
+        return false;
+    }
+
+    struct epoll_event event;
+
+    const int numEvents = epoll_wait(epollFd, &event, 1, timeoutMs);
+    if (numEvents == -1)
+    {
+        if (errno != EINTR)
+        {
+            throw std::runtime_error{ fmt::format("epoll_wait failure: {}", strerror(errno)) };
+        }
+        
+        return false;
+    }
+
+    return numEvents > 0;
+}
+
+int NetUdp::createEpoll(int socket)
+{
+    const int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd == -1)
+    {
+        throw std::runtime_error{ fmt::format("Could not create epoll instance: {}", strerror(errno)) };
+    }
+
+    struct epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = socket;
+
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, socket, &event) == -1)
+    {
+        close(epollFd);
+        throw std::runtime_error{ fmt::format("Could not watch socket: {}", strerror(errno)) };
+    }
+
+    return epollFd;
+}
+
+bool NetUdp::resolveAddr(std::string_view str, uint16_t defaultPort, NetAddr& outAddr)
+{
+    std::string host{ str };
+    std::string port = std::to_string(defaultPort);
+
+    //split off the port, ipv6 hosts need to be in brackets to have one
+    if (!host.empty() && host.front() == '[')
+    {
+        const size_t end = host.find(']');
+        if (end == std::string::npos)
+        {
+            return false;
+        }
+
+        if (end + 1 < host.size())
+        {
+            if (host[end + 1] != ':')
+            {
+                return false;
+            }
+
+            port = host.substr(end + 2);
+        }
+
+        host = host.substr(1, end - 1);
+    }
+    else if (const size_t colon = host.find(':');
+             colon != std::string::npos && host.find(':', colon + 1) == std::string::npos)
+    {
+        port = host.substr(colon + 1);
+        host = host.substr(0, colon);
+    }
+
+    struct addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    struct addrinfo* results = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &results) != 0 || !results)
+    {
+        return false;
+    }
+
+    struct sockaddr_storage sockAddr{};
+    std::memcpy(&sockAddr, results->ai_addr, std::min<size_t>(results->ai_addrlen, sizeof(sockAddr)));
+    freeaddrinfo(results);
+
+    sockAddrToNetAddr(sockAddr, outAddr);
+
+    return true;
+}
+
+int NetUdp::openSocket(uint16_t port, int& outFamily)
+{
+    //try for a dual stack socket first
+    int sock = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (sock != -1)
+    {
+        const int no = 0;
+        setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no));
+
+        struct sockaddr_in6 addr{};
+        addr.sin6_family = AF_INET6;
+        addr.sin6_addr = in6addr_any;
+        addr.sin6_port = htons(port);
+
+        if (bind(sock, reinterpret_cast<const struct sockaddr*>(&addr), sizeof(addr)) == -1)
+        {
+            close(sock);
+            throw std::runtime_error{ fmt::format("Could not bind udp port {}: {}", port, strerror(errno)) };
+        }
+
+        outFamily = AF_INET6;
+        return sock;
+    }
+
+    log.log(LogLevel::Info, "Net: No ipv6 support, falling back to ipv4");
+
+    sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (sock == -1)
+    {
+        throw std::runtime_error{ fmt::format("Could not open udp socket: {}", strerror(errno)) };
+    }
+
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(sock, reinterpret_cast<const struct sockaddr*>(&addr), sizeof(addr)) == -1)
+    {
+        close(sock);
+        throw std::runtime_error{ fmt::format("Could not bind udp port {}: {}", port, strerror(errno)) };
+    }
+
+    outFamily = AF_INET;
+    return sock;
+}
+
+void NetUdp::sockAddrToNetAddr(const struct sockaddr_storage& sockAddr, NetAddr& outAddr)
+{
+    outAddr.type = NetAddrType::Ip;
+    outAddr.ip = {};
+
+    if (sockAddr.ss_family == AF_INET6)
+    {
+        const auto& addr6 = reinterpret_cast<const struct sockaddr_in6&>(sockAddr);
+        std::memcpy(outAddr.ip.data(), &addr6.sin6_addr, outAddr.ip.size());
+        outAddr.port = ntohs(addr6.sin6_port);
+    }
+    else
+    {
+        //store ipv4 as ::ffff:a.b.c.d so every address looks the same
+        const auto& addr4 = reinterpret_cast<const struct sockaddr_in&>(sockAddr);
+        outAddr.ip[10] = 0xff;
+        outAddr.ip[11] = 0xff;
+        std::memcpy(outAddr.ip.data() + 12, &addr4.sin_addr, 4);
+        outAddr.port = ntohs(addr4.sin_port);
+    }
+}
+
+bool NetUdp::netAddrToSockAddr(const NetAddr& addr, int family, struct sockaddr_storage& outSockAddr, socklen_t& outSockAddrLen)
+{
+    if (addr.type != NetAddrType::Ip)
+    {
+        return false;
+    }
+
+    outSockAddr = {};
+
+    if (family == AF_INET6)
+    {
+        auto& addr6 = reinterpret_cast<struct sockaddr_in6&>(outSockAddr);
+        addr6.sin6_family = AF_INET6;
+        std::memcpy(&addr6.sin6_addr, addr.ip.data(), addr.ip.size());
+        addr6.sin6_port = htons(addr.port);
+
+        outSockAddrLen = sizeof(struct sockaddr_in6);
+        return true;
+    }
+
+    //an ipv4 only socket can't reach real ipv6 addresses
+    static constexpr std::array<uint8_t, 12> V4_MAPPED_PREFIX = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+    if (!std::equal(V4_MAPPED_PREFIX.begin(), V4_MAPPED_PREFIX.end(), addr.ip.begin()))
+    {
+        return false;
+    }
+
+    auto& addr4 = reinterpret_cast<struct sockaddr_in&>(outSockAddr);
+    addr4.sin_family = AF_INET;
+    std::memcpy(&addr4.sin_addr, addr.ip.data() + 12, 4);
+    addr4.sin_port = htons(addr.port);
+
+    outSockAddrLen = sizeof(struct sockaddr_in);
+    return true;
+}
+
+void NetUdp::sendBatch(int socket, PacketBatch& batch)
+{
+    size_t numSent = 0;
+    while (numSent < batch.numPackets)
+    {
+        const int res = sendmmsg(socket, batch.headers.data() + numSent, static_cast<unsigned int>(batch.numPackets - numSent), 0);
+        if (res == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            //udp doesn't promise anything, so anything that can't go out right now just gets dropped
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED ||
+                errno == ENETUNREACH || errno == EHOSTUNREACH || errno == EADDRNOTAVAIL)
+            {
+                numSent++;
+                continue;
+            }
+
+            releaseBatch(batch);
+            throw std::runtime_error{ fmt::format("sendmmsg err: {}({})", strerror(errno), errno) };
+        }
+
+        numSent += static_cast<size_t>(res);
+    }
+
+    releaseBatch(batch);
+}
+
+void NetUdp::releaseBatch(PacketBatch& batch)
+{
+    //give the blocks back to the pool
+    for (size_t i = 0; i < batch.numPackets; i++)
+    {
+        batch.bufs[i] = NetBuf{};
+    }
+
+    batch.numPackets = 0;
+}
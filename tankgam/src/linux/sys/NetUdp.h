@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <array>
+#include <memory>
+#include <span>
+#include <string_view>
+
+#include <sys/socket.h>
+
+#include "NetBuf.h"
+
+struct NetAddr;
+enum class NetSrc;
+class Log;
+
+//non-blocking udp sockets, ipv6 with ipv4 mapped addresses where the system lets us
+class NetUdp
+{
+public:
+    NetUdp(Log& log, bool initClient, bool initServer, uint16_t serverPort);
+    ~NetUdp();
+
+    NetUdp(const NetUdp&) = delete;
+    NetUdp& operator=(const NetUdp&) = delete;
+
+    bool getPacket(const NetSrc& src, NetBuf& buf, NetAddr& fromAddr);
+
+    //reads as many waiting packets as fit in a single recvmmsg
+    //returns the number of bufs & fromAddrs filled in
+    size_t getPackets(const NetSrc& src, std::span<NetBuf> bufs, std::span<NetAddr> fromAddrs);
+
+    //packets get queued up and sent together once the batch is full or on flushPackets
+    bool sendPacket(const NetSrc& src, NetBuf buf, const NetAddr& toAddr);
+
+    void flushPackets(const NetSrc& src);
+
+    //blocks until the socket for src has something to read or the timeout passes
+    //returns true if there's a packet waiting
+    bool waitForPackets(const NetSrc& src, int timeoutMs);
+
+    //turns "host", "host:port" or "[v6 host]:port" into an address
+    //returns false if it couldn't be resolved
+    static bool resolveAddr(std::string_view str, uint16_t defaultPort, NetAddr& outAddr);
+
+    static constexpr size_t MAX_PACKET_BATCH = 32;
+
+private:
+    Log& log;
+    bool initClient;
+    bool initServer;
+
+    int serverSocket;
+    int clientSocket;
+
+    //one per socket, so the server and client can each wait on their own thread
+    int serverEpollFd;
+    int clientEpollFd;
+
+    //AF_INET6, or AF_INET if the system doesn't do ipv6
+    int serverFamily;
+    int clientFamily;
+
+    //everything recvmmsg/sendmmsg needs for a batch of packets
+    struct PacketBatch
+    {
+        //what's waiting to go out, recieving goes straight into the caller's buffers
+        std::array<NetBuf, MAX_PACKET_BATCH> bufs;
+        std::array<struct iovec, MAX_PACKET_BATCH> iovecs;
+        std::array<struct mmsghdr, MAX_PACKET_BATCH> headers;
+        std::array<struct sockaddr_storage, MAX_PACKET_BATCH> addrs;
+        size_t numPackets;
+    };
+
+    std::unique_ptr<PacketBatch> serverRecvBatch;
+    std::unique_ptr<PacketBatch> clientRecvBatch;
+    std::unique_ptr<PacketBatch> serverSendBatch;
+    std::unique_ptr<PacketBatch> clientSendBatch;
+
+    //port 0 lets the system pick one
+    int openSocket(uint16_t port, int& outFamily);
+
+    static void sockAddrToNetAddr(const struct sockaddr_storage& sockAddr, NetAddr& outAddr);
+    static bool netAddrToSockAddr(const NetAddr& addr, int family, struct sockaddr_storage& outSockAddr, socklen_t& outSockAddrLen);
+
+    //returns an epoll instance watching just this socket
+    int createEpoll(int socket);
+
+    void sendBatch(int socket, PacketBatch& batch);
+
+    //drops the sent buffers and empties the batch
+    void releaseBatch(PacketBatch& batch);
+};
@@ -6,6 +6,12 @@
 
 #include "SDL.h"
 
+#include <algorithm>
+#include <cstdlib>
+#include <thread>
+#include <atomic>
+#include <exception>
+
 #include <util/FileManager.h>
 
 #if NDEBUG
@@ -26,16 +32,45 @@ int main(int argc, char** argv)
         
         bool initClient = false;
         bool initServer = false;
-        if (argc > 1)
+        size_t maxClients = Server::DEFAULT_MAX_CLIENTS;
+        bool forceUdp = false;
+        uint16_t serverPort = Net::DEFAULT_SERVER_PORT;
+        const char* connectAddr = nullptr;
+        const char* mapName = nullptr;
+        for (int i = 1; i < argc; i++)
         {
-            if (strcmp(argv[1], "--client") == 0)
+            if (strcmp(argv[i], "--client") == 0)
             {
                 initClient = true;
             }
-            if (strcmp(argv[1], "--server") == 0)
+            else if (strcmp(argv[i], "--server") == 0)
             {
                 initServer = true;
             }
+            else if (strcmp(argv[i], "--maxclients") == 0 && i + 1 < argc)
+            {
+                maxClients = static_cast<size_t>(std::max(1, atoi(argv[++i])));
+            }
+            else if (strcmp(argv[i], "--udp") == 0)
+            {
+                forceUdp = true;
+            }
+            else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc)
+            {
+                serverPort = static_cast<uint16_t>(std::clamp(atoi(argv[++i]), 1, 65535));
+            }
+            else if (strcmp(argv[i], "--connect") == 0 && i + 1 < argc)
+            {
+                //connecting to another machine only makes sense over udp
+                //and it doesn't need a listen server of our own, unless they ask for one with --server
+                connectAddr = argv[++i];
+                initClient = true;
+                forceUdp = true;
+            }
+            else if (strcmp(argv[i], "--map") == 0 && i + 1 < argc)
+            {
+                mapName = argv[++i];
+            }
         }
         
         if (!initClient && !initServer)
@@ -44,14 +79,48 @@ int main(int argc, char** argv)
             initServer = true;
         }
         
-        Net net{ console, initClient, initServer };
+        if (forceUdp && !Net::isBackendSupported(NetBackend::Udp))
+        {
+            console.logf(LogLevel::Error, "--udp and --connect aren't supported on this platform yet");
+            return 1;
+        }
+        
+        //a listen server runs on its own thread, so it gets handed packets directly instead of through sockets
+        NetBackend netBackend = NetBackend::Loopback;
+        if (forceUdp)
+        {
+            netBackend = NetBackend::Udp;
+        }
+        else if (initClient && initServer)
+        {
+            netBackend = NetBackend::InProcess;
+        }
+        
+        Net net{ console, initClient, initServer, netBackend, serverPort };
+        
+        if (connectAddr)
+        {
+            NetAddr serverAddr;
+            if (!Net::resolveAddr(connectAddr, serverAddr))
+            {
+                console.logf(LogLevel::Error, "Could not resolve server address %s", connectAddr);
+                return 1;
+            }
+            
+            net.setServerAddr(serverAddr);
+        }
         
         std::unique_ptr<Server> server;
         std::unique_ptr<Client> client;
         
         if (initServer)
         {
-            server = std::make_unique<Server>(console, fileManager, net);
+            server = std::make_unique<Server>(console, fileManager, net, maxClients);
+            
+            if (mapName)
+            {
+                server->loadMap(mapName);
+            }
         }
         
         if (initClient)
@@ -59,26 +128,79 @@ int main(int argc, char** argv)
             client = std::make_unique<Client>(console, fileManager, net);
         }
        
+        //the server thread can't throw across to us, so it leaves whatever killed it here
+        std::exception_ptr serverException;
+        std::atomic<bool> serverStopped{ false };
+        std::thread serverThread;
+        
+        if (server && client)
+        {
+            serverThread = std::thread{ [&server, &serverException, &serverStopped]()
+                {
+                    try
+                    {
+                        while (server->runFrame())
+                        {
+                            server->sleepUntilNextTick();
+                        }
+                    }
+                    catch (...)
+                    {
+                        serverException = std::current_exception();
+                    }
+                    
+                    serverStopped = true;
+                } };
+        }
+        
+        //make sure the server thread is gone before anything it uses is
+        const auto stopServerThread = [&server, &serverThread]()
+        {
+            if (serverThread.joinable())
+            {
+                server->shutdown();
+                serverThread.join();
+            }
+        };
+        
         try
         {
-            for (;;)
+            if (client)
             {
-                if (server && !server->runFrame())
+                while (!serverStopped && client->runFrame())
                 {
-                    break;
                 }
-                
-                if (client && !client->runFrame())
+            }
+            else
+            {
+                //a dedicated server has nothing else to do until the next tick
+                while (server->runFrame())
                 {
-                    break;
+                    server->sleepUntilNextTick();
                 }
             }
         }
         catch (const std::exception& e)
         {
+            stopServerThread();
             SDL_Log("Run Loop Exception: %s", e.what());
             return 1;
         }
+        
+        stopServerThread();
+        
+        if (serverException)
+        {
+            try
+            {
+                std::rethrow_exception(serverException);
+            }
+            catch (const std::exception& e)
+            {
+                SDL_Log("Server Thread Exception: %s", e.what());
+                return 1;
+            }
+        }
     }
     
     //According to the docs I should call this even if I call SDL_QuitSubSystem for every SDL_InitSubSystem call I make
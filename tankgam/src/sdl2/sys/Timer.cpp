@@ -1,22 +1,24 @@
 #include "sys/Timer.h"
 
 #include <stdexcept>
+#include <algorithm>
 
 #include "SDL.h"
 
-//since the 64 bit api of the tick system in sdl2 is only available past 2.0.18
-//add this inbetween function to get it working on old sdl2 versions
-static uint64_t GetTicks()
+//the performance counter is a monotonic high resolution clock (clock_gettime on linux)
+//convert it to nanoseconds without overflowing
+static uint64_t GetNanos()
 {
-#if SDL_VERSION_ATLEAST(2, 0, 18)
-    return SDL_GetTicks64();
-#else
-    return static_cast<uint64_t>(SDL_GetTicks());
-#endif
+    static const uint64_t frequency = SDL_GetPerformanceFrequency();
+    const uint64_t counter = SDL_GetPerformanceCounter();
+    
+    return (counter / frequency) * Timer::NANOS_PER_SECOND +
+        ((counter % frequency) * Timer::NANOS_PER_SECOND) / frequency;
 }
 
 Timer::Timer()
-    : enabled{ false }, startTime{ GetTicks() }
+    : enabled{ false }, startTime{ GetNanos() },
+      slewError{ 0 }, slewStart{ 0 }, slewTime{ 0 }, lastTime{ 0 }
 {
     if (SDL_InitSubSystem(SDL_INIT_TIMER) != 0)
     {
@@ -32,31 +34,108 @@ Timer::~Timer()
 void Timer::start()
 {
     enabled = true;
-    startTime = GetTicks();
+    startTime = GetNanos();
+    slewError = 0;
+    slewTime = 0;
+    lastTime = 0;
 }
 
 void Timer::stop()
 {
     enabled = false;
     startTime = 0;
+    slewError = 0;
+    slewTime = 0;
+    lastTime = 0;
 }
 
-void Timer::setTickOffset(uint64_t tickOffset)
+void Timer::setTime(uint64_t time)
 {
-    startTime = startTime + ((tickOffset / 1000) * Timer::TICK_RATE);
+    startTime = GetNanos() - time;
+    slewError = 0;
+    slewTime = 0;
+    lastTime = time;
+}
+
+void Timer::adjustTime(uint64_t time, uint64_t newSlewTime)
+{
+    const uint64_t now = GetNanos();
+    
+    //whatever got worked in so far stays, the rest gets replaced by this correction
+    startTime -= static_cast<uint64_t>(getSlewOffset(now));
+    slewError = 0;
+    slewTime = 0;
+    
+    //everything here wraps around the same way getTotalTime does, so unsigned math is fine
+    const int64_t error = static_cast<int64_t>(time - (now - startTime));
+    
+    //too far off to wait for, if that's backwards getTotalTime holds still until it's caught up
+    if (static_cast<uint64_t>(error < 0 ? -error : error) > MAX_SLEW_TIME || newSlewTime == 0)
+    {
+        startTime -= static_cast<uint64_t>(error);
+        return;
+    }
+    
+    //close enough, run a bit fast or slow until it's fixed so time doesn't visibly jump
+    //the error is a lot smaller than slewTime, so the clock never runs backwards
+    slewError = error;
+    slewStart = now;
+    slewTime = newSlewTime;
+}
+
+int64_t Timer::getSlewOffset(uint64_t now) const
+{
+    if (slewTime == 0)
+    {
+        return 0;
+    }
+    
+    const uint64_t elapsed = std::min(now - slewStart, slewTime);
+    
+    return static_cast<int64_t>(static_cast<double>(slewError) * static_cast<double>(elapsed) / static_cast<double>(slewTime));
+}
+
+//get the nanoseconds since time started
+uint64_t Timer::getTotalTime() const
+{
+    if (!enabled)
+    {
+        return 0;
+    }
+    
+    const uint64_t now = GetNanos();
+    const uint64_t time = now - startTime + static_cast<uint64_t>(getSlewOffset(now));
+    
+    lastTime = std::max(lastTime, time);
+    
+    return lastTime;
 }
 
 //get the ticks since time started
 uint64_t Timer::getTotalTicks() const
 {
-    if (enabled)
-    {
-        const uint64_t ticks = GetTicks() - startTime;
+    return getTotalTime() / NANOS_PER_TICK;
+}
 
-        return (ticks * Timer::TICK_RATE) / 1000;
+float Timer::getTickFraction() const
+{
+    return static_cast<float>(getTotalTime() % NANOS_PER_TICK) / static_cast<float>(NANOS_PER_TICK);
+}
+
+uint64_t Timer::getNanosUntilTick(uint64_t tick) const
+{
+    if (!enabled)
+    {
+        return 0;
     }
-    else
+    
+    const uint64_t tickTime = tick * NANOS_PER_TICK;
+    const uint64_t currentTime = getTotalTime();
+    
+    if (tickTime <= currentTime)
     {
         return 0;
     }
+    
+    return tickTime - currentTime;
 }
@@ -15,16 +15,49 @@ public:
     
     void stop();
 
-    void setTickOffset(uint64_t tickOffset);
+    //jumps straight to the given time in nanoseconds
+    //the only way the clock ever goes backwards
+    void setTime(uint64_t time);
+
+    //runs the clock a little faster or slower until it's caught up to the given time in nanoseconds
+    //spread out over slewTime nanoseconds, so it should be about how long until the next adjustment
+    //if it's too far ahead we jump straight to it, too far behind and it holds still until it catches up
+    void adjustTime(uint64_t time, uint64_t slewTime);
+
+    //get the nanoseconds since time started, never less than it returned last time
+    uint64_t getTotalTime() const;
 
     //get the ticks since time started
     uint64_t getTotalTicks() const;
     
+    //how far we are into the current tick, from 0 up to 1
+    float getTickFraction() const;
+    
+    //get the nanoseconds left until the given tick starts, 0 if it already has
+    uint64_t getNanosUntilTick(uint64_t tick) const;
+    
     static constexpr uint64_t TICK_RATE = 64;
+    
+    static constexpr uint64_t NANOS_PER_SECOND = 1000000000;
+    static constexpr uint64_t NANOS_PER_TICK = NANOS_PER_SECOND / TICK_RATE;
+    
+    //anything further off than this gets snapped to instead of slewed
+    static constexpr uint64_t MAX_SLEW_TIME = NANOS_PER_TICK * 4;
 
 private:
     bool enabled;
 
-    //the time when the timer began
+    //the time when the timer began, in nanoseconds
     uint64_t startTime;
+    
+    //the correction that's being worked in, slewError spread evenly from slewStart over slewTime
+    int64_t slewError;
+    uint64_t slewStart;
+    uint64_t slewTime;
+    
+    //what getTotalTime returned last, so it never goes backwards
+    mutable uint64_t lastTime;
+    
+    //how much of the current correction has been worked in by now
+    int64_t getSlewOffset(uint64_t now) const;
 };
@@ -2,6 +2,8 @@
 
 #include <stdexcept>
 #include <algorithm>
+#include <thread>
+#include <chrono>
 
 #include <util/Log.h>
 
@@ -42,6 +44,18 @@ bool NetLoopback::getPacket(const NetSrc& src, NetBuf& buf, NetAddr& fromAddr)
     return true;
 }
 
+size_t NetLoopback::getPackets(const NetSrc& src, std::span<NetBuf> bufs, std::span<NetAddr> fromAddrs)
+{
+    size_t numPackets = 0;
+    while (numPackets < bufs.size() && numPackets < fromAddrs.size() &&
+           getPacket(src, bufs[numPackets], fromAddrs[numPackets]))
+    {
+        numPackets++;
+    }
+    
+    return numPackets;
+}
+
 bool NetLoopback::sendPacket(const NetSrc& src, NetBuf buf, const NetAddr& /*toAddr*/)
 {
     NetLoopbackBuf& loop = getOppositeLoopback(src);
@@ -55,6 +69,24 @@ bool NetLoopback::sendPacket(const NetSrc& src, NetBuf buf, const NetAddr& /*toA
     return true;
 }
 
+void NetLoopback::flushPackets(const NetSrc& /*src*/)
+{
+}
+
+bool NetLoopback::waitForPackets(const NetSrc& src, int timeoutMs)
+{
+    NetLoopbackBuf& loop = getLoopback(src);
+    if (loop.recv < loop.send)
+    {
+        return true;
+    }
+    
+    //both ends live on this thread, so nothing can show up while we wait
+    std::this_thread::sleep_for(std::chrono::milliseconds{ timeoutMs });
+    
+    return false;
+}
+
 NetLoopbackBuf& NetLoopback::getLoopback(const NetSrc& src)
 {
     if (src == NetSrc::Client)
@@ -3,6 +3,7 @@
 #include <array>
 #include <cstdint>
 #include <cstring>
+#include <span>
 
 #include "NetBuf.h"
 
@@ -27,8 +28,19 @@ public:
     NetLoopback& operator=(const NetLoopback&) = delete;
     
     bool getPacket(const NetSrc& src, NetBuf& buf, NetAddr& fromAddr);
+    size_t getPackets(const NetSrc& src, std::span<NetBuf> bufs, std::span<NetAddr> fromAddrs);
+    
     bool sendPacket(const NetSrc& src, NetBuf buf, const NetAddr& toAddr);
     
+    //messages go straight into the other side's buffer, so there's nothing to flush
+    void flushPackets(const NetSrc& src);
+    
+    //blocks until src has a message waiting or the timeout passes
+    //returns true if there's a packet waiting
+    bool waitForPackets(const NetSrc& src, int timeoutMs);
+    
+    static constexpr size_t MAX_PACKET_BATCH = 4;
+    
 private:
     Log& log;
 